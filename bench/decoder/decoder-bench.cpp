@@ -0,0 +1,111 @@
+/// Measure how many functions per second can be decoded, comparing a linear pass with udis86
+/// (which formats every instruction as text), a linear pass with the table-driven decoder, and
+/// full basic block discovery. It also reports how many jump tables block discovery resolved.
+///
+/// Usage: decoder-bench [ELF file]
+/// The file defaults to the C library this program is linked against.
+
+#include <dlfcn.h>
+#include <stdio.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../../runtime/cfg.h"
+#include "../../runtime/decoder.h"
+#include "../../runtime/disassembler.h"
+#include "../../runtime/elf.h"
+#include "../../runtime/util.h"
+
+using std::string;
+using std::vector;
+
+enum {
+  /// Run each benchmark for at least this long
+  MinBenchmarkTime = Time_s / 2
+};
+
+struct function_code {
+  interval range;
+  const uint8_t* code;
+};
+
+/// Run a benchmark over every function until enough time has passed, and report the rate
+static void run(const char* name, const vector<function_code>& functions,
+                std::function<size_t(const function_code&)> fn) {
+  size_t start_time = getTime();
+  size_t passes = 0;
+  size_t count = 0;
+  size_t elapsed;
+  do {
+    for(const function_code& f : functions) {
+      count += fn(f);
+    }
+    passes++;
+    elapsed = getTime() - start_time;
+  } while(elapsed < MinBenchmarkTime);
+  
+  double seconds = (double)elapsed / Time_s;
+  printf("%-12s %12.0f functions/s %14.0f instructions or blocks/s\n", name,
+    passes * functions.size() / seconds, count / seconds);
+}
+
+int main(int argc, char** argv) {
+  string filename;
+  if(argc > 1) {
+    filename = argv[1];
+  } else {
+    Dl_info info;
+    if(dladdr((void*)printf, &info) == 0 || info.dli_fname == NULL) {
+      fprintf(stderr, "Failed to find the C library. Pass an ELF file to benchmark.\n");
+      return 1;
+    }
+    filename = info.dli_fname;
+  }
+  
+  ELFFile* elf = ELFFile::open(filename);
+  if(elf == NULL) {
+    fprintf(stderr, "Failed to open %s\n", filename.c_str());
+    return 1;
+  }
+  
+  function_table table = elf->getFunctions();
+  vector<function_code> functions;
+  for(function_table::function& fn : table.getFunctions()) {
+    const uint8_t* code = elf->getLoadedData(fn.range);
+    if(code != NULL)
+      functions.push_back(function_code{ fn.range, code });
+  }
+  
+  printf("Decoding %lu functions from %s\n", functions.size(), filename.c_str());
+  
+  run("udis86", functions, [](const function_code& f) {
+    size_t n = 0;
+    for(disassembler i(f.code, f.range.getBase(), f.range.getLimit()); !i.done(); i.next()) n++;
+    return n;
+  });
+  
+  run("decoder", functions, [](const function_code& f) {
+    size_t n = 0;
+    for(x86::decoder i(f.code, f.range.getBase(), f.range.getLimit()); !i.done(); i.next()) n++;
+    return n;
+  });
+  
+  cfg::memory_reader read = [elf](interval r) { return elf->getLoadedData(r); };
+  run("findBlocks", functions, [&](const function_code& f) {
+    return cfg::findBlocks(f.range, read).size();
+  });
+  
+  // Only a jump table gives a block more than a fall-through and a branch target
+  size_t tables = 0;
+  for(const function_code& f : functions) {
+    for(const block_info& b : cfg::findBlocks(f.range, read)) {
+      if(b.successors.size() > 2) tables++;
+    }
+  }
+  printf("Resolved %lu jump tables\n", tables);
+  
+  delete elf;
+  return 0;
+}
@@ -0,0 +1,167 @@
+/// Measure the private heap's allocation throughput while threads are created and destroyed
+/// constantly, comparing the shared locked heap with per-thread heaps. Each thread allocates
+/// objects the size of a sample block and a block list node, frees the nodes itself, and hands
+/// the blocks to a consumer thread that frees them, like the profiler thread does.
+///
+/// It also measures the cost of writing samples into a large pool of sample blocks, one block
+/// after another, like the signal handlers of many threads. Set CAUSAL_HUGE_PAGES to compare
+/// the kinds of pages that back the heap.
+///
+/// Usage: heap-bench [threads [rounds [allocations]]]
+/// Each round starts `threads` threads at once and waits for them all to exit.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+#include <random>
+#include <vector>
+
+#include "../../runtime/heap.h"
+#include "../../runtime/sampler.h"
+#include "../../runtime/util.h"
+
+using std::vector;
+
+enum {
+  /// Blocks are handed to the consumer thread in batches of this many
+  BatchSize = 64,
+  /// Sample blocks in the pool that samples are written to
+  PoolBlocks = 2048
+};
+
+CausalHeap& getPrivateHeap() {
+  static char buf[sizeof(CausalHeap)];
+  static CausalHeap* theHeap = new(buf) CausalHeap();
+  return *theHeap;
+}
+
+/// Use the shared heap directly, as the runtime did before it had per-thread heaps
+struct shared_heap {
+  static void attach() {}
+  static void detach() {}
+  static void* malloc(size_t sz) { return getPrivateHeap().malloc(sz); }
+  static void free(void* p) { getPrivateHeap().free(p); }
+};
+
+/// Batches of blocks waiting for the consumer thread
+pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batches_cv = PTHREAD_COND_INITIALIZER;
+vector<vector<void*>> batches;
+bool producing;
+
+size_t allocations_per_thread;
+
+static void submit(vector<void*>& batch) {
+  pthread_mutex_lock(&batches_lock);
+  batches.push_back(vector<void*>());
+  batches.back().swap(batch);
+  pthread_cond_signal(&batches_cv);
+  pthread_mutex_unlock(&batches_lock);
+}
+
+template<class Heap> static void* consumer(void*) {
+  while(true) {
+    vector<vector<void*>> taken;
+    pthread_mutex_lock(&batches_lock);
+    while(batches.empty() && producing) {
+      pthread_cond_wait(&batches_cv, &batches_lock);
+    }
+    taken.swap(batches);
+    bool done = !producing;
+    pthread_mutex_unlock(&batches_lock);
+
+    for(vector<void*>& batch : taken) {
+      for(void* p : batch) {
+        Heap::free(p);
+      }
+    }
+    if(done && taken.empty()) return NULL;
+  }
+}
+
+template<class Heap> static void* producer(void*) {
+  Heap::attach();
+  vector<void*> batch;
+  batch.reserve(BatchSize);
+  for(size_t i = 0; i < allocations_per_thread; i++) {
+    void* block = Heap::malloc(sizeof(SampleBlock));
+    // A list node, allocated and freed on the same thread
+    Heap::free(Heap::malloc(3 * sizeof(void*)));
+    batch.push_back(block);
+    if(batch.size() == BatchSize) submit(batch);
+  }
+  if(batch.size() > 0) submit(batch);
+  Heap::detach();
+  return NULL;
+}
+
+/// Run every round with one kind of heap, and report the allocation rate
+template<class Heap> static void run(const char* name, size_t threads, size_t rounds) {
+  producing = true;
+  pthread_t consumer_thread;
+  pthread_create(&consumer_thread, NULL, consumer<Heap>, NULL);
+
+  size_t start_time = getTime();
+  vector<pthread_t> producers(threads);
+  for(size_t r = 0; r < rounds; r++) {
+    for(pthread_t& t : producers) {
+      pthread_create(&t, NULL, producer<Heap>, NULL);
+    }
+    for(pthread_t& t : producers) {
+      pthread_join(t, NULL);
+    }
+  }
+
+  pthread_mutex_lock(&batches_lock);
+  producing = false;
+  pthread_cond_signal(&batches_cv);
+  pthread_mutex_unlock(&batches_lock);
+  pthread_join(consumer_thread, NULL);
+
+  double seconds = (double)(getTime() - start_time) / Time_s;
+  size_t allocations = 2 * allocations_per_thread * threads * rounds;
+  printf("%-8s %12.0f allocations/s %10.0f threads/s\n", name,
+    allocations / seconds, threads * rounds / seconds);
+}
+
+/// Fill a pool of sample blocks one sample at a time, visiting the blocks in a shuffled order
+/// so nearly every write lands on a different page, and report the time per sample
+static void runFill() {
+  vector<SampleBlock*> pool;
+  for(size_t i = 0; i < PoolBlocks; i++) {
+    pool.push_back(new SampleBlock(SamplerMode::Normal, 0));
+  }
+  std::shuffle(pool.begin(), pool.end(), std::minstd_rand());
+
+  size_t start_time = getTime();
+  for(size_t i = 0; i < BlockSize; i++) {
+    for(SampleBlock* b : pool) {
+      b->add(SampleType::Cycle, i);
+    }
+  }
+  double nanos = (double)(getTime() - start_time) / (PoolBlocks * BlockSize);
+
+  printf("%-8s %12.2f ns/sample %9lu byte pages (%s)\n", "fill", nanos, hugepages::getPageSize(),
+    hugepages::getName(hugepages::getMode()));
+
+  for(SampleBlock* b : pool) {
+    delete b;
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+  size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 200;
+  allocations_per_thread = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+
+  printf("Running %lu rounds of %lu threads, with %lu blocks per thread\n",
+    rounds, threads, allocations_per_thread);
+
+  run<shared_heap>("shared", threads, rounds);
+  run<ThreadHeap>("thread", threads, rounds);
+  runFill();
+  return 0;
+}
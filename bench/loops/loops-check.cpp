@@ -0,0 +1,91 @@
+/// Check loop discovery on hand-built control flow graphs: a nested loop, two back edges that
+/// share a header, an irreducible cycle, and blocks that can't be reached from the entry.
+/// Each case lists the expected loops by header, body, parent, and depth.
+///
+/// Usage: loops-check
+/// Exits with a nonzero status if any case finds different loops.
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "../../runtime/loops.h"
+
+using std::string;
+using std::vector;
+
+/// Build a function's blocks from their successor lists. Block 0 is the entry.
+static vector<block_info> makeBlocks(const vector<vector<uint32_t>>& successors) {
+  vector<block_info> blocks;
+  for(size_t b = 0; b < successors.size(); b++) {
+    uintptr_t base = 0x1000 + b * 0x10;
+    blocks.push_back(block_info{ interval(base, base + 0x10), b == 0, 1, successors[b] });
+  }
+  return blocks;
+}
+
+static string toString(const loop_info& l) {
+  string s = "header " + std::to_string(l.header) + " blocks {";
+  for(size_t i = 0; i < l.blocks.size(); i++) {
+    s += (i > 0 ? "," : "") + std::to_string(l.blocks[i]);
+  }
+  return s + "} parent " + std::to_string(l.parent) + " depth " + std::to_string(l.depth);
+}
+
+/// Run findLoops on one graph and compare every loop with the expected ones, in order
+static bool check(const char* name, const vector<vector<uint32_t>>& successors,
+                  const vector<loop_info>& expected) {
+  vector<loop_info> found = loops::findLoops(makeBlocks(successors));
+
+  bool ok = found.size() == expected.size();
+  for(size_t i = 0; ok && i < found.size(); i++) {
+    ok = found[i].header == expected[i].header && found[i].blocks == expected[i].blocks &&
+         found[i].parent == expected[i].parent && found[i].depth == expected[i].depth;
+  }
+
+  printf("%-16s %s\n", name, ok ? "ok" : "FAILED");
+  if(!ok) {
+    for(const loop_info& l : expected) printf("  expected %s\n", toString(l).c_str());
+    for(const loop_info& l : found) printf("  found    %s\n", toString(l).c_str());
+  }
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  bool ok = true;
+
+  // 0 -> 1 (outer header) -> 2 (inner header) -> 3 -> back to 2, or on to 4 -> back to 1.
+  // 1 exits to 5.
+  ok &= check("nested", {
+    { 1 }, { 2, 5 }, { 3 }, { 2, 4 }, { 1 }, {}
+  }, {
+    loop_info{ 1, { 1, 2, 3, 4 }, -1, 1 },
+    loop_info{ 2, { 2, 3 }, 0, 2 }
+  });
+
+  // Two latches, 2 and 3, both branch back to the header 1. They form one loop.
+  ok &= check("shared header", {
+    { 1 }, { 2, 3 }, { 1 }, { 1, 4 }, {}
+  }, {
+    loop_info{ 1, { 1, 2, 3 }, -1, 1 }
+  });
+
+  // The entry branches into both 1 and 2, which branch to each other. Neither dominates the
+  // other, so the cycle has no header. The loop 3 -> 4 -> 3 after it is still found.
+  ok &= check("irreducible", {
+    { 1, 2 }, { 2 }, { 1, 3 }, { 4 }, { 3, 5 }, {}
+  }, {
+    loop_info{ 3, { 3, 4 }, -1, 1 }
+  });
+
+  // Block 4 can't be reached, but branches into the latch 2. Blocks 5 and 6 form a cycle that
+  // can't be reached. Neither is part of any loop.
+  ok &= check("unreachable", {
+    { 1 }, { 2, 3 }, { 1 }, {}, { 2 }, { 6 }, { 5 }
+  }, {
+    loop_info{ 1, { 1, 2 }, -1, 1 }
+  });
+
+  return ok ? 0 : 1;
+}
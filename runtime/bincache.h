@@ -0,0 +1,79 @@
+#if !defined(CAUSAL_RUNTIME_BINCACHE_H)
+#define CAUSAL_RUNTIME_BINCACHE_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "bins.h"
+#include "interval.h"
+
+enum {
+  BinCacheSize = 4096
+};
+
+/// A direct-mapped cache of resolved sample bins, keyed on the exact program counter.
+/// Block boundaries are byte-granular, so entries can't be shared between nearby PCs.
+class BinCache {
+private:
+  struct entry {
+    uintptr_t pc;
+    SampleBin* bin;
+  };
+
+  entry _entries[BinCacheSize];
+  size_t _hits = 0;
+  size_t _misses = 0;
+  size_t _invalidations = 0;
+
+  /// Mix in some higher bits so hot code in different pages doesn't always collide
+  static size_t index(uintptr_t pc) {
+    return (pc ^ (pc >> 12)) % BinCacheSize;
+  }
+
+public:
+  BinCache() {
+    memset(_entries, 0, sizeof(_entries));
+  }
+
+  /// Look up the bin for a PC. Returns NULL on a miss.
+  SampleBin* find(uintptr_t pc) {
+    entry& e = _entries[index(pc)];
+    if(e.pc == pc && e.bin != NULL) {
+      _hits++;
+      return e.bin;
+    }
+    _misses++;
+    return NULL;
+  }
+
+  /// Record the resolved bin for a PC, replacing whatever was in its slot
+  void insert(uintptr_t pc, SampleBin* bin) {
+    entry& e = _entries[index(pc)];
+    e.pc = pc;
+    e.bin = bin;
+  }
+
+  /// Drop all cached entries for PCs in a range (e.g. when a function is split into blocks)
+  void invalidate(interval r) {
+    for(entry& e : _entries) {
+      if(e.bin != NULL && r.contains(e.pc)) {
+        e.pc = 0;
+        e.bin = NULL;
+      }
+    }
+    _invalidations++;
+  }
+
+  /// Drop all cached entries
+  void clear() {
+    memset(_entries, 0, sizeof(_entries));
+    _invalidations++;
+  }
+
+  // Accessors for cache statistics
+  size_t getHits() const { return _hits; }
+  size_t getMisses() const { return _misses; }
+  size_t getInvalidations() const { return _invalidations; }
+};
+
+#endif
@@ -3,9 +3,10 @@
 
 #include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
-#include "disassembler.h"
 #include "interval.h"
 #include "sampler.h"
 
@@ -25,6 +26,11 @@ public:
     else
       _inst_samples++;
   }
+  /// Add all of another bin's samples to this one
+  void addSamples(const SampleBin& b) {
+    _cycle_samples += b._cycle_samples;
+    _inst_samples += b._inst_samples;
+  }
   // Accessors for sample counters
   size_t getCycleSamples() const { return _cycle_samples; }
   size_t getInstructionSamples() const { return _inst_samples; }
@@ -34,26 +40,23 @@ class BasicBlock : public SampleBin {
 private:
   interval _range;
   bool _entry;
-  size_t _length = 1;
+  size_t _length;
+  /// Successor blocks, as indices into the function's block list
+  std::vector<uint32_t> _successors;
+  /// Index of the innermost loop containing this block in the function's loop list, or -1
+  int _loop = -1;
 public:
-  BasicBlock(interval range, bool entry) : _range(range), _entry(entry) {
-    // Count instructions
-    for(disassembler i(range); !i.done() && !i.branches() && i.fallsThrough(); i.next()) {
-      _length++;
-    }
-  }
+  /// Create a block with a known instruction count and successors
+  BasicBlock(interval range, bool entry, size_t length, const std::vector<uint32_t>& successors) :
+    _range(range), _entry(entry), _length(length), _successors(successors) {}
   
   const interval& getRange() const { return _range; }
   bool isEntryBlock() const { return _entry; }
   size_t getLength() const { return _length; }
+  const std::vector<uint32_t>& getSuccessors() const { return _successors; }
   
-  /// Split this block at the given pointer and return the new successor block
-  BasicBlock split(uintptr_t p) {
-    BasicBlock b(interval(p, _range.getLimit()), false); // Split off a new block starting at p
-    _length -= b.getLength(); // Decrease the instruction count by the length of the new block
-    _range = interval(_range.getBase(), p); // Update this block's range
-    return b;
-  }
+  int getLoop() const { return _loop; }
+  void setLoop(int loop) { _loop = loop; }
   
   void print(ostream& os) const {
     os << _range << "\t" << getLength() << "\t" << getCycleSamples() << "\t" << getInstructionSamples();
@@ -65,19 +68,86 @@ static ostream& operator<<(ostream& os, const BasicBlock& b) {
   return os;
 }
 
+/// A natural loop in a function. Its samples are the totals of the blocks in its body.
+class Loop : public SampleBin {
+private:
+  interval _header;
+  std::vector<interval> _blocks;
+  int _parent;
+  size_t _depth;
+public:
+  Loop(interval header, int parent, size_t depth) : _header(header), _parent(parent), _depth(depth) {}
+  
+  /// Add a block to the loop body. Blocks must be added in address order.
+  void addBlock(interval range) { _blocks.push_back(range); }
+  
+  const interval& getHeader() const { return _header; }
+  const std::vector<interval>& getBlocks() const { return _blocks; }
+  /// Index of the enclosing loop in the function's loop list, or -1 for outermost loops
+  int getParent() const { return _parent; }
+  size_t getDepth() const { return _depth; }
+  
+  /// Get the address ranges covered by the loop body, merging adjacent blocks
+  std::vector<interval> getRanges() const {
+    std::vector<interval> ranges;
+    for(const interval& b : _blocks) {
+      if(ranges.size() > 0 && ranges.back().getLimit() == b.getBase())
+        ranges.back() = interval(ranges.back().getBase(), b.getLimit());
+      else
+        ranges.push_back(b);
+    }
+    return ranges;
+  }
+  
+  void print(ostream& os) const {
+    os << _header << "\t" << _depth << "\t" << _blocks.size() << "\t" 
+       << getCycleSamples() << "\t" << getInstructionSamples();
+  }
+};
+
+static ostream& operator<<(ostream& os, const Loop& l) {
+  l.print(os);
+  return os;
+}
+
+/// Samples at one raw program counter, kept for offline symbolization
+class PCBin : public SampleBin {
+private:
+  /// A time when the file these samples belong to was loaded. It places the PC in the right
+  /// file when different files were loaded at the same address during the run.
+  size_t _time;
+public:
+  PCBin(size_t time) : _time(time) {}
+  size_t getTime() const { return _time; }
+};
+
+class File;
+
 class Function : public SampleBin {
 private:
-  std::string _name;
+  const char* _name;
+  std::vector<const char*> _aliases;
+  const char* _source = NULL;
   interval _range;
   uintptr_t _load_offset;
+  File* _file;
   bool _processed;
 public:
-  Function(const std::string name, interval range, uintptr_t load_offset) :
-    _name(name), _range(range), _load_offset(load_offset), _processed(false) {}
+  /// Names are borrowed from the symbol sources held by the function's file
+  Function(const char* name, interval range, uintptr_t load_offset, File* file) :
+    _name(name), _range(range), _load_offset(load_offset), _file(file), _processed(false) {}
     
-  const std::string& getName() const { return _name; }
+  const char* getName() const { return _name; }
+  const std::vector<const char*>& getAliases() const { return _aliases; }
+  void addAlias(const char* alias) { _aliases.push_back(alias); }
+  /// Get the source file the function was compiled from, or NULL if it isn't known
+  const char* getSource() const { return _source; }
+  void setSource(const char* source) { _source = source; }
   interval getRange() const { return _range; }
   interval getLoadedRange() const { return _range + _load_offset; }
+  uintptr_t getLoadOffset() const { return _load_offset; }
+  File* getFile() const { return _file; }
+  void setFile(File* file) { _file = file; }
   
   // Mark the function as processed when its basic blocks have been identified
   bool isProcessed() const { return _processed; }
@@ -88,12 +158,39 @@ class File : public SampleBin {
 private:
   std::string _name;
   interval _range;
+  uintptr_t _load_offset;
+  std::string _build_id;
+  /// Mapped files (ELF images, debug files, or symbol caches) that function names point into
+  std::vector<std::shared_ptr<const void>> _symbol_sources;
+  bool _loaded;
+  bool _dirty;
+  bool _filtered;
 public:
-  File(const std::string name, interval range) :
-    _name(name), _range(range) {}
+  File(const std::string name, interval range, uintptr_t load_offset) :
+    _name(name), _range(range), _load_offset(load_offset), _loaded(false), _dirty(false), _filtered(false) {}
     
   const std::string& getName() const { return _name; };
   interval getRange() const { return _range; }
+  uintptr_t getLoadOffset() const { return _load_offset; }
+  
+  /// Keep a mapped file open as long as this file's functions may use its names
+  void addSymbolSource(std::shared_ptr<const void> source) { _symbol_sources.push_back(source); }
+  
+  const std::string& getBuildID() const { return _build_id; }
+  void setBuildID(const std::string& build_id) { _build_id = build_id; }
+  
+  // Mark the file as loaded when its function symbols have been read
+  bool isLoaded() const { return _loaded; }
+  void setLoaded() { _loaded = true; }
+  
+  // Mark the file as dirty when it has symbols or blocks that aren't in the symbol cache
+  bool isDirty() const { return _dirty; }
+  void setDirty() { _dirty = true; }
+  
+  // Mark the file as filtered when scope filters left out some of its functions, so its
+  // incomplete function list is never saved in the symbol cache
+  bool isFiltered() const { return _filtered; }
+  void setFiltered() { _filtered = true; }
 };
 
 #endif
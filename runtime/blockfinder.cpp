@@ -0,0 +1,144 @@
+#include "blockfinder.h"
+
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+#include "loader.h"
+#include "log.h"
+#include "overhead.h"
+#include "real.h"
+#include "util.h"
+
+using std::deque;
+using std::vector;
+
+namespace blockfinder {
+  /// Protects the job queues and the running flag
+  pthread_mutex_t jobs_mtx = PTHREAD_MUTEX_INITIALIZER;
+  /// Signaled when a job is queued or the workers should exit
+  pthread_cond_t jobs_cv = PTHREAD_COND_INITIALIZER;
+  /// Protects the result list. Only held briefly, and never waited on by the profiler thread.
+  pthread_mutex_t results_mtx = PTHREAD_MUTEX_INITIALIZER;
+  
+  deque<interval> urgent_jobs;
+  deque<interval> background_jobs;
+  deque<result> results;
+  vector<pthread_t> workers;
+  bool running = false;
+  
+  vector<block_info> findBlocks(interval range) {
+    overhead::timer t(overhead::Blocks);
+    // Code is read in place. Jump tables are only read if they are inside a loaded file.
+    return cfg::findBlocks(range, [](interval r) -> const uint8_t* {
+      return loader::isReadable(r) ? reinterpret_cast<const uint8_t*>(r.getBase()) : NULL;
+    });
+  }
+  
+  /// Wait for the next job. Returns false when the workers should exit.
+  static bool getJob(interval& range) {
+    pthread_mutex_lock(&jobs_mtx);
+    while(running && urgent_jobs.empty() && background_jobs.empty()) {
+      pthread_cond_wait(&jobs_cv, &jobs_mtx);
+    }
+    
+    bool found = running;
+    if(found) {
+      deque<interval>& q = urgent_jobs.empty() ? background_jobs : urgent_jobs;
+      range = q.front();
+      q.pop_front();
+    }
+    
+    pthread_mutex_unlock(&jobs_mtx);
+    return found;
+  }
+  
+  static bool isRunning() {
+    pthread_mutex_lock(&jobs_mtx);
+    bool result = running;
+    pthread_mutex_unlock(&jobs_mtx);
+    return result;
+  }
+  
+  static void* worker(void* arg) {
+    interval range;
+    while(getJob(range)) {
+      result r;
+      r.range = range;
+      
+      // Code can't be read while a library is being unloaded, so wait for the unload to finish
+      loader::lockMappings();
+      while(loader::isUnloading() && isRunning()) {
+        loader::unlockMappings();
+        wait(Time_ms);
+        loader::lockMappings();
+      }
+      
+      // The job is dropped if the workers were stopped while waiting
+      if(loader::isUnloading()) {
+        loader::unlockMappings();
+        continue;
+      }
+      
+      // No library can be unloaded while the mappings are locked, so the generation identifies the code that was read
+      r.generation = loader::getGeneration();
+      r.blocks = findBlocks(range);
+      loader::unlockMappings();
+      
+      pthread_mutex_lock(&results_mtx);
+      results.push_back(std::move(r));
+      pthread_mutex_unlock(&results_mtx);
+    }
+    return NULL;
+  }
+  
+  void start(size_t threads) {
+    running = true;
+    for(size_t i = 0; i < threads; i++) {
+      pthread_t t;
+      // Use the real pthread_create so workers aren't sampled
+      if(Real::pthread_create()(&t, NULL, worker, NULL) == 0) {
+        workers.push_back(t);
+      } else {
+        WARNING("Failed to create block finder thread");
+      }
+    }
+  }
+  
+  void submit(interval range, bool urgent) {
+    pthread_mutex_lock(&jobs_mtx);
+    if(urgent) urgent_jobs.push_back(range);
+    else background_jobs.push_back(range);
+    pthread_cond_signal(&jobs_cv);
+    pthread_mutex_unlock(&jobs_mtx);
+  }
+  
+  bool getResult(result& r) {
+    if(pthread_mutex_trylock(&results_mtx) != 0)
+      return false;
+    
+    bool found = !results.empty();
+    if(found) {
+      r = std::move(results.front());
+      results.pop_front();
+    }
+    
+    pthread_mutex_unlock(&results_mtx);
+    return found;
+  }
+  
+  void stop() {
+    pthread_mutex_lock(&jobs_mtx);
+    running = false;
+    urgent_jobs.clear();
+    background_jobs.clear();
+    pthread_cond_broadcast(&jobs_cv);
+    pthread_mutex_unlock(&jobs_mtx);
+    
+    for(pthread_t t : workers) {
+      pthread_join(t, NULL);
+    }
+    workers.clear();
+  }
+}
@@ -0,0 +1,36 @@
+#if !defined(CAUSAL_RUNTIME_BLOCKFINDER_H)
+#define CAUSAL_RUNTIME_BLOCKFINDER_H
+
+#include <vector>
+
+#include "cfg.h"
+#include "interval.h"
+
+/// A pool of worker threads that find basic blocks in the background, so the profiler thread
+/// never stalls disassembling a large function. Results are picked up by polling.
+namespace blockfinder {
+  /// The basic blocks found for one function
+  struct result {
+    interval range;     ///< The function's loaded range
+    size_t generation;  ///< The loader generation when the code was read
+    std::vector<block_info> blocks;
+  };
+  
+  /// Find the basic blocks of a loaded function in the current thread. The caller must hold
+  /// the mappings lock. Returns no blocks if the function's code isn't mapped.
+  std::vector<block_info> findBlocks(interval range);
+  
+  /// Start the worker threads
+  void start(size_t threads);
+  
+  /// Queue a function. Urgent functions (ones that already have samples) are processed first.
+  void submit(interval range, bool urgent);
+  
+  /// Take a finished result, if one is available. Never blocks.
+  bool getResult(result& r);
+  
+  /// Stop the workers and wait for them to exit. Jobs that haven't started are dropped.
+  void stop();
+}
+
+#endif
@@ -1,29 +1,73 @@
 #if !defined(CAUSAL_RUNTIME_CAUSAL_H)
 #define CAUSAL_RUNTIME_CAUSAL_H
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
+#include <list>
 #include <map>
+#include <memory>
 #include <new>
-#include <set>
-#include <stack>
+#include <random>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "bincache.h"
 #include "bins.h"
+#include "blockfinder.h"
+#include "cfg.h"
+#include "control.h"
 #include "counter.h"
-#include "disassembler.h"
 #include "elf.h"
+#include "hugepages.h"
+#include "loader.h"
 #include "log.h"
+#include "loops.h"
+#include "options.h"
 #include "output.h"
+#include "overhead.h"
 #include "papi.h"
 #include "real.h"
 #include "sampler.h"
+#include "scope.h"
+#include "stats.h"
+#include "symcache.h"
+#include "timing.h"
 #include "util.h"
 
 enum {
   CycleSamplePeriod = 10000000,
-  InstructionSamplePeriod = 500011
+  InstructionSamplePeriod = 500011,
+  /// Length of each speedup experiment, and of the idle period that follows it
+  ExperimentDuration = Time_s,
+  /// Delay inserted in other threads for each sample in the sped-up code
+  ExperimentDelaySize = Time_ms,
+  /// How often the profiler thread checks for timed work when no samples arrive
+  ProfilerPollInterval = 100 * Time_ms
+};
+
+/// Bins for a file that was unloaded, kept so its samples still appear in the output
+struct RetiredFile {
+  File file;
+  map<interval, Function> functions;
+  map<interval, BasicBlock> blocks;
+  map<interval, vector<Loop>> loops;
+  /// Raw PC samples in the file, for offline mode
+  std::unordered_map<uintptr_t, PCBin> pcs;
+  /// The time the profiler thread noticed the file was unloaded
+  size_t time;
+  
+  RetiredFile(const File& file, size_t time) : file(file), time(time) {}
+};
+
+/// Samples from one thread, for the live statistics
+struct ThreadSamples {
+  size_t samples = 0;
+  /// The sample count when the current rate interval started
+  size_t interval_samples = 0;
+  size_t rate = 0;
 };
 
 class Causal {
@@ -31,15 +75,79 @@ private:
   bool _initialized;
   pthread_t _profiler_thread;
   
+  /// Directory for the persistent symbol cache, or NULL if the cache is disabled
+  const char* _cache_dir;
+  /// Root directory for separate debug files
+  const char* _debug_dir;
+  /// If set, only raw PCs are recorded. Symbols and blocks are found later by causal-symbolize.
+  bool _offline;
+  /// Number of background threads finding basic blocks, or zero to find them on demand
+  size_t _block_threads;
+  
   Output* _output;
+  /// Output format, "text" or "binary"
+  const char* _output_format;
+  std::string _output_path;
+  /// The profiled process, recorded with each run
+  RunInfo _run;
+  /// Number of threads that have started sampling
+  size_t _threads = 0;
+  /// Time between snapshots of the profile, or zero if snapshots are disabled
+  size_t _snapshot_interval;
+  size_t _next_snapshot;
+  /// Set if commands are accepted on a control socket
+  bool _control = false;
+  /// Samples the profiler thread has attributed
+  size_t _samples = 0;
+  /// Shared memory for live statistics, or NULL if they aren't published
+  stats::segment* _stats = NULL;
+  std::string _stats_path;
+  size_t _next_stats = 0;
+  /// Start of the interval per-thread sample rates are measured over
+  size_t _rate_start = 0;
+  map<pid_t, ThreadSamples> _thread_samples;
+  /// Limits the files and functions that are symbolized and sampled
+  ScopeFilter _filter;
   
   SampleBin _orphan;
+  /// Returned for samples in functions whose blocks are still being found in the background
+  SampleBin _deferred;
+  /// Samples waiting for their function's blocks, by function range
+  map<interval, vector<Sample>> _deferred_samples;
   map<interval, File> _files;
   map<interval, Function> _functions;
   map<interval, BasicBlock> _blocks;
+  /// Loops in each function, by function range
+  map<interval, vector<Loop>> _loops;
+  std::list<RetiredFile> _retired;
+  /// Samples by raw program counter, for offline mode
+  std::unordered_map<uintptr_t, PCBin> _pcs;
+  
+  /// The loader generation when the file map was last updated
+  size_t _mappings_generation;
+  
+  BinCache _bin_cache;
   
   vector<Counter*> _progress_counters;
   
+  /// Speed up loop bodies in experiments, not just single blocks
+  bool _experiment_loops;
+  /// Set if speedup experiments are enabled
+  bool _experiments;
+  bool _experiment_running = false;
+  size_t _experiment_start = 0;
+  /// The earliest time the next experiment can start
+  size_t _next_experiment = 0;
+  /// Progress counter values when the running experiment started
+  vector<size_t> _experiment_counters;
+  Experiment _experiment;
+  vector<Experiment> _experiment_results;
+  std::minstd_rand _experiment_rng;
+  /// Limits experiments to a function or file when set by a control command. The kind is
+  /// "function" or "file", or empty if experiments can target any code.
+  std::string _scope_kind;
+  std::string _scope_name;
+  
 	Causal() : _initialized(false) {
     initialize();
 	}
@@ -65,8 +173,7 @@ private:
         return NULL;
       } else {
         // Function hasn't been disassembled yet. Process it
-        findBlocks(fn->second.getLoadedRange());
-        fn->second.setProcessed();
+        processFunction(fn->second);
         // Can we find a block now?
         b = _blocks.find(p);
         if(b != _blocks.end()) return &b->second;
@@ -77,7 +184,59 @@ private:
     }
   }
   
-  SampleBin& getBin(uintptr_t p) {
+  /// Get the bin for a sample at p, collected in a sample block that started at the given time
+  SampleBin& getBin(uintptr_t p, size_t time) {
+    // Check the cache of recently resolved PCs first
+    SampleBin* cached = _bin_cache.find(p);
+    if(cached != NULL) return *cached;
+    
+    SampleBin& bin = findBin(p);
+    
+    // The sample may be from a file that was unloaded after it was collected.
+    // Those bins depend on the sample time, so they are never cached.
+    if(&bin == &_orphan) return findRetiredBin(p, time);
+    // Deferred samples will be looked up again once their blocks are found
+    if(&bin == &_deferred) return bin;
+    
+    _bin_cache.insert(p, &bin);
+    return bin;
+  }
+  
+  /// Find the first file retired after the sample block started that contains p
+  RetiredFile* findRetiredFile(uintptr_t p, size_t time) {
+    for(RetiredFile& r : _retired) {
+      if(r.time >= time && r.file.getRange().contains(p)) return &r;
+    }
+    return NULL;
+  }
+  
+  SampleBin& findRetiredBin(uintptr_t p, size_t time) {
+    RetiredFile* r = findRetiredFile(p, time);
+    if(r == NULL) return _orphan;
+    
+    map<interval, BasicBlock>::iterator b = r->blocks.find(p);
+    if(b != r->blocks.end()) return b->second;
+    
+    map<interval, Function>::iterator fn = r->functions.find(p);
+    if(fn != r->functions.end()) return fn->second;
+    
+    return r->file;
+  }
+  
+  /// Count a sample by raw PC in offline mode. Samples go to the file they would be attributed
+  /// to online: a live file if one contains the PC, or else the first file retired after the
+  /// sample block started. Each PC keeps the time it was first counted, which falls inside the
+  /// lifetime of its file, so the symbolizer can find the same file.
+  void addRawSample(const Sample& s, size_t now, size_t block_time) {
+    if(_files.find(s.address) != _files.end()) {
+      _pcs.emplace(s.address, PCBin(now)).first->second.addSample(s.type);
+    } else {
+      RetiredFile* r = findRetiredFile(s.address, block_time);
+      if(r != NULL) r->pcs.emplace(s.address, PCBin(block_time)).first->second.addSample(s.type);
+    }
+  }
+  
+  SampleBin& findBin(uintptr_t p) {
     // Try to find a matching block. If one exists, return immediately
     map<interval, BasicBlock>::iterator b = _blocks.find(p);
     if(b != _blocks.end()) return b->second;
@@ -89,10 +248,22 @@ private:
         // If the function has already been processed, then we're not going to find a block
         // Just return the function.
         return fn->second;
+      } else if(_block_threads > 0) {
+        // Blocks are found in the background. Hold on to the samples until they're ready,
+        // and move the function to the front of the queue when its first sample arrives.
+        interval range = fn->second.getLoadedRange();
+        if(_deferred_samples.find(range) == _deferred_samples.end()) {
+          _deferred_samples.emplace(range, vector<Sample>());
+          blockfinder::submit(range, true);
+        }
+        return _deferred;
+      } else if(loader::isUnloading()) {
+        // Code may be unmapped until the unload finishes. Hold on to the samples until then.
+        _deferred_samples.emplace(fn->second.getLoadedRange(), vector<Sample>());
+        return _deferred;
       } else {
         // Function hasn't been disassembled yet. Process it
-        findBlocks(fn->second.getLoadedRange());
-        fn->second.setProcessed();
+        processFunction(fn->second);
         // Can we find a block now?
         b = _blocks.find(p);
         if(b != _blocks.end()) return b->second;
@@ -102,155 +273,897 @@ private:
     
     // No luck finding a function either. Check for a known file
     map<interval, File>::iterator f = _files.find(p);
-    // If found, return the file. Otherwise return the default orphan bin
-    if(f != _files.end()) return f->second;
-    else return _orphan;
+    // If not found, return the default orphan bin
+    if(f == _files.end()) return _orphan;
+    
+    // If the file's symbols haven't been loaded yet, load them and try again
+    if(!f->second.isLoaded()) {
+      loadFunctions(f->second);
+      if(_filter.hasFunctionFilters()) updateScope();
+      return findBin(p);
+    }
+    
+    // Return the file
+    return f->second;
   }
   
   void profiler() {
+    // Wake up periodically if there is work to do even when no samples arrive
+    size_t timeout = (_experiments || _snapshot_interval > 0 || _control || _stats != NULL) ? ProfilerPollInterval : 0;
+    
     while(true) {
-      SampleBlock* block = sampler::getNextBlock();
+      // Wake up soon enough to switch to the timestamp counter without waiting for samples
+      size_t wait = timing::isCalibrating() ? (size_t)timing::CalibrationTime : timeout;
+      SampleBlock* block = sampler::getNextBlock(wait);
       
-      if(block == NULL)
+      if(block == NULL && sampler::isFinished())
         return;
       
-      /*if(block->getCount() > 0) {
-        BasicBlock* b = getBlock(block->get(0).address);
-        if(b != NULL) {
-          INFO("Idle time end: %lu\n", getTime());
-          INFO("Speeding up range %p-%p", 
-            (void*)b->getRange().getBase(), (void*)b->getRange().getLimit());
-          printCounters();
-          sampler::startSpeedup(b->getRange(), Time_ms);
-          size_t elapsed = wait(Time_s);
-          printCounters();
-          size_t delays = sampler::reset();
-          INFO("Inserted %lu delays in %fms", delays, (float)elapsed / Time_ms);
-          INFO("Idle time start: %lu\n", getTime());
-          wait(Time_s);
-        }
-      }*/
+      overhead::timer t(overhead::Profiler);
+      
+      if(timing::finishCalibration())
+        INFO("Measuring time with the %s clock", timing::getSource());
+      
+      // Keep code mapped while samples are attributed, since that may disassemble functions
+      loader::lockMappings();
       
-      for(Sample& s : block->getSamples()) {
-        getBin(s.address).addSample(s.type);
+      // Pick up any files loaded or unloaded since the last block
+      if(loader::getGeneration() != _mappings_generation) {
+        updateFiles();
+        if(_filter.isActive()) updateScope();
+      }
+      
+      // Free scope ranges that were replaced while a handler was reading them
+      if(_filter.isActive()) sampler::reclaimScopes();
+      
+      if(_offline) {
+        if(block != NULL) {
+          size_t now = getTime();
+          for(Sample& s : block->getSamples()) {
+            addRawSample(s, now, block->getStartTime());
+          }
+        }
+      } else {
+        installBlocks();
+        
+        // Find the blocks that samples collected during an unload are waiting for
+        if(_block_threads == 0 && !loader::isUnloading())
+          processDeferred();
+        
+        if(block != NULL) {
+          for(Sample& s : block->getSamples()) {
+            SampleBin& bin = getBin(s.address, block->getStartTime());
+            if(&bin == &_deferred) _deferred_samples.find(s.address)->second.push_back(s);
+            else bin.addSample(s.type);
+          }
+        }
+        
+        if(_experiments)
+          updateExperiment(block);
       }
       
+      loader::unlockMappings();
+      
+      if(block != NULL) {
+        _samples += block->getCount();
+        _thread_samples[block->getThread()].samples += block->getCount();
+      }
       delete block;
+      
+      // Snapshots only read the profiler's own bins, so they don't hold up the loader
+      if(_snapshot_interval > 0 && getTime() >= _next_snapshot) {
+        writeSnapshot();
+        _next_snapshot = getTime() + _snapshot_interval;
+      }
+      
+      std::string command;
+      if(_control && control::getCommand(command))
+        control::reply(runCommand(command));
+      
+      if(_stats != NULL && getTime() >= _next_stats) {
+        publishStats(false);
+        _next_stats = getTime() + ProfilerPollInterval;
+      }
     }
   }
   
+  /// Update the live statistics. Per-thread sample rates are measured over about a second.
+  void publishStats(bool finished) {
+    size_t now = getTime();
+    if(now - _rate_start >= Time_s) {
+      for(auto& t : _thread_samples) {
+        t.second.rate = (t.second.samples - t.second.interval_samples) * Time_s / (now - _rate_start);
+        t.second.interval_samples = t.second.samples;
+      }
+      _rate_start = now;
+    }
+    
+    stats::segment* s = _stats;
+    stats::beginWrite(s);
+    
+    s->start_time = _run.start_time;
+    s->update_time = getWallTime();
+    s->finished = finished;
+    s->paused = sampler::isPaused();
+    s->samples = _samples;
+    s->dropped_samples = sampler::getDroppedSamples();
+    s->filtered_samples = sampler::getFilteredSamples();
+    s->pending_blocks = sampler::getPendingBlocks();
+    s->deferred_functions = _deferred_samples.size();
+    s->experiments = _experiment_results.size();
+    
+    stats::experiment_record& e = s->experiment;
+    e.running = _experiment_running;
+    if(_experiment_running) {
+      e.start_time = s->update_time - (now - _experiment_start);
+      e.base = _experiment.range.getBase();
+      e.limit = _experiment.range.getLimit();
+      strncpy(e.kind, _experiment.kind, sizeof(e.kind) - 1);
+      stats::setName(e.function, _experiment.function);
+      stats::setName(e.file, _experiment.file);
+    }
+    
+    s->counter_count = 0;
+    for(Counter* c : _progress_counters) {
+      if(s->counter_count == stats::MaxCounters) break;
+      stats::counter_record& r = s->counters[s->counter_count++];
+      stats::setName(r.name, std::string(c->getFile()) + ":" + std::to_string(c->getLine()));
+      r.value = c->getValue();
+    }
+    
+    s->thread_count = 0;
+    for(const auto& t : _thread_samples) {
+      if(s->thread_count == stats::MaxThreads) break;
+      stats::thread_record& r = s->threads[s->thread_count++];
+      r.tid = t.first;
+      r.samples = t.second.samples;
+      r.rate = t.second.rate;
+    }
+    
+    stats::endWrite(s);
+  }
+  
+  /// Run a command from the control socket and return the reply. Commands run on the profiler
+  /// thread between sample blocks, so they can read and change the profiler's state directly.
+  std::string runCommand(const std::string& line) {
+    // Split the command into its first word and the rest of the line
+    size_t split = line.find(' ');
+    std::string name = line.substr(0, split);
+    std::string arg;
+    if(split != std::string::npos && line.find_first_not_of(' ', split) != std::string::npos)
+      arg = line.substr(line.find_first_not_of(' ', split));
+    
+    if(name == "pause") {
+      sampler::pause();
+      // A running experiment would measure the pause, so it is discarded
+      if(_experiment_running) {
+        sampler::reset();
+        _experiment_running = false;
+      }
+      INFO("Paused sampling");
+      return "ok\n";
+      
+    } else if(name == "resume") {
+      sampler::resume();
+      INFO("Resumed sampling");
+      return "ok\n";
+      
+    } else if(name == "scope") {
+      if(!_experiments)
+        return "error: experiments are disabled\n";
+      
+      size_t s = arg.find(' ');
+      std::string kind = arg.substr(0, s);
+      std::string target = s == std::string::npos ? "" : arg.substr(s + 1);
+      if(kind == "clear" && target.empty()) {
+        _scope_kind.clear();
+        _scope_name.clear();
+      } else if((kind == "function" || kind == "file") && !target.empty()) {
+        _scope_kind = kind;
+        _scope_name = target;
+      } else {
+        return "error: usage: scope function <name> | scope file <path> | scope clear\n";
+      }
+      
+      // Finish the running experiment early so the next one respects the new scope
+      if(_experiment_running)
+        finishExperiment(getTime());
+      return "ok\n";
+      
+    } else if(name == "dump") {
+      if(arg.empty()) {
+        if(!writeSnapshot())
+          return "error: failed to write " + _output_path + ".snapshot\n";
+        return "wrote " + _output_path + ".snapshot\n";
+      }
+      
+      Output* out = Output::open(_output_format, arg, false, "test", CycleSamplePeriod, InstructionSamplePeriod);
+      if(out == NULL)
+        return "error: failed to open " + arg + "\n";
+      overhead::timer t(overhead::Output);
+      writeProfile(*out);
+      delete out;
+      return "wrote " + arg + "\n";
+      
+    } else if(name == "stats") {
+      std::string result;
+      auto add = [&](const char* key, const std::string& value) {
+        result += key;
+        result += " ";
+        result += value;
+        result += "\n";
+      };
+      
+      add("paused", sampler::isPaused() ? "yes" : "no");
+      add("clock", timing::getSource());
+      add("threads", std::to_string(__atomic_load_n(&_threads, __ATOMIC_SEQ_CST)));
+      add("samples", std::to_string(_samples));
+      add("dropped_samples", std::to_string(sampler::getDroppedSamples()));
+      add("filtered_samples", std::to_string(sampler::getFilteredSamples()));
+      add("files", std::to_string(_files.size()));
+      add("functions", std::to_string(_functions.size()));
+      add("blocks", std::to_string(_blocks.size()));
+      add("deferred_functions", std::to_string(_deferred_samples.size()));
+      for(size_t c = 0; c < overhead::CategoryCount; c++) {
+        overhead::category category = (overhead::category)c;
+        add((std::string("overhead_") + overhead::getName(category) + "_ms").c_str(),
+            std::to_string(overhead::getNanos(category) / Time_ms));
+      }
+      size_t handler_events = overhead::getCount(overhead::Handler);
+      add("handler_ns_per_event", std::to_string(handler_events == 0 ? 0 : overhead::getNanos(overhead::Handler) / handler_events));
+      add("heap_page_size", std::to_string(hugepages::getPageSize()));
+      for(hugepages::mode m : { hugepages::HugeTLB, hugepages::Transparent, hugepages::Off }) {
+        add((std::string("heap_chunks_") + hugepages::getName(m)).c_str(), std::to_string(hugepages::getChunks(m)));
+      }
+      add("bin_cache_hits", std::to_string(_bin_cache.getHits()));
+      add("bin_cache_misses", std::to_string(_bin_cache.getMisses()));
+      add("experiments", std::to_string(_experiment_results.size()));
+      add("experiment", _experiment_running ? _experiment.kind + std::string(" ") + _experiment.function : "none");
+      add("scope", _scope_kind.empty() ? "none" : _scope_kind + " " + _scope_name);
+      return result;
+      
+    } else if(name == "help") {
+      return "pause                  stop recording samples\n"
+             "resume                 start recording samples again\n"
+             "scope function <name>  only run experiments in a function\n"
+             "scope file <path>      only run experiments in a file\n"
+             "scope clear            run experiments anywhere\n"
+             "dump [path]            write the profile so far, to the snapshot file by default\n"
+             "stats                  show sample, symbol, and experiment counters\n";
+    }
+    
+    return "error: unknown command " + name + ", try help\n";
+  }
+  
   static void* startProfiler(void* arg) {
     getInstance().profiler();
     return NULL;
   }
   
-  void findBlocks(interval range) {
-    // Disassemble to find starting addresses of all basic blocks
-    std::set<uintptr_t> block_bases;
-    std::stack<uintptr_t> q;
-    q.push(range.getBase());
-
-    while(q.size() > 0) {
-      uintptr_t p = q.top();
-      q.pop();
+  void processFunction(Function& fn) {
+    addBlocks(fn, blockfinder::findBlocks(fn.getLoadedRange()));
+  }
   
-      // Skip null or already-seen pointers
-      if(p == 0 || block_bases.find(p) != block_bases.end())
+  /// Find the blocks of every function with samples waiting for them. The mappings must be locked.
+  void processDeferred() {
+    while(!_deferred_samples.empty()) {
+      map<interval, Function>::iterator fn = _functions.find(_deferred_samples.begin()->first);
+      if(fn != _functions.end()) processFunction(fn->second);
+      else _deferred_samples.erase(_deferred_samples.begin());
+    }
+  }
+  
+  /// Create bins for a function's blocks and the loops they form. Block ranges are loaded addresses.
+  void createBlocks(Function& fn, const vector<block_info>& blocks) {
+    vector<loop_info> found = loops::findLoops(blocks);
+    
+    // Loops are ordered outermost first, so inner loops overwrite their parents
+    vector<int> innermost(blocks.size(), -1);
+    for(size_t l = 0; l < found.size(); l++) {
+      for(size_t b : found[l].blocks) {
+        innermost[b] = l;
+      }
+    }
+    
+    for(size_t i = 0; i < blocks.size(); i++) {
+      const block_info& b = blocks[i];
+      auto inserted = _blocks.emplace(b.range, BasicBlock(b.range, b.entry, b.length, b.successors));
+      if(inserted.second)
+        inserted.first->second.setLoop(innermost[i]);
+    }
+    
+    if(found.size() > 0) {
+      vector<Loop>& fn_loops = _loops[fn.getLoadedRange()];
+      for(const loop_info& l : found) {
+        fn_loops.emplace_back(blocks[l.header].range, l.parent, l.depth);
+        for(size_t b : l.blocks) {
+          fn_loops.back().addBlock(blocks[b].range);
+        }
+      }
+    }
+  }
+  
+  void addBlocks(Function& fn, const vector<block_info>& blocks) {
+    createBlocks(fn, blocks);
+    fn.setProcessed();
+    // The function's blocks aren't in the symbol cache yet
+    fn.getFile()->setDirty();
+    
+    // Cached PCs in this range may point to the function's bin instead of the new blocks
+    _bin_cache.invalidate(fn.getLoadedRange());
+    
+    // Attribute any samples that were waiting for these blocks
+    map<interval, vector<Sample>>::iterator d = _deferred_samples.find(fn.getLoadedRange());
+    if(d != _deferred_samples.end()) {
+      vector<Sample> samples = std::move(d->second);
+      _deferred_samples.erase(d);
+      for(Sample& s : samples) {
+        getBin(s.address, 0).addSample(s.type);
+      }
+    }
+  }
+  
+  /// Add the blocks found by background workers since the last call
+  void installBlocks() {
+    blockfinder::result r;
+    while(blockfinder::getResult(r)) {
+      // Skip functions that were unloaded or processed while the job was queued
+      map<interval, Function>::iterator fn = _functions.find(r.range);
+      if(fn == _functions.end() || fn->second.isProcessed() ||
+         fn->first.getBase() != r.range.getBase() || fn->first.getLimit() != r.range.getLimit())
+        continue;
+      
+      // Code in this range may have been replaced since it was read, so read it again
+      if(r.generation != _mappings_generation) {
+        blockfinder::submit(r.range, _deferred_samples.find(r.range) != _deferred_samples.end());
         continue;
+      }
+      
+      addBlocks(fn->second, r.blocks);
+    }
+  }
   
-      // This is a new block starting address
-      block_bases.insert(p);
+  void updateFiles() {
+    _mappings_generation = loader::getGeneration();
+    vector<loader::mapping> mappings = loader::getMappings();
+    
+    // Index the current mappings by range
+    map<interval, const loader::mapping*> current;
+    for(const loader::mapping& m : mappings) {
+      current.emplace(m.range, &m);
+    }
+    
+    // Retire files that are no longer mapped, or whose range now holds a different file
+    for(map<interval, File>::iterator f = _files.begin(); f != _files.end();) {
+      map<interval, const loader::mapping*>::iterator m = current.find(f->first);
+      if(m == current.end() || m->second->name != f->second.getName() ||
+         m->second->load_offset != f->second.getLoadOffset()) {
+        retireFile(f->second);
+        f = _files.erase(f);
+      } else {
+        f++;
+      }
+    }
+    
+    // Record new file ranges. Symbols are loaded when the first sample lands in the file.
+    for(const loader::mapping& m : mappings) {
+      if(_files.find(m.range) == _files.end()) {
+        INFO("Found file %s", m.name.c_str());
+        _files.emplace(m.range, File(m.name, m.range, m.load_offset)).first->second.setBuildID(m.build_id);
+      }
+    }
+  }
   
-      disassembler i(p, range.getLimit());
-      bool block_ended = false;
-      do {
-        // Any branch ends a basic block
-        if(i.branches()) {
-          block_ended = true;
-          
-          // If the block falls through, start a new block at the next instruction
-          if(i.fallsThrough())
-            q.push(i.limit());
+  /// Limit recorded samples to the files and functions that pass the scope filters. Files
+  /// whose symbols aren't loaded yet are kept whole, so their first sample can load them.
+  /// Offline runs never load symbols, so causal-symbolize applies the function filters.
+  void updateScope() {
+    vector<interval> ranges;
+    for(auto& f : _files) {
+      File& file = f.second;
+      if(_filter.includesFile(file.getName()) &&
+         (!_filter.hasFunctionFilters() || !file.isLoaded() || _offline)) {
+        ranges.push_back(file.getRange());
+      }
+    }
+    
+    // Only functions that passed the filters are loaded
+    if(_filter.hasFunctionFilters() && !_offline) {
+      for(auto& i : _functions) {
+        ranges.push_back(i.first);
+      }
+    }
+    
+    std::sort(ranges.begin(), ranges.end(), [](const interval& a, const interval& b) {
+      return a.getBase() < b.getBase();
+    });
+    
+    // Merge ranges that touch or overlap
+    vector<interval> merged;
+    for(const interval& r : ranges) {
+      if(merged.size() > 0 && r.getBase() <= merged.back().getLimit()) {
+        if(r.getLimit() > merged.back().getLimit())
+          merged.back() = interval(merged.back().getBase(), r.getLimit());
+      } else {
+        merged.push_back(r);
+      }
+    }
+    
+    sampler::setScope(merged.data(), merged.size());
+  }
+  
+  void retireFile(File& file) {
+    INFO("Retiring unloaded file %s", file.getName().c_str());
+    _retired.emplace_back(file, getTime());
+    RetiredFile& r = _retired.back();
+    
+    // Move the file's functions, blocks, and loops out of the live maps
+    for(map<interval, Function>::iterator fn = _functions.begin(); fn != _functions.end();) {
+      if(fn->second.getFile() != &file) {
+        fn++;
+        continue;
+      }
+      
+      interval range = fn->first;
+      Function& retired = r.functions.emplace(range, fn->second).first->second;
+      retired.setFile(&r.file);
+      
+      // Samples waiting for blocks that will never be installed count toward the function
+      map<interval, vector<Sample>>::iterator d = _deferred_samples.find(range);
+      if(d != _deferred_samples.end()) {
+        for(Sample& s : d->second) {
+          retired.addSample(s.type);
+        }
+        _deferred_samples.erase(d);
+      }
+      
+      for(map<interval, BasicBlock>::iterator b = _blocks.lower_bound(interval(range.getBase()));
+          b != _blocks.end() && b->first.getBase() < range.getLimit();) {
+        r.blocks.emplace(b->first, b->second);
+        b = _blocks.erase(b);
+      }
+      
+      map<interval, vector<Loop>>::iterator l = _loops.find(range);
+      if(l != _loops.end()) {
+        r.loops.emplace(range, std::move(l->second));
+        _loops.erase(l);
+      }
+      
+      fn = _functions.erase(fn);
+    }
+    
+    // Later samples at the file's addresses belong to whatever is loaded there next
+    for(auto p = _pcs.begin(); p != _pcs.end();) {
+      if(file.getRange().contains(p->first)) {
+        r.pcs.insert(*p);
+        p = _pcs.erase(p);
+      } else {
+        p++;
+      }
+    }
+    
+    // Cached PCs may point to the retired bins
+    _bin_cache.clear();
+  }
+  
+  void loadFunctions(File& file) {
+    overhead::timer t(overhead::Symbols);
+    file.setLoaded();
+    
+    const string& filename = file.getName();
+    
+    // Skip libpapi and libcausal
+    if(filename.find("libcausal") != string::npos ||
+       filename.find("libpapi") != string::npos) {
+      return;
+    }
+    
+    if(!_filter.includesFile(filename)) {
+      INFO("Skipping file %s, which is out of scope", filename.c_str());
+      return;
+    }
+    
+    size_t start_time = getTime();
+    std::shared_ptr<ELFFile> elf(ELFFile::open(filename));
+    
+    if(!elf) {
+      WARNING("Skipping file %s", filename.c_str());
+    } else {
+      // Dynamic libraries need to be shifted to their load address
+      uintptr_t load_offset = file.getLoadOffset();
+      
+      // The build-id normally comes from the loaded notes, but not every file has them mapped
+      if(file.getBuildID().empty())
+        file.setBuildID(elf->getBuildID());
+      
+      // Use the symbol cache if possible, otherwise parse the symbol table
+      if(!loadCachedFunctions(file, load_offset)) {
+        // Merge in symbols from a separate debug file, if there is one
+        std::shared_ptr<ELFFile> debug(elf->openDebugFile(filename, _debug_dir));
+        function_table functions = elf->getFunctions(debug.get());
+        
+        for(function_table::function& fn : functions.getFunctions()) {
+          auto aliases = functions.getAliases(fn);
+          if(!_filter.includesFunction(fn.name, aliases, fn.source)) {
+            file.setFiltered();
+            continue;
+          }
           
-          // Add the branch target
-          branch_target target = i.target();
-          if(target.dynamic()) {
-            WARNING("Unhandled dynamic branch target: %s", i.toString());
-          } else {
-            uintptr_t t = target.value();
-            
-            if(range.contains(t))
-              q.push(t);
+          auto inserted = _functions.emplace(fn.range + load_offset,
+                                             Function(fn.name, fn.range, load_offset, &file));
+          if(inserted.second) {
+            inserted.first->second.setSource(fn.source);
+            for(const char* alias : aliases) {
+              inserted.first->second.addAlias(alias);
+            }
           }
         }
         
-        i.next();
-      } while(!block_ended && !i.done());
-  
-      // Disassemble the new basic block
-      /*for(disassembler inst = disassembler(p, range.getLimit()); !inst.done() && inst.fallsThrough(); inst.next()) {
-        if(inst.branches()) {
-          branch_target target = inst.target();
-          if(target.dynamic()) {
-            WARNING("Unhandled dynamic branch target in instruction %s", inst.toString());
-          } else {
-            uintptr_t t = target.value();
-            if(range.contains(t))
-              q.push(t);
-          }
+        // Function names point into the mapped files, so keep them open
+        file.addSymbolSource(elf);
+        if(debug) file.addSymbolSource(debug);
+        file.setDirty();
+      }
+      
+      // Find blocks for the rest of the file's functions before their first samples arrive
+      if(_block_threads > 0) {
+        for(auto& i : _functions) {
+          if(i.second.getFile() == &file && !i.second.isProcessed())
+            blockfinder::submit(i.first, false);
         }
-      }*/
-    }
-
-    // Create basic block objects
-    size_t index = 0;
-    uintptr_t prev_base = 0;
-    for(set<uintptr_t>::iterator iter = block_bases.begin(); iter != block_bases.end(); iter++) {
-      if(prev_base != 0) {
-        interval r(prev_base, *iter);
-        _blocks.emplace(r, BasicBlock(r, index == 0));
-        index++;
       }
-      prev_base = *iter;
     }
-
-    // The last block ends at the function's limit address
-    interval r(prev_base, range.getLimit());
-    _blocks.emplace(r, BasicBlock(r, index == 0));
+    
+    INFO("Loaded symbols for %s in %fms", filename.c_str(), (float)(getTime() - start_time) / Time_ms);
   }
   
-  void findFunctions() {
-    for(const auto& file : papi::getFiles()) {
-      const string& filename = file.first;
-      const interval& file_range = file.second;
-      
-      // Record the file range
-      _files.emplace(file_range, File(filename, file_range));
+  bool loadCachedFunctions(File& file, uintptr_t load_offset) {
+    if(_cache_dir == NULL || file.getBuildID().empty())
+      return false;
+    
+    std::shared_ptr<symcache::reader> cache(symcache::reader::open(symcache::getPath(_cache_dir, file.getBuildID())));
+    if(!cache)
+      return false;
+    
+    for(const symcache::function_record& r : cache->getFunctions()) {
+      vector<const char*> aliases;
+      for(uint32_t alias : cache->getAliases(r)) {
+        aliases.push_back(cache->getString(alias));
+      }
+      if(!_filter.includesFunction(cache->getName(r), aliases, cache->getSource(r))) {
+        file.setFiltered();
+        continue;
+      }
       
-      // Skip libpapi and libcausal
-      if(filename.find("libcausal") != string::npos ||
-         filename.find("libpapi") != string::npos) {
+      interval fn_range(r.base, r.limit);
+      auto inserted = _functions.emplace(fn_range + load_offset,
+                                         Function(cache->getName(r), fn_range, load_offset, &file));
+      if(!inserted.second)
         continue;
+      
+      inserted.first->second.setSource(cache->getSource(r));
+      for(const char* alias : aliases) {
+        inserted.first->second.addAlias(alias);
       }
       
-      ELFFile* elf = ELFFile::open(filename);
+      // Create the function's basic blocks without disassembling it
+      if(r.processed) {
+        vector<block_info> blocks;
+        for(const symcache::block_record& b : cache->getBlocks(r)) {
+          blocks.push_back(block_info{ interval(b.base, b.limit) + load_offset, b.entry != 0, b.length });
+          for(uint32_t succ : cache->getSuccessors(b)) {
+            if(succ < r.block_count) blocks.back().successors.push_back(succ);
+          }
+        }
+        createBlocks(inserted.first->second, blocks);
+        inserted.first->second.setProcessed();
+      }
+    }
+    
+    INFO("Loaded %lu cached functions for %s", cache->getFunctions().size(), file.getName().c_str());
+    
+    // Function names point into the cache file, so keep it open
+    file.addSymbolSource(cache);
+    return true;
+  }
+  
+  /// Add the functions and blocks for files that have changed to their symbol cache writers
+  void collectSymbolCache(map<File*, symcache::writer>& writers, map<interval, Function>& functions,
+                          const map<interval, BasicBlock>& blocks) {
+    for(auto& i : functions) {
+      Function& fn = i.second;
+      File* file = fn.getFile();
+      // A file with filtered functions would leave them out of its cache
+      if(!file->isDirty() || file->isFiltered() || file->getBuildID().empty())
+        continue;
+      
+      symcache::writer& w = writers[file];
+      w.addFunction(fn.getName(), fn.getAliases(), fn.getSource(), fn.getRange(), fn.isProcessed());
       
-      if(elf == NULL) {
-        WARNING("Skipping file %s", filename.c_str());
-      } else {
-        // Dynamic libraries need to be shifted to their load address
-        uintptr_t load_offset = 0;
-        if(elf->isDynamic())
-          load_offset = file_range.getBase();
-        
-        for(const auto& fn : elf->getFunctions()) {
-          const string& fn_name = fn.first;
-          interval fn_range = fn.second;
-          
-          _functions.emplace(fn_range + load_offset, Function(fn_name, fn_range, load_offset));
+      if(fn.isProcessed()) {
+        interval loaded = fn.getLoadedRange();
+        for(auto b = blocks.lower_bound(interval(loaded.getBase())); 
+            b != blocks.end() && b->first.getBase() < loaded.getLimit(); b++) {
+          const BasicBlock& block = b->second;
+          interval r(block.getRange().getBase() - fn.getLoadOffset(),
+                     block.getRange().getLimit() - fn.getLoadOffset());
+          w.addBlock(r, block.getLength(), block.isEntryBlock(), block.getSuccessors());
+        }
+      }
+    }
+  }
+  
+  void saveSymbolCache() {
+    if(_cache_dir == NULL)
+      return;
+    
+    // Collect the functions and blocks for each file that has changed
+    map<File*, symcache::writer> writers;
+    collectSymbolCache(writers, _functions, _blocks);
+    for(RetiredFile& r : _retired) {
+      collectSymbolCache(writers, r.functions, r.blocks);
+    }
+    
+    if(writers.size() > 0 && mkdir(_cache_dir, 0755) == -1 && errno != EEXIST) {
+      WARNING("Failed to create symbol cache directory %s", _cache_dir);
+      return;
+    }
+    
+    for(auto& i : writers) {
+      File* file = i.first;
+      if(i.second.commit(symcache::getPath(_cache_dir, file->getBuildID())))
+        INFO("Saved symbol cache for %s", file->getName().c_str());
+    }
+  }
+  
+  void writeBlocks(Output& out, const map<interval, Function>& functions, const map<interval, BasicBlock>& blocks) {
+    const Function* current_fn = NULL;
+    
+    for(const auto& i : blocks) {
+      const BasicBlock& b  = i.second;
+      uintptr_t block_base = b.getRange().getBase();
+      // If this block has no samples, skip it
+      if(b.getCycleSamples() == 0 && b.getInstructionSamples() == 0)
+        continue;
+      
+      // If this is a new function, print info
+      if(current_fn == NULL || !current_fn->getLoadedRange().contains(block_base)) {
+        current_fn = &functions.find(block_base)->second;
+      }
+      out.writeBlockStats(current_fn->getFile()->getName(), current_fn->getName(), b);
+    }
+  }
+  
+  /// Total the samples in each loop's blocks and write the loops that have samples
+  void writeLoops(Output& out, const map<interval, Function>& functions, const map<interval, BasicBlock>& blocks,
+                  map<interval, vector<Loop>>& loops) {
+    for(auto& i : loops) {
+      const Function& fn = functions.find(i.first)->second;
+      for(Loop& l : i.second) {
+        static_cast<SampleBin&>(l) = SampleBin();
+        for(const interval& r : l.getBlocks()) {
+          map<interval, BasicBlock>::const_iterator b = blocks.find(r.getBase());
+          if(b != blocks.end()) l.addSamples(b->second);
         }
         
-        delete elf;
+        if(l.getCycleSamples() > 0 || l.getInstructionSamples() > 0)
+          out.writeLoopStats(fn.getFile()->getName(), fn.getName(), l);
+      }
+    }
+  }
+  
+  /// Start or finish a speedup experiment. Each experiment is followed by an idle period
+  /// of the same length. New experiments start when a sample block arrives, so block may be NULL.
+  void updateExperiment(SampleBlock* block) {
+    size_t now = getTime();
+    if(_experiment_running) {
+      if(now - _experiment_start >= ExperimentDuration)
+        finishExperiment(now);
+    } else if(now >= _next_experiment && block != NULL && block->getCount() > 0 && !sampler::isPaused()) {
+      // Pick a random sample, so code is chosen in proportion to its share of samples
+      uintptr_t p;
+      if(pickExperimentSample(block, p))
+        startExperiment(p, now);
+    }
+  }
+  
+  /// Choose a random sample from a block that is inside the experiment scope. Returns false
+  /// if none of the block's samples are in scope.
+  bool pickExperimentSample(SampleBlock* block, uintptr_t& p) {
+    if(_scope_kind.empty()) {
+      p = block->get(_experiment_rng() % block->getCount()).address;
+      return true;
+    }
+    
+    // Reservoir sampling keeps every in-scope sample equally likely
+    size_t found = 0;
+    for(Sample& s : block->getSamples()) {
+      if(inScope(s.address) && _experiment_rng() % ++found == 0)
+        p = s.address;
+    }
+    return found > 0;
+  }
+  
+  /// Check if an address is in the function or file experiments are limited to. Files match
+  /// by full path, or by any trailing part of the path that starts at a directory boundary.
+  bool inScope(uintptr_t p) {
+    map<interval, Function>::iterator fn = _functions.find(p);
+    if(fn == _functions.end())
+      return false;
+    if(_scope_kind == "function")
+      return fn->second.getName() == _scope_name;
+    
+    const std::string& path = fn->second.getFile()->getName();
+    if(path.size() < _scope_name.size() || path.compare(path.size() - _scope_name.size(), std::string::npos, _scope_name) != 0)
+      return false;
+    return path.size() == _scope_name.size() || _scope_name[0] == '/' || path[path.size() - _scope_name.size() - 1] == '/';
+  }
+  
+  void startExperiment(uintptr_t p, size_t now) {
+    map<interval, BasicBlock>::iterator b = _blocks.find(p);
+    if(b == _blocks.end())
+      return;
+    map<interval, Function>::iterator fn = _functions.find(p);
+    
+    Experiment& e = _experiment;
+    e.file = fn->second.getFile()->getName();
+    e.function = fn->second.getName();
+    
+    // Speed up a loop containing the block, choosing uniformly among the levels of its nest
+    vector<interval> ranges;
+    if(_experiment_loops && b->second.getLoop() != -1) {
+      const vector<Loop>& loops = _loops.find(fn->first)->second;
+      int l = b->second.getLoop();
+      for(size_t level = _experiment_rng() % loops[l].getDepth(); level > 0; level--) {
+        l = loops[l].getParent();
+      }
+      ranges = loops[l].getRanges();
+      e.kind = "loop";
+      e.range = loops[l].getHeader();
+    }
+    
+    // Fall back to the block if it isn't in a loop, or the loop is too scattered to perturb
+    if(ranges.size() == 0 || ranges.size() > MaxPerturbedRanges) {
+      ranges.assign(1, b->first);
+      e.kind = "block";
+      e.range = b->first;
+    }
+    
+    e.range_count = ranges.size();
+    e.delay_size = ExperimentDelaySize;
+    
+    _experiment_counters.clear();
+    for(Counter* c : _progress_counters) {
+      _experiment_counters.push_back(c->getValue());
+    }
+    
+    INFO("Speeding up %s at %p in %s", e.kind, (void*)e.range.getBase(), e.function.c_str());
+    sampler::startSpeedup(ranges.data(), ranges.size(), ExperimentDelaySize);
+    _experiment_running = true;
+    _experiment_start = now;
+  }
+  
+  void finishExperiment(size_t now) {
+    Experiment& e = _experiment;
+    e.delays = sampler::reset();
+    e.duration = now - _experiment_start;
+    
+    e.progress.clear();
+    for(size_t i = 0; i < _progress_counters.size(); i++) {
+      size_t start = i < _experiment_counters.size() ? _experiment_counters[i] : 0;
+      e.progress.push_back(_progress_counters[i]->getValue() - start);
+    }
+    
+    INFO("Inserted %lu delays in %fms", e.delays, (float)e.duration / Time_ms);
+    _experiment_results.push_back(e);
+    _experiment_running = false;
+    _next_experiment = now + ExperimentDuration;
+  }
+  
+  /// Get the command line from /proc, with arguments separated by spaces
+  static std::string getCommandLine() {
+    std::string result;
+    FILE* f = fopen("/proc/self/cmdline", "r");
+    if(f == NULL)
+      return result;
+    
+    int c;
+    while((c = fgetc(f)) != EOF) {
+      result.push_back(c == '\0' ? ' ' : c);
+    }
+    fclose(f);
+    
+    // Drop the separator after the last argument
+    if(result.size() > 0 && result.back() == ' ')
+      result.pop_back();
+    return result;
+  }
+  
+  static std::string getHostName() {
+    char host[256];
+    if(gethostname(host, sizeof(host)) == -1)
+      return "unknown";
+    host[sizeof(host) - 1] = '\0';
+    return host;
+  }
+  
+  /// Write everything recorded so far
+  void writeProfile(Output& out) {
+    RunInfo run = _run;
+    run.end_time = getWallTime();
+    run.threads = __atomic_load_n(&_threads, __ATOMIC_SEQ_CST);
+    out.writeRunInfo(run);
+    writeMappings(out);
+    
+    if(_offline) {
+      writeRawSamples(out);
+    } else {
+      writeBlocks(out, _functions, _blocks);
+      writeLoops(out, _functions, _blocks, _loops);
+      for(RetiredFile& r : _retired) {
+        writeBlocks(out, r.functions, r.blocks);
+        writeLoops(out, r.functions, r.blocks, r.loops);
+      }
+      
+      for(const Experiment& e : _experiment_results) {
+        out.writeExperiment(e);
+      }
+    }
+    
+    for(size_t c = 0; c < overhead::CategoryCount; c++) {
+      overhead::category category = (overhead::category)c;
+      out.writeOverhead(overhead::getName(category), overhead::getCount(category), overhead::getNanos(category));
+    }
+  }
+  
+  /// Replace the snapshot file with the profile so far. The snapshot is written to a temporary
+  /// file and renamed into place, so readers always see a complete profile. Returns false if
+  /// the snapshot couldn't be written.
+  bool writeSnapshot() {
+    overhead::timer t(overhead::Output);
+    size_t start_time = getTime();
+    std::string snapshot_path = _output_path + ".snapshot";
+    std::string tmp_path = snapshot_path + "." + std::to_string(getpid()) + ".tmp";
+    
+    Output* out = Output::open(_output_format, tmp_path, false, "test", CycleSamplePeriod, InstructionSamplePeriod);
+    if(out == NULL) {
+      WARNING("Failed to create snapshot file %s", tmp_path.c_str());
+      return false;
+    }
+    writeProfile(*out);
+    delete out;
+    
+    if(rename(tmp_path.c_str(), snapshot_path.c_str()) == -1) {
+      WARNING("Failed to replace snapshot file %s", snapshot_path.c_str());
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    
+    INFO("Wrote snapshot in %fms", (float)(getTime() - start_time) / Time_ms);
+    return true;
+  }
+  
+  /// Write a snapshot of the loaded files. Offline symbolization uses it to find the file for
+  /// each raw PC, and tools use it to match blocks across runs by build-id and file offset.
+  /// Retired files record when they were unloaded, so a PC is placed in the file that was
+  /// loaded at its address when it was first sampled.
+  void writeMappings(Output& out) {
+    for(const auto& f : _files) {
+      out.writeMapping(f.second, 0);
+    }
+    for(const RetiredFile& r : _retired) {
+      out.writeMapping(r.file, r.time);
+    }
+  }
+  
+  /// Write the raw PC samples for offline symbolization
+  void writeRawSamples(Output& out) {
+    for(const auto& p : _pcs) {
+      out.writePCStats(p.first, p.second);
+    }
+    for(const RetiredFile& r : _retired) {
+      for(const auto& p : r.pcs) {
+        out.writePCStats(p.first, p.second);
       }
     }
   }
@@ -265,14 +1178,66 @@ public:
   void initialize() {
     if(__atomic_exchange_n(&_initialized, true, __ATOMIC_SEQ_CST) == false) {
       INFO("Initializing");
+      // Start measuring the timestamp counter's rate. The profiler thread switches to it later.
+      timing::initialize();
+      INFO("Measuring time with the %s clock", timing::getSource());
+      size_t start_time = getTime();
+      overhead::initialize();
+      
+      _cache_dir = options::getString("CAUSAL_CACHE_DIR");
+      _debug_dir = options::getString("CAUSAL_DEBUG_DIR", "/usr/lib/debug");
+      _offline = options::getBool("CAUSAL_OFFLINE", false);
+      _block_threads = _offline ? 0 : options::getSize("CAUSAL_BLOCK_THREADS", 2);
+      _filter = ScopeFilter::fromOptions();
+      if(_offline && _filter.hasFunctionFilters())
+        WARNING("Symbol and source filters are not applied in offline runs. Set them for causal-symbolize instead.");
+      
+      const char* experiments = options::getString("CAUSAL_EXPERIMENTS");
+      _experiments = !_offline && experiments != NULL;
+      _experiment_loops = _experiments && strcmp(experiments, "loop") == 0;
+      if(_experiments && !_experiment_loops && strcmp(experiments, "block") != 0) {
+        WARNING("Unknown experiment kind %s, experiments are disabled", experiments);
+        _experiments = false;
+      }
+      
+      _run.command = getCommandLine();
+      _run.host = getHostName();
+      _run.pid = getpid();
+      _run.start_time = getWallTime();
+      
+      _output_format = options::getString("CAUSAL_OUTPUT_FORMAT", "text");
+      _output_path = Output::expandPath(options::getString("CAUSAL_OUTPUT", Output::getDefaultPath(_output_format)), _run);
+      _snapshot_interval = options::getSize("CAUSAL_SNAPSHOT_INTERVAL", 0) * Time_s;
+      _next_snapshot = getTime() + _snapshot_interval;
+      
+      const char* control_path = options::getString("CAUSAL_CONTROL");
+      if(control_path != NULL)
+        _control = control::start(Output::expandPath(control_path, _run));
+      if(options::getBool("CAUSAL_PAUSED", false))
+        sampler::pause();
+      
+      const char* stats_path = options::getString("CAUSAL_STATS");
+      if(stats_path != NULL) {
+        _stats_path = Output::expandPath(stats_path, _run);
+        _stats = stats::create(_stats_path, _run.pid);
+        PREFER(_stats != NULL, "Failed to create statistics file %s", _stats_path.c_str());
+        _rate_start = getTime();
+      }
       
-      _output = new Output("test", CycleSamplePeriod, InstructionSamplePeriod);
+      _output = Output::open(_output_format, _output_path, true, "test",
+                             CycleSamplePeriod, InstructionSamplePeriod);
+      REQUIRE(_output != NULL, "Failed to open %s for output", _output_path.c_str());
       
       // Set up PAPI
       papi::initialize();
       
-      // Build a map of functions
-      findFunctions();
+      // Build a map of loaded files. Functions are found lazily by the profiler thread.
+      updateFiles();
+      if(_filter.isActive())
+        updateScope();
+      
+      if(_block_threads > 0)
+        blockfinder::start(_block_threads);
     
       // Create the profiler thread
       REQUIRE(Real::pthread_create()(&_profiler_thread, NULL, startProfiler, NULL) == 0,
@@ -280,6 +1245,8 @@ public:
         
       // Initialize the main thread
       initializeThread();
+      
+      INFO("Initialized in %fms", (float)(getTime() - start_time) / Time_ms);
     }
   }
   
@@ -296,6 +1263,7 @@ public:
   }
   
   void initializeThread() {
+    __atomic_add_fetch(&_threads, 1, __ATOMIC_SEQ_CST);
     sampler::initializeThread(CycleSamplePeriod, InstructionSamplePeriod);
   }
   
@@ -303,9 +1271,13 @@ public:
     sampler::shutdownThread();
   }
   
+  /// Called in the child after a fork. Only the forking thread exists in the child, so it isn't
+  /// profiled, and its copy of the parent's records is never written.
   void reinitialize() {
     INFO("Reinitializing");
     __atomic_store_n(&_initialized, false, __ATOMIC_SEQ_CST);
+    // The parent's threads may have held the mappings lock when it forked
+    loader::reset();
   }
   
   void shutdown() {
@@ -318,29 +1290,69 @@ public:
       pthread_join(_profiler_thread, NULL);
       INFO("Done.");
       
-      const File* current_file = NULL;
-      const Function* current_fn = NULL;
+      if(_control)
+        control::stop();
       
-      for(const auto& i : _blocks) {
-        const BasicBlock& b  = i.second;
-        uintptr_t block_base = b.getRange().getBase();
-        // If this block has no samples, skip it
-        if(b.getCycleSamples() == 0 && b.getInstructionSamples() == 0)
-          continue;
-        
-        // If this is a new file, print info
-        if(current_file == NULL || !current_file->getRange().contains(block_base)) {
-          current_file = &_files.find(block_base)->second;
-        }
-        
-        // If this is a new function, print info
-        if(current_fn == NULL || !current_fn->getLoadedRange().contains(block_base)) {
-          current_fn = &_functions.find(block_base)->second;
-        }
-        _output->writeBlockStats(current_file->getName(), current_fn->getName(), b);
+      // An experiment cut short by the end of the program is discarded
+      if(_experiment_running) {
+        sampler::reset();
+        _experiment_running = false;
       }
       
+      if(_block_threads > 0)
+        blockfinder::stop();
+      
+      // Install finished blocks, then find the rest of the blocks that samples are waiting for.
+      // Samples still waiting if the program exits during an unload are left unattributed.
+      loader::lockMappings();
+      installBlocks();
+      if(!loader::isUnloading())
+        processDeferred();
+      loader::unlockMappings();
+      
+      size_t lookups = _bin_cache.getHits() + _bin_cache.getMisses();
+      INFO("Bin cache: %lu hits, %lu misses (%.1f%% hit rate), %lu invalidations",
+        _bin_cache.getHits(), _bin_cache.getMisses(),
+        lookups == 0 ? 0.0 : 100.0 * _bin_cache.getHits() / lookups,
+        _bin_cache.getInvalidations());
+      
+      if(_filter.isActive())
+        INFO("Filtered %lu out-of-scope samples", sampler::getFilteredSamples());
+      
+      INFO("Private heap: %lu hugetlb, %lu thp, and %lu ordinary chunks, %lu byte pages",
+        hugepages::getChunks(hugepages::HugeTLB), hugepages::getChunks(hugepages::Transparent),
+        hugepages::getChunks(hugepages::Off), hugepages::getPageSize());
+      
+      // Chunks mapped with smaller pages than the option asked for
+      size_t fallback_chunks = 0;
+      for(size_t m = hugepages::Off; m < hugepages::getMode(); m++) {
+        fallback_chunks += hugepages::getChunks((hugepages::mode)m);
+      }
+      PREFER(fallback_chunks == 0, "%lu private heap chunks couldn't get %s pages and use smaller pages",
+        fallback_chunks, hugepages::getName(hugepages::getMode()));
+      
+      for(size_t c = 0; c < overhead::CategoryCount; c++) {
+        overhead::category category = (overhead::category)c;
+        INFO("Overhead in %s: %lu events, %fms", overhead::getName(category),
+          overhead::getCount(category), (float)overhead::getNanos(category) / Time_ms);
+      }
+      
+      writeProfile(*_output);
       delete _output;
+      
+      // Monitors that still have the statistics mapped see the final values
+      if(_stats != NULL) {
+        publishStats(true);
+        stats::detach(_stats);
+        _stats = NULL;
+        unlink(_stats_path.c_str());
+      }
+      
+      // The final profile replaces the last snapshot
+      if(_snapshot_interval > 0)
+        unlink((_output_path + ".snapshot").c_str());
+      
+      saveSymbolCache();
     }
   }
 };
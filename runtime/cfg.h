@@ -0,0 +1,336 @@
+#if !defined(CAUSAL_RUNTIME_CFG_H)
+#define CAUSAL_RUNTIME_CFG_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stack>
+#include <utility>
+#include <vector>
+
+#include "decoder.h"
+#include "interval.h"
+#include "log.h"
+
+enum {
+  /// Jump tables with more entries than this are assumed to be misidentified
+  MaxJumpTableEntries = 4096
+};
+
+/// A basic block found by disassembling a function
+struct block_info {
+  interval range;
+  bool entry;
+  size_t length;
+  /// Indices of the blocks control can reach from this one, in the function's block list
+  std::vector<uint32_t> successors;
+};
+
+namespace cfg {
+  /// Get a pointer to the bytes at a range of loaded addresses, or NULL if they can't be read.
+  /// In the runtime this is the loaded memory itself. Offline tools read from the file instead.
+  typedef std::function<const uint8_t*(interval)> memory_reader;
+
+  /// What is known about a possible jump table dispatch sequence, tracked through a block and
+  /// into the successors of its bounds check. Compilers emit one of two forms:
+  ///
+  ///   cmp idx, N; ja default; jmp [idx*8 + table]                      (absolute entries)
+  ///   cmp idx, N; ja default; lea t, [rip + table];
+  ///   movsxd r, dword [t + idx*4]; add r, t; jmp r                     (table-relative entries)
+  ///
+  /// The lea is often hoisted above the bounds check, so state flows across the conditional branch.
+  /// The bound only applies to a table indexed by the register that was compared, or a copy of it.
+  struct jump_table_state {
+    size_t entries = 0;         ///< Entries allowed by the bounds check, or zero if unknown
+    uint32_t index_regs = 0;    ///< Registers that hold the compared index, one bit per register
+    uintptr_t table = 0;        ///< Table address loaded by a rip-relative lea
+    int table_reg = x86::NoRegister;
+    int entry_reg = x86::NoRegister;  ///< Register holding a sign-extended relative entry
+    bool relocated = false;     ///< Has the table address been added to the entry?
+
+    /// Is the bounds check known to apply to a register?
+    bool holdsIndex(int reg) const {
+      return entries != 0 && reg >= 0 && reg < 16 && (index_regs & (1 << reg));
+    }
+
+    /// Update the state with the next instruction in the block
+    void update(const x86::instruction& i, uintptr_t next_pc) {
+      if(i.type == x86::op::lea && i.base == x86::RIP && i.index == x86::NoRegister) {
+        table = next_pc + i.disp;
+        table_reg = i.reg;
+        entry_reg = x86::NoRegister;
+        relocated = false;
+      } else if(i.type == x86::op::movsxd && table_reg != x86::NoRegister && i.mem &&
+                i.base == table_reg && holdsIndex(i.index) && i.scale == 4 && i.disp == 0) {
+        entry_reg = i.reg;
+        relocated = false;
+      } else if(i.type == x86::op::add && entry_reg != x86::NoRegister && !i.mem &&
+                ((i.reg == entry_reg && i.rm == table_reg) || (i.rm == entry_reg && i.reg == table_reg)) &&
+                i.writes == entry_reg) {
+        relocated = true;
+      } else if(i.writes != x86::NoRegister && (i.writes == table_reg || i.writes == entry_reg)) {
+        // Anything else that writes one of the tracked registers breaks the sequence
+        *this = jump_table_state();
+      }
+
+      // Compilers often copy or zero-extend the index between the bounds check and the jump,
+      // which keeps it in bounds. Any other write replaces it.
+      if(i.writes >= 0 && i.writes < 16) {
+        int source = x86::NoRegister;
+        if(i.type == x86::op::mov) source = (i.writes == i.reg) ? i.rm : i.reg;
+        else if(i.type == x86::op::movzx || i.type == x86::op::movsxd) source = i.rm;
+
+        if(holdsIndex(source)) index_regs |= 1 << i.writes;
+        else index_regs &= ~(1 << i.writes);
+      }
+    }
+
+    /// Record the bounds check for a conditional branch that follows `cmp reg, imm`.
+    /// Returns the state for the successor that is only reached when the index is in bounds.
+    jump_table_state bounded(const x86::instruction& branch, int reg, uint64_t imm, bool taken) const {
+      jump_table_state result = *this;
+      result.entries = 0;
+      result.index_regs = 0;
+
+      if(branch.type == x86::op::jcc) {
+        if(!taken && branch.cond == x86::CondA) result.entries = imm + 1;       // Falls through if idx <= imm
+        else if(!taken && branch.cond == x86::CondAE) result.entries = imm;     // Falls through if idx < imm
+        else if(taken && branch.cond == x86::CondBE) result.entries = imm + 1;  // Jumps if idx <= imm
+        else if(taken && branch.cond == x86::CondB) result.entries = imm;       // Jumps if idx < imm
+      }
+
+      if(result.entries > MaxJumpTableEntries || reg < 0 || reg >= 16)
+        result.entries = 0;
+      else
+        result.index_regs = 1 << reg;
+      return result;
+    }
+  };
+
+  /// A block start address that still needs to be decoded
+  struct pending_block {
+    uintptr_t base;
+    jump_table_state state;
+  };
+
+  /// Find the targets of an indirect jump through a jump table. Targets outside the function
+  /// are dropped. Returns false if the jump doesn't match a known jump table pattern.
+  static bool getJumpTableTargets(x86::decoder& d, const jump_table_state& state, interval range,
+                                  const memory_reader& read, std::vector<uintptr_t>& targets) {
+    const x86::instruction& i = d.get();
+    if(state.entries == 0 || i.type != x86::op::jmp_indirect)
+      return false;
+
+    size_t dropped = 0;
+
+    if(i.mem && i.base == x86::NoRegister && state.holdsIndex(i.index) && i.scale == sizeof(uintptr_t)) {
+      // Absolute entries, indexed directly by the jump
+      uintptr_t table = i.disp;
+      const uint8_t* data = read(interval(table, table + state.entries * sizeof(uintptr_t)));
+      if(data == NULL)
+        return false;
+
+      for(size_t n = 0; n < state.entries; n++) {
+        uintptr_t t;
+        memcpy(&t, data + n * sizeof(uintptr_t), sizeof(uintptr_t));
+        if(range.contains(t)) targets.push_back(t);
+        else dropped++;
+      }
+
+    } else if(!i.mem && i.rm == state.entry_reg && state.relocated) {
+      // 32-bit entries relative to the start of the table
+      const uint8_t* data = read(interval(state.table, state.table + state.entries * sizeof(int32_t)));
+      if(data == NULL)
+        return false;
+
+      for(size_t n = 0; n < state.entries; n++) {
+        int32_t offset;
+        memcpy(&offset, data + n * sizeof(int32_t), sizeof(int32_t));
+        uintptr_t t = state.table + offset;
+        if(range.contains(t)) targets.push_back(t);
+        else dropped++;
+      }
+
+    } else {
+      return false;
+    }
+
+    if(dropped > 0)
+      WARNING("Dropped %lu jump table targets outside the function at %p", dropped, (void*)d.base());
+
+    return true;
+  }
+
+  /// Flags for each byte of a function, recorded as instructions are decoded
+  enum {
+    SizeMask = 0x0F,    ///< Size of the instruction that starts here, or zero if none was decoded
+    StopsBlock = 0x10,  ///< The instruction branches or doesn't fall through
+    BlockStart = 0x20   ///< A basic block starts here
+  };
+
+  /// Count instructions in a block, up to and including the first branch. Instructions are
+  /// normally found in the decoded sizes, but any that weren't recorded are decoded again.
+  /// Sets `falls_off` if control runs off the end of the block without branching.
+  static size_t countInstructions(interval block, interval range, const uint8_t* code,
+                                  const std::vector<uint8_t>& decoded, bool& falls_off) {
+    size_t length = 1;
+    falls_off = false;
+    uintptr_t p = block.getBase();
+    while(p < block.getLimit()) {
+      uint8_t flags = decoded[p - range.getBase()];
+      size_t size = flags & SizeMask;
+      bool stops = flags & StopsBlock;
+
+      if(size == 0) {
+        x86::decoder i(code + (p - range.getBase()), p, block.getLimit());
+        if(i.done()) break;
+        size = i.size();
+        stops = i.branches() || !i.fallsThrough();
+      }
+
+      // Stop at the first branch or an instruction that runs past the end of the block
+      if(stops || p + size > block.getLimit()) {
+        falls_off = !stops;
+        break;
+      }
+
+      length++;
+      p += size;
+    }
+
+    if(p >= block.getLimit())
+      falls_off = true;
+    return length;
+  }
+
+  /// Find the basic blocks in a function, decoding each instruction once. Code and jump tables
+  /// are read through `read`. Each block lists its successors within the function.
+  /// Returns no blocks if the function's code can't be read.
+  static std::vector<block_info> findBlocks(interval range, const memory_reader& read) {
+    std::vector<block_info> blocks;
+    const uint8_t* code = read(range);
+    if(code == NULL)
+      return blocks;
+
+    std::vector<uint8_t> decoded(range.getLimit() - range.getBase(), 0);
+    // Branches to other blocks in the function, by address of the branch and its target
+    std::vector<std::pair<uintptr_t, uintptr_t>> edges;
+
+    // Decode to find starting addresses of all basic blocks
+    std::stack<pending_block> q;
+    q.push(pending_block{ range.getBase(), jump_table_state() });
+
+    while(q.size() > 0) {
+      pending_block pending = q.top();
+      uintptr_t p = pending.base;
+      q.pop();
+
+      // Skip null, out of range, or already-seen pointers
+      if(p == 0 || !range.contains(p) || (decoded[p - range.getBase()] & BlockStart))
+        continue;
+
+      // This is a new block starting address
+      decoded[p - range.getBase()] |= BlockStart;
+
+      jump_table_state state = pending.state;
+      int compared_reg = x86::NoRegister;  // The register the last instruction compared to an immediate
+      uint64_t compared_imm = 0;
+
+      x86::decoder i(code + (p - range.getBase()), p, range.getLimit());
+      bool block_ended = false;
+      while(!block_ended && !i.done()) {
+        uint8_t& flags = decoded[i.base() - range.getBase()];
+        flags = (flags & ~(SizeMask | StopsBlock)) | i.size() |
+                ((i.branches() || !i.fallsThrough()) ? StopsBlock : 0);
+
+        // Any branch ends a basic block
+        if(i.branches()) {
+          block_ended = true;
+
+          // If the block falls through, start a new block at the next instruction
+          if(i.fallsThrough()) {
+            jump_table_state next_state = (compared_reg != x86::NoRegister) ?
+              state.bounded(i.get(), compared_reg, compared_imm, false) : state;
+            q.push(pending_block{ i.limit(), next_state });
+            if(range.contains(i.limit()))
+              edges.emplace_back(i.base(), i.limit());
+          }
+
+          // Add the branch target
+          if(i.dynamicTarget()) {
+            std::vector<uintptr_t> targets;
+            if(getJumpTableTargets(i, state, range, read, targets)) {
+              for(uintptr_t t : targets) {
+                q.push(pending_block{ t, jump_table_state() });
+                edges.emplace_back(i.base(), t);
+              }
+            } else {
+              WARNING("Unhandled dynamic branch target: %s", i.toString());
+            }
+          } else {
+            uintptr_t t = i.target();
+
+            if(range.contains(t)) {
+              jump_table_state target_state = (compared_reg != x86::NoRegister) ?
+                state.bounded(i.get(), compared_reg, compared_imm, true) : state;
+              q.push(pending_block{ t, target_state });
+              edges.emplace_back(i.base(), t);
+            }
+          }
+        } else {
+          bool compares = i.get().type == x86::op::cmp && !i.get().mem;
+          compared_reg = compares ? i.get().rm : x86::NoRegister;
+          compared_imm = i.get().imm;
+          state.update(i.get(), i.limit());
+        }
+
+        i.next();
+
+        // Code after the start of a block that has already been decoded doesn't need to be
+        // decoded again. Its branches have already been followed.
+        if(!block_ended && !i.done() && (decoded[i.base() - range.getBase()] & BlockStart))
+          break;
+      }
+    }
+
+    // Create basic block records
+    std::vector<bool> falls_off;
+    uintptr_t prev_base = 0;
+    for(uintptr_t p = range.getBase(); p <= range.getLimit(); p++) {
+      // The last block ends at the function's limit address
+      if(p == range.getLimit() || (decoded[p - range.getBase()] & BlockStart)) {
+        if(prev_base != 0) {
+          interval r(prev_base, p);
+          bool f;
+          blocks.push_back(block_info{ r, blocks.size() == 0, countInstructions(r, range, code, decoded, f) });
+          falls_off.push_back(f);
+        }
+        prev_base = p;
+      }
+    }
+
+    // Blocks that run into the next block fall through to it
+    for(size_t n = 0; n + 1 < blocks.size(); n++) {
+      if(falls_off[n])
+        blocks[n].successors.push_back(n + 1);
+    }
+
+    // Add branch edges. Targets are always block starts, and a branch belongs to the block it's in.
+    auto byBase = [](uintptr_t p, const block_info& b) { return p < b.range.getBase(); };
+    for(const auto& e : edges) {
+      size_t from = std::upper_bound(blocks.begin(), blocks.end(), e.first, byBase) - blocks.begin() - 1;
+      size_t to = std::upper_bound(blocks.begin(), blocks.end(), e.second, byBase) - blocks.begin() - 1;
+      blocks[from].successors.push_back(to);
+    }
+
+    for(block_info& b : blocks) {
+      std::sort(b.successors.begin(), b.successors.end());
+      b.successors.erase(std::unique(b.successors.begin(), b.successors.end()), b.successors.end());
+    }
+
+    return blocks;
+  }
+}
+
+#endif
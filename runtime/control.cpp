@@ -0,0 +1,211 @@
+#include "control.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "log.h"
+#include "real.h"
+
+using std::string;
+
+namespace control {
+  enum {
+    /// How often, in milliseconds, the control thread checks whether it should exit
+    PollInterval = 100,
+    /// Longer command lines are rejected, so a bad client can't grow the buffer forever
+    MaxCommandLength = 4096
+  };
+
+  int listen_fd = -1;
+  string socket_path;
+  pthread_t control_thread;
+  std::atomic<bool> running(false);
+
+  /// Protects the command handoff between the control thread and the profiler thread
+  pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+  /// Signaled when the profiler thread replies, or when the control thread should exit
+  pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+  string command;
+  bool has_command = false;
+  string response;
+  bool has_response = false;
+
+  /// Hand a command to the profiler thread and wait for its reply
+  static string submit(const string& c) {
+    pthread_mutex_lock(&mtx);
+    command = c;
+    has_command = true;
+    has_response = false;
+    while(running && !has_response) {
+      pthread_cond_wait(&cv, &mtx);
+    }
+    has_command = false;
+    string result = has_response ? response : "error: profiler is shutting down\n";
+    pthread_mutex_unlock(&mtx);
+    return result;
+  }
+
+  static bool sendAll(int fd, const string& text) {
+    const char* p = text.data();
+    size_t size = text.size();
+    while(size > 0) {
+      // A client that disconnects early must not kill the program with SIGPIPE
+      ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+      if(n == -1 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  /// Run the commands from one connection until the client disconnects or the thread stops
+  static void serve(int fd) {
+    string buffer;
+    while(running) {
+      struct pollfd p = { fd, POLLIN, 0 };
+      int ready = poll(&p, 1, PollInterval);
+      if(ready == -1 && errno != EINTR) return;
+      if(ready <= 0) continue;
+
+      char chunk[512];
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if(n == -1 && errno == EINTR) continue;
+      if(n <= 0) return;
+      buffer.append(chunk, n);
+
+      size_t end;
+      while((end = buffer.find('\n')) != string::npos) {
+        string line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        if(line.size() > 0 && line.back() == '\r')
+          line.pop_back();
+        if(line.size() > 0 && !sendAll(fd, submit(line)))
+          return;
+      }
+
+      if(buffer.size() > MaxCommandLength) {
+        sendAll(fd, "error: command is too long\n");
+        return;
+      }
+    }
+  }
+
+  static void* controlMain(void* arg) {
+    while(running) {
+      struct pollfd p = { listen_fd, POLLIN, 0 };
+      int ready = poll(&p, 1, PollInterval);
+      if(ready <= 0) continue;
+
+      int fd = accept(listen_fd, NULL, NULL);
+      if(fd == -1) continue;
+      serve(fd);
+      close(fd);
+    }
+    return NULL;
+  }
+
+  bool start(const string& path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+      WARNING("Control socket path %s is too long", path.c_str());
+      return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // Replace a socket left behind by an earlier run, but never any other kind of file
+    struct stat st;
+    if(lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd == -1) {
+      WARNING("Failed to create control socket: %s", strerror(errno));
+      return false;
+    }
+
+    // Only the owner can control the program. The socket is created without group or other
+    // permissions, so there is no window where another user can connect.
+    mode_t old_mask = umask(S_IRWXG | S_IRWXO);
+    int bound = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if(bound == -1) {
+      WARNING("Failed to bind control socket %s: %s", path.c_str(), strerror(errno));
+      close(listen_fd);
+      listen_fd = -1;
+      return false;
+    }
+
+    // Don't listen unless the permissions are certain
+    if(chmod(path.c_str(), S_IRUSR | S_IWUSR) == -1 || listen(listen_fd, 4) == -1) {
+      WARNING("Failed to secure control socket %s: %s", path.c_str(), strerror(errno));
+      close(listen_fd);
+      listen_fd = -1;
+      unlink(path.c_str());
+      return false;
+    }
+    socket_path = path;
+
+    running = true;
+    // Use the real pthread_create so the control thread isn't sampled
+    if(Real::pthread_create()(&control_thread, NULL, controlMain, NULL) != 0) {
+      WARNING("Failed to create control thread");
+      running = false;
+      close(listen_fd);
+      listen_fd = -1;
+      unlink(path.c_str());
+      return false;
+    }
+
+    INFO("Listening for commands on %s", path.c_str());
+    return true;
+  }
+
+  bool getCommand(string& c) {
+    if(pthread_mutex_trylock(&mtx) != 0)
+      return false;
+
+    bool found = has_command && !has_response;
+    if(found) {
+      c = command;
+      has_command = false;
+    }
+
+    pthread_mutex_unlock(&mtx);
+    return found;
+  }
+
+  void reply(const string& text) {
+    pthread_mutex_lock(&mtx);
+    response = text;
+    has_response = true;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mtx);
+  }
+
+  void stop() {
+    if(listen_fd == -1)
+      return;
+
+    pthread_mutex_lock(&mtx);
+    running = false;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mtx);
+
+    pthread_join(control_thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path.c_str());
+  }
+}
@@ -0,0 +1,26 @@
+#if !defined(CAUSAL_RUNTIME_CONTROL_H)
+#define CAUSAL_RUNTIME_CONTROL_H
+
+#include <string>
+
+/// A Unix domain socket that accepts commands while the program runs. A background thread
+/// reads one command per line from each connection and hands it to the profiler thread, which
+/// polls for commands between sample blocks. Commands never touch the profiler's records from
+/// another thread, so they need no extra locking.
+namespace control {
+  /// Create the socket, readable and writable only by its owner, and start the control thread.
+  /// Returns false if the socket can't be created or its permissions can't be set.
+  bool start(const std::string& path);
+
+  /// Take a waiting command, if there is one. Never blocks. The caller must send a reply.
+  bool getCommand(std::string& command);
+
+  /// Answer the last command taken with getCommand
+  void reply(const std::string& text);
+
+  /// Stop the control thread, and close and remove the socket. Commands that are waiting are
+  /// answered with an error.
+  void stop();
+}
+
+#endif
@@ -0,0 +1,505 @@
+#if !defined(CAUSAL_RUNTIME_DECODER_H)
+#define CAUSAL_RUNTIME_DECODER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "arch.h"
+#include "disassembler.h"
+
+/// A table-driven x86 decoder for block discovery. It finds instruction lengths, classifies
+/// branches, and decodes just enough of the operands to recognize jump tables. Nothing is
+/// formatted as text; toString() uses udis86, and is only meant for diagnostics.
+namespace x86 {
+  enum {
+    NoRegister = -1,
+    RIP = 16,
+    MaxInstructionSize = 15
+  };
+
+  /// The instruction classes that block discovery cares about
+  enum class op {
+    other,
+    invalid,
+    jcc,          ///< Conditional branch with a relative target
+    jrcxz,        ///< jcxz, jecxz, or jrcxz
+    jmp,          ///< Unconditional branch with a relative target
+    jmp_indirect, ///< Unconditional branch through a register or memory
+    ret,
+    cmp,
+    lea,
+    mov,          ///< Word-sized mov between registers or memory, without an immediate
+    movzx,
+    movsxd,
+    add
+  };
+
+  /// Condition codes used by bounds checks, from the low bits of the jcc opcode
+  enum {
+    CondB = 0x2,
+    CondAE = 0x3,
+    CondBE = 0x6,
+    CondA = 0x7
+  };
+
+  /// Opcode flags
+  enum {
+    M = 0x001,    ///< Has a ModRM byte
+    I8 = 0x002,   ///< 8-bit immediate
+    I16 = 0x004,  ///< 16-bit immediate
+    IZ = 0x008,   ///< 16 or 32-bit immediate, depending on operand size
+    IV = 0x010,   ///< 16, 32, or 64-bit immediate, depending on operand size
+    X = 0x020,    ///< Invalid in 64-bit mode
+    P = 0x040,    ///< Prefix
+    S = 0x080,    ///< Needs special handling
+    R8 = 0x100,   ///< 8-bit relative branch target
+    R32 = 0x200   ///< 32-bit relative branch target
+  };
+
+  static const uint16_t OneByte[256] = {
+    /* 00 */ M, M, M, M, I8, IZ, X, X, M, M, M, M, I8, IZ, X, 0,
+    /* 10 */ M, M, M, M, I8, IZ, X, X, M, M, M, M, I8, IZ, X, X,
+    /* 20 */ M, M, M, M, I8, IZ, P, X, M, M, M, M, I8, IZ, P, X,
+    /* 30 */ M, M, M, M, I8, IZ, P, X, M, M, M, M, I8, IZ, P, X,
+    /* 40 */ P, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+    /* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 60 */ X, X, X, M, P, P, P, P, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+    /* 70 */ R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8,
+    /* 80 */ M|I8, M|IZ, X, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, X, 0, 0, 0, 0, 0,
+    /* A0 */ S, S, S, S, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+    /* B0 */ I8, I8, I8, I8, I8, I8, I8, I8, IV, IV, IV, IV, IV, IV, IV, IV,
+    /* C0 */ M|I8, M|I8, I16, 0, X, X, M|I8, M|IZ, S, 0, I16, 0, 0, I8, X, 0,
+    /* D0 */ M, M, M, M, X, X, X, 0, M, M, M, M, M, M, M, M,
+    /* E0 */ R8, R8, R8, R8, I8, I8, I8, I8, R32, R32, X, R8, 0, 0, 0, 0,
+    /* F0 */ P, 0, P, P, 0, 0, M|S, M|S, 0, 0, 0, 0, 0, 0, M, M
+  };
+
+  static const uint16_t TwoByte[256] = {
+    /* 00 */ M, M, M, M, X, 0, 0, 0, 0, 0, X, 0, X, M, 0, M|I8,
+    /* 10 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 20 */ M, M, M, M, X, X, X, X, M, M, M, M, M, M, M, M,
+    /* 30 */ 0, 0, 0, 0, 0, 0, 0, 0, S, X, S, X, X, X, X, X,
+    /* 40 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 50 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 60 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 70 */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M, M, X, X, M, M, M, M,
+    /* 80 */ R32, R32, R32, R32, R32, R32, R32, R32, R32, R32, R32, R32, R32, R32, R32, R32,
+    /* 90 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* A0 */ 0, 0, 0, M, M|I8, M, X, X, 0, 0, 0, M, M|I8, M, M, M,
+    /* B0 */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+    /* C0 */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* D0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* E0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* F0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M
+  };
+
+  /// A decoded instruction. Registers are numbered 0-15 regardless of operand width.
+  struct instruction {
+    op type;
+    uint8_t size;
+    int cond;         ///< Condition code for jcc
+    int reg;          ///< The ModRM reg operand, or NoRegister
+    int rm;           ///< The ModRM rm operand if it is a register, or NoRegister. For cmp
+                      ///< with the accumulator and an immediate, the accumulator.
+    bool mem;         ///< Does the ModRM byte encode a memory operand?
+    int base;         ///< Memory operand base register, RIP, or NoRegister
+    int index;        ///< Memory operand index register, or NoRegister
+    uint8_t scale;
+    int64_t disp;
+    uint64_t imm;     ///< Immediate operand, truncated to the operand size
+    int64_t rel;      ///< Relative branch displacement
+    int writes;       ///< A general purpose register written by the instruction, if known
+  };
+
+  /// Decode one instruction from at most `avail` bytes. Returns false if the bytes run out
+  /// before the instruction does. Undecodable instructions are one byte long and invalid.
+  static bool decode(const uint8_t* p, size_t avail, bool mode64, instruction& insn) {
+    insn.type = op::other;
+    insn.cond = 0;
+    insn.reg = insn.rm = insn.base = insn.index = insn.writes = NoRegister;
+    insn.mem = false;
+    insn.scale = 0;
+    insn.disp = 0;
+    insn.imm = 0;
+    insn.rel = 0;
+
+    size_t n = 0;
+    bool opsize16 = false;
+    bool addr16 = false;   // Only possible in 32-bit mode
+    bool addr32 = false;   // Only possible in 64-bit mode
+    uint8_t rex = 0;
+
+    #define NEXT_BYTE(b) if(n >= avail) return false; b = p[n++]
+
+    // Legacy prefixes, then REX. A REX byte only counts if it comes last.
+    uint8_t b;
+    while(true) {
+      NEXT_BYTE(b);
+      if(b == 0x66) {
+        opsize16 = true;
+      } else if(b == 0x67) {
+        if(mode64) addr32 = true;
+        else addr16 = true;
+      } else if(b == 0xF0 || b == 0xF2 || b == 0xF3 || b == 0x2E || b == 0x36 ||
+                b == 0x3E || b == 0x26 || b == 0x64 || b == 0x65) {
+        // Lock, repeat, and segment prefixes don't change the length
+      } else if(mode64 && b >= 0x40 && b <= 0x4F) {
+        rex = b;
+        NEXT_BYTE(b);
+        break;
+      } else {
+        break;
+      }
+
+      if(n >= MaxInstructionSize) break;
+    }
+
+    if(rex & 0x8) opsize16 = false;
+
+    uint16_t flags;
+    uint8_t opcode = b;
+    bool two_byte = false;
+    bool vex = false;
+
+    if(opcode == 0x0F) {
+      NEXT_BYTE(opcode);
+      two_byte = true;
+      if(opcode == 0x38) {
+        NEXT_BYTE(opcode);
+        flags = M;
+      } else if(opcode == 0x3A) {
+        NEXT_BYTE(opcode);
+        flags = M|I8;
+      } else {
+        flags = TwoByte[opcode];
+      }
+
+    } else if(opcode == 0xC4 || opcode == 0xC5 || opcode == 0x62 || opcode == 0x8F) {
+      // These all need at least one more byte, whatever they turn out to be
+      if(n >= avail) return false;
+
+      // VEX (C4, C5), EVEX (62), or XOP (8F). In 32-bit mode, C4, C5 and 62 are only prefixes
+      // if the next byte would be a register ModRM. XOP reuses pop r/m, but with map numbers
+      // that can't be the reg field of a pop.
+      if(opcode == 0x8F) vex = (p[n] & 0x1F) >= 8;
+      else vex = mode64 || (p[n] & 0xC0) == 0xC0;
+
+      if(!vex) {
+        flags = (opcode == 0x8F || !mode64) ? M : X;
+      } else {
+        uint8_t escape = opcode;
+        uint8_t p0;
+        unsigned map = 1;
+        NEXT_BYTE(p0);
+        if(escape == 0xC5) {
+          if(!(p0 & 0x80)) rex |= 0x4;
+        } else {
+          uint8_t p1;
+          NEXT_BYTE(p1);
+          map = p0 & 0x1F;
+          if(escape == 0x62) {
+            // EVEX has a third payload byte and only three map bits
+            uint8_t p2;
+            NEXT_BYTE(p2);
+            (void)p2;
+            map = p0 & 0x07;
+          }
+          if(!(p0 & 0x80)) rex |= 0x4;
+          if(!(p0 & 0x40)) rex |= 0x2;
+          if(!(p0 & 0x20)) rex |= 0x1;
+          if(p1 & 0x80) rex |= 0x8;
+        }
+
+        NEXT_BYTE(opcode);
+        if(escape == 0x8F) {
+          if(map == 0x8) flags = M|I8;
+          else if(map == 0xA) flags = M|IZ;
+          else flags = M;
+        } else if(map == 1) {
+          // Everything in map 1 has a ModRM byte except vzeroupper and vzeroall
+          flags = (opcode == 0x77) ? 0 : (M | (TwoByte[opcode] & I8));
+        } else if(map == 3) {
+          flags = M|I8;
+        } else {
+          flags = M;
+        }
+      }
+
+    } else {
+      flags = OneByte[opcode];
+
+      // Opcodes that differ in 32-bit mode
+      if(!mode64) {
+        if(opcode >= 0x40 && opcode <= 0x4F) flags = 0;   // inc and dec
+        else if(opcode == 0x82) flags = M|I8;
+        else if(opcode == 0xD4 || opcode == 0xD5) flags = I8;
+        else if(flags == X) flags = 0;
+      }
+    }
+
+    // A prefix where an opcode should be, e.g. after a REX byte
+    if(flags & P)
+      flags = X;
+
+    if(flags & X) {
+      insn.type = op::invalid;
+      insn.size = 1;
+      return true;
+    }
+
+    // Decode the ModRM byte, SIB byte, and displacement
+    int modrm_reg = 0;
+    if(flags & M) {
+      uint8_t modrm;
+      NEXT_BYTE(modrm);
+      unsigned mod = modrm >> 6;
+      unsigned rm = modrm & 7;
+      modrm_reg = (modrm >> 3) & 7;
+      insn.reg = modrm_reg | ((rex & 0x4) << 1);
+
+      if(mod == 3) {
+        insn.rm = rm | ((rex & 0x1) << 3);
+      } else {
+        insn.mem = true;
+        size_t disp_size = (mod == 1) ? 1 : (mod == 2) ? (addr16 ? 2 : 4) : 0;
+
+        if(addr16) {
+          // 16-bit addressing has no SIB byte, and a direct address in place of [bp]
+          if(mod == 0 && rm == 6) disp_size = 2;
+        } else if(rm == 4) {
+          uint8_t sib;
+          NEXT_BYTE(sib);
+          unsigned sib_base = sib & 7;
+          unsigned sib_index = ((sib >> 3) & 7) | ((rex & 0x2) << 2);
+          insn.scale = 1 << (sib >> 6);
+          if(sib_index != 4) insn.index = sib_index;
+          if(mod == 0 && sib_base == 5) disp_size = 4;
+          else insn.base = sib_base | ((rex & 0x1) << 3);
+        } else if(mod == 0 && rm == 5) {
+          disp_size = 4;
+          if(mode64) insn.base = RIP;
+        } else {
+          insn.base = rm | ((rex & 0x1) << 3);
+        }
+
+        if(n + disp_size > avail) return false;
+        if(disp_size == 1) {
+          insn.disp = (int8_t)p[n];
+        } else if(disp_size == 2) {
+          int16_t d;
+          memcpy(&d, p + n, 2);
+          insn.disp = d;
+        } else if(disp_size == 4) {
+          int32_t d;
+          memcpy(&d, p + n, 4);
+          insn.disp = d;
+        }
+        n += disp_size;
+      }
+    }
+
+    // Find the operand size, then the immediate size
+    unsigned opsize = (rex & 0x8) ? 8 : opsize16 ? 2 : 4;
+    unsigned imm_opsize = (opsize == 2) ? 2 : 4;
+
+    size_t imm_size = 0;
+    if(flags & I8) imm_size += 1;
+    if(flags & I16) imm_size += 2;
+    if(flags & IZ) imm_size += imm_opsize;
+    if(flags & IV) imm_size += opsize;
+    if(flags & R8) imm_size += 1;
+    if(flags & R32) imm_size += 4;
+
+    if((flags & S) && !two_byte && !vex) {
+      if(opcode == 0xF6 || opcode == 0xF7) {
+        // Group 3: test has an immediate, the other members don't
+        if(modrm_reg == 0 || modrm_reg == 1) imm_size = (opcode == 0xF6) ? 1 : imm_opsize;
+      } else if(opcode >= 0xA0 && opcode <= 0xA3) {
+        // Moves to and from an absolute address
+        imm_size = mode64 ? (addr32 ? 4 : 8) : (addr16 ? 2 : 4);
+      } else if(opcode == 0xC8) {
+        // enter
+        imm_size = 3;
+      }
+    } else if(!mode64 && !two_byte && !vex && (opcode == 0x9A || opcode == 0xEA)) {
+      // Far call and jump with a pointer operand
+      imm_size = opsize16 ? 4 : 6;
+    }
+
+    if(n + imm_size > avail) return false;
+
+    // Read relative branch targets and immediates
+    const uint8_t* imm = p + n;
+    if(flags & R8) {
+      insn.rel = (int8_t)imm[0];
+    } else if(flags & R32) {
+      int32_t rel;
+      memcpy(&rel, imm, 4);
+      insn.rel = rel;
+    } else if(imm_size == 1) {
+      insn.imm = (uint64_t)(int64_t)(int8_t)imm[0];
+    } else if(imm_size == 2) {
+      int16_t v;
+      memcpy(&v, imm, 2);
+      insn.imm = (uint64_t)(int64_t)v;
+    } else if(imm_size == 4) {
+      int32_t v;
+      memcpy(&v, imm, 4);
+      insn.imm = (uint64_t)(int64_t)v;
+    } else if(imm_size == 8) {
+      memcpy(&insn.imm, imm, 8);
+    }
+    n += imm_size;
+
+    #undef NEXT_BYTE
+
+    if(n > MaxInstructionSize) {
+      insn.type = op::invalid;
+      insn.size = 1;
+      return true;
+    }
+    insn.size = n;
+
+    if(vex)
+      return true;
+
+    // Classify the instruction, and note which register it writes for the common cases
+    if(!two_byte) {
+      if(opcode >= 0x70 && opcode <= 0x7F) {
+        insn.type = op::jcc;
+        insn.cond = opcode & 0xF;
+      } else if(opcode == 0xE3) {
+        insn.type = op::jrcxz;
+      } else if(opcode == 0xE9 || opcode == 0xEB) {
+        insn.type = op::jmp;
+      } else if(opcode == 0xFF && (modrm_reg == 4 || modrm_reg == 5)) {
+        insn.type = op::jmp_indirect;
+      } else if(opcode == 0xC3 || opcode == 0xC2 || opcode == 0xCB || opcode == 0xCA) {
+        insn.type = op::ret;
+      } else if(!mode64 && opcode == 0xEA) {
+        insn.type = op::jmp_indirect;
+      } else if(opcode == 0x3C || opcode == 0x3D || ((opcode == 0x80 || opcode == 0x81 || opcode == 0x83) && modrm_reg == 7)) {
+        insn.type = op::cmp;
+        // Truncate the sign-extended immediate to the operand size
+        unsigned size = (opcode == 0x3C || opcode == 0x80) ? 1 : opsize;
+        if(size < 8) insn.imm &= ((uint64_t)1 << (size * 8)) - 1;
+        if(opcode == 0x3C || opcode == 0x3D) insn.rm = 0;
+      } else if(opcode == 0x8D) {
+        insn.type = op::lea;
+        insn.writes = insn.reg;
+      } else if(opcode == 0x63 && mode64) {
+        insn.type = op::movsxd;
+        insn.writes = insn.reg;
+      } else if(opcode == 0x01 || opcode == 0x03) {
+        insn.type = op::add;
+        if(!insn.mem) insn.writes = (opcode == 0x01) ? insn.rm : insn.reg;
+      } else if(opcode < 0x40 && (opcode & 7) <= 3 && (opcode & 0x38) != 0x38) {
+        // Other ALU operations write their first operand
+        insn.writes = (opcode & 2) ? insn.reg : insn.rm;
+      } else if(opcode == 0x89 || opcode == 0x8B) {
+        insn.type = op::mov;
+        insn.writes = (opcode & 2) ? insn.reg : insn.rm;
+      } else if(opcode == 0x88 || opcode == 0x8A) {
+        insn.writes = (opcode & 2) ? insn.reg : insn.rm;
+      } else if(opcode == 0x69 || opcode == 0x6B) {
+        insn.writes = insn.reg;
+      } else if(opcode == 0xC6 || opcode == 0xC7) {
+        insn.writes = insn.rm;
+      } else if((opcode == 0x80 || opcode == 0x81 || opcode == 0x83 || opcode == 0xC0 ||
+                 opcode == 0xC1 || (opcode >= 0xD0 && opcode <= 0xD3)) && modrm_reg != 7) {
+        insn.writes = insn.rm;
+      } else if(opcode >= 0xB0 && opcode <= 0xBF) {
+        insn.writes = (opcode & 7) | ((rex & 0x1) << 3);
+      } else if(mode64 && opcode >= 0x58 && opcode <= 0x5F) {
+        insn.writes = (opcode & 7) | ((rex & 0x1) << 3);
+      } else if((opcode == 0xFE || opcode == 0xFF) && modrm_reg <= 1) {
+        insn.writes = insn.rm;
+      } else if(opcode == 0xF7 && (modrm_reg == 2 || modrm_reg == 3)) {
+        insn.writes = insn.rm;
+      }
+    } else {
+      if(opcode >= 0x80 && opcode <= 0x8F) {
+        insn.type = op::jcc;
+        insn.cond = opcode & 0xF;
+      } else if(opcode == 0xB6 || opcode == 0xB7) {
+        insn.type = op::movzx;
+        insn.writes = insn.reg;
+      } else if((opcode >= 0x40 && opcode <= 0x4F) || opcode == 0xAF || opcode == 0xBE || opcode == 0xBF) {
+        insn.writes = insn.reg;
+      }
+    }
+
+    return true;
+  }
+
+  /// Decodes a sequence of instructions, with the same interface as disassembler
+  class decoder {
+  private:
+    const uint8_t* _code;   ///< Code for the address `_start`
+    uintptr_t _start;
+    uintptr_t _end;
+    uintptr_t _pc;          ///< Address of the current instruction
+    instruction _insn;
+    bool _done;
+    std::string _text;
+
+  public:
+    /// Decode code stored at `code` as if it were loaded at address `start`
+    decoder(const uint8_t* code, uintptr_t start, uintptr_t end) :
+        _code(code), _start(start), _end(end), _pc(start), _done(false) {
+      _insn.size = 0;
+      decodeCurrent();
+    }
+
+    /// Decode the next instruction
+    void next() {
+      if(_done) return;
+      _pc += _insn.size;
+      decodeCurrent();
+    }
+
+    /// Has decoding reached the end of the code, or an instruction that doesn't fit?
+    bool done() const { return _done; }
+
+    const instruction& get() const { return _insn; }
+
+    /// Check if this instruction is a branch of some sort (not a call!)
+    bool branches() const {
+      return _insn.type == op::jcc || _insn.type == op::jrcxz ||
+             _insn.type == op::jmp || _insn.type == op::jmp_indirect;
+    }
+
+    /// Check if execution can continue to the next instruction
+    bool fallsThrough() const {
+      return _insn.type != op::jmp && _insn.type != op::jmp_indirect &&
+             _insn.type != op::ret && _insn.type != op::invalid;
+    }
+
+    /// Does the branch target depend on register or memory values?
+    bool dynamicTarget() const { return _insn.type == op::jmp_indirect; }
+
+    /// Get the destination of a direct branch
+    uintptr_t target() const { return limit() + _insn.rel; }
+
+    uintptr_t base() const { return _pc; }
+    uintptr_t limit() const { return _pc + _insn.size; }
+    size_t size() const { return _insn.size; }
+
+    /// Format the instruction with udis86, for diagnostics
+    const char* toString() {
+      disassembler d(_code + (_pc - _start), _pc, _end);
+      _text = d.toString();
+      return _text.c_str();
+    }
+
+  private:
+    void decodeCurrent() {
+      if(_pc >= _end || !decode(_code + (_pc - _start), _end - _pc, _IS_X86_64, _insn))
+        _done = true;
+    }
+  };
+}
+
+#endif
@@ -11,6 +11,27 @@
 
 using std::string;
 
+/// Get the sign-extended displacement of a memory operand
+static int64_t getDisplacement(const ud_operand_t& op) {
+  switch(op.offset) {
+    case 8: return op.lval.sbyte;
+    case 16: return op.lval.sword;
+    case 32: return op.lval.sdword;
+    case 64: return op.lval.sqword;
+    default: return 0;
+  }
+}
+
+/// Get the value of an immediate operand, truncated to the operand size
+static uint64_t getImmediate(const ud_operand_t& op) {
+  switch(op.size) {
+    case 8: return op.lval.ubyte;
+    case 16: return op.lval.uword;
+    case 32: return op.lval.udword;
+    default: return op.lval.uqword;
+  }
+}
+
 class branch_target {
 private:
 	uintptr_t _pc;
@@ -59,16 +80,8 @@ public:
 				return 0;
 			}
       
-			// Add the offset, if any
-			if(_op.size == 8) {
-				p += _op.lval.sbyte;
-			} else if(_op.size == 16) {
-				p += _op.lval.sword;
-			} else if(_op.size == 32) {
-				p += _op.lval.sdword;
-			} else if(_op.size == 64) {
-				p += _op.lval.sqword;
-			}
+			// Add the displacement, if any
+			p += getDisplacement(_op);
 			return *(uintptr_t*)p;
 		}
 		WARNING("Unsupported jump target operand type");
@@ -82,13 +95,17 @@ private:
   bool _done;
 	
 public:
-  /// Initialize the libudis86 object and begin disassembly
-	disassembler(uintptr_t start, uintptr_t end = std::numeric_limits<uintptr_t>::max()) : _done(false) {
+  /// Initialize the libudis86 object and begin disassembly of code at the given address
+	disassembler(uintptr_t start, uintptr_t end = std::numeric_limits<uintptr_t>::max()) :
+    disassembler((const uint8_t*)start, start, end) {}
+  
+  /// Disassemble code stored at `code` as if it were loaded at address `start` (e.g. from a file)
+  disassembler(const uint8_t* code, uintptr_t start, uintptr_t end) : _done(false) {
 		ud_init(&_ud);
 		ud_set_syntax(&_ud, UD_SYN_INTEL);
 		_X86(ud_set_mode(&_ud, 32));
 		_X86_64(ud_set_mode(&_ud, 64));
-		ud_set_input_buffer(&_ud, (uint8_t*)start, end - start);
+		ud_set_input_buffer(&_ud, (uint8_t*)code, end - start);
 		ud_set_pc(&_ud, start);
 		// Disassemble the first instruction
 		next();
@@ -164,6 +181,16 @@ public:
     return _ud.inp_ctr;
   }
   
+  /// Get the instruction mnemonic
+  ud_mnemonic_code_t mnemonic() {
+    return _ud.mnemonic;
+  }
+  
+  /// Get one of the instruction's operands
+  const ud_operand_t& operand(size_t i) {
+    return _ud.operand[i];
+  }
+  
   /// Get the branch target for this instruction (always in operand 0)
 	branch_target target() {
     return branch_target(_ud.pc, _ud.operand[0]);
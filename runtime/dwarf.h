@@ -0,0 +1,404 @@
+#if !defined(CAUSAL_RUNTIME_DWARF_H)
+#define CAUSAL_RUNTIME_DWARF_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ehframe.h"
+#include "interval.h"
+#include "log.h"
+
+/// Minimal DWARF debug info reader. Only the first entry of each compilation unit is read, for
+/// the name of its primary source file and the directory it was compiled in. Code ranges come
+/// from .debug_aranges, or from the unit's own low and high PC when it has one contiguous range.
+namespace dwarf {
+  enum {
+    DW_TAG_compile_unit = 0x11,
+    DW_TAG_partial_unit = 0x3c,
+    DW_TAG_skeleton_unit = 0x4a
+  };
+
+  enum {
+    DW_AT_name = 0x03,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_comp_dir = 0x1b,
+    DW_AT_str_offsets_base = 0x72
+  };
+
+  enum {
+    DW_FORM_addr = 0x01,
+    DW_FORM_block2 = 0x03,
+    DW_FORM_block4 = 0x04,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_block = 0x09,
+    DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_flag = 0x0c,
+    DW_FORM_sdata = 0x0d,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_ref_addr = 0x10,
+    DW_FORM_ref1 = 0x11,
+    DW_FORM_ref2 = 0x12,
+    DW_FORM_ref4 = 0x13,
+    DW_FORM_ref8 = 0x14,
+    DW_FORM_ref_udata = 0x15,
+    DW_FORM_indirect = 0x16,
+    DW_FORM_sec_offset = 0x17,
+    DW_FORM_exprloc = 0x18,
+    DW_FORM_flag_present = 0x19,
+    DW_FORM_strx = 0x1a,
+    DW_FORM_addrx = 0x1b,
+    DW_FORM_ref_sup4 = 0x1c,
+    DW_FORM_strp_sup = 0x1d,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_ref_sig8 = 0x20,
+    DW_FORM_implicit_const = 0x21,
+    DW_FORM_loclistx = 0x22,
+    DW_FORM_rnglistx = 0x23,
+    DW_FORM_ref_sup8 = 0x24,
+    DW_FORM_strx1 = 0x25,
+    DW_FORM_strx2 = 0x26,
+    DW_FORM_strx3 = 0x27,
+    DW_FORM_strx4 = 0x28,
+    DW_FORM_addrx1 = 0x29,
+    DW_FORM_addrx2 = 0x2a,
+    DW_FORM_addrx3 = 0x2b,
+    DW_FORM_addrx4 = 0x2c,
+    DW_FORM_GNU_addr_index = 0x1f01,
+    DW_FORM_GNU_str_index = 0x1f02,
+    DW_FORM_GNU_ref_alt = 0x1f20,
+    DW_FORM_GNU_strp_alt = 0x1f21
+  };
+
+  enum {
+    DW_UT_compile = 0x01,
+    DW_UT_partial = 0x03,
+    DW_UT_skeleton = 0x04
+  };
+
+  /// The contents of one debug section in memory. Missing sections are empty.
+  struct section {
+    const uint8_t* data = NULL;
+    size_t size = 0;
+  };
+
+  struct sections {
+    section info;
+    section abbrev;
+    section aranges;
+    section str;
+    section line_str;
+    section str_offsets;
+  };
+
+  /// The code ranges of one compilation unit, and the path of its primary source file
+  struct unit {
+    std::string path;
+    std::vector<interval> ranges;
+  };
+
+  /// The fields of a unit header needed to read its attributes
+  struct unit_header {
+    uint16_t version;
+    uint8_t address_size;
+    uint8_t offset_size;
+  };
+
+  /// An attribute value. String forms that index the string offsets table keep the index in
+  /// `number` until the unit's string offsets base is known.
+  struct value {
+    uint64_t number = 0;
+    const char* string = NULL;
+    bool indexed = false;
+    bool constant = false;
+  };
+
+  /// Get a string at an offset in a string section, or NULL if the offset is bad
+  static const char* getString(const section& s, uint64_t offset) {
+    if(s.data == NULL || offset >= s.size)
+      return NULL;
+    const char* p = (const char*)s.data + offset;
+    return strnlen(p, s.size - offset) < s.size - offset ? p : NULL;
+  }
+
+  /// Read one attribute value, or skip over it if it isn't a string, address, or constant
+  static void readValue(ehframe::reader& r, uint64_t form, int64_t implicit, const unit_header& u,
+                        const sections& s, value& v) {
+    uint64_t offset;
+    switch(form) {
+      case DW_FORM_addr: v.number = u.address_size == 4 ? r.u32() : r.u64(); break;
+
+      case DW_FORM_data1: v.number = r.u8(); v.constant = true; break;
+      case DW_FORM_data2: v.number = r.u16(); v.constant = true; break;
+      case DW_FORM_data4: v.number = r.u32(); v.constant = true; break;
+      case DW_FORM_data8: v.number = r.u64(); v.constant = true; break;
+      case DW_FORM_udata: v.number = r.uleb128(); v.constant = true; break;
+      case DW_FORM_sdata: v.number = r.sleb128(); v.constant = true; break;
+      case DW_FORM_implicit_const: v.number = implicit; v.constant = true; break;
+
+      case DW_FORM_string: v.string = r.string(); break;
+      case DW_FORM_strp:
+        offset = u.offset_size == 8 ? r.u64() : r.u32();
+        v.string = getString(s.str, offset);
+        break;
+      case DW_FORM_line_strp:
+        offset = u.offset_size == 8 ? r.u64() : r.u32();
+        v.string = getString(s.line_str, offset);
+        break;
+      case DW_FORM_strx:
+      case DW_FORM_GNU_str_index: v.number = r.uleb128(); v.indexed = true; break;
+      case DW_FORM_strx1: v.number = r.u8(); v.indexed = true; break;
+      case DW_FORM_strx2: v.number = r.u16(); v.indexed = true; break;
+      case DW_FORM_strx3: v.number = r.u16(); v.number |= (uint64_t)r.u8() << 16; v.indexed = true; break;
+      case DW_FORM_strx4: v.number = r.u32(); v.indexed = true; break;
+      // This is also the form of DW_AT_str_offsets_base
+      case DW_FORM_sec_offset: v.number = u.offset_size == 8 ? r.u64() : r.u32(); break;
+
+      // Everything else is skipped
+      case DW_FORM_flag_present: break;
+      case DW_FORM_flag:
+      case DW_FORM_ref1:
+      case DW_FORM_addrx1: r.u8(); break;
+      case DW_FORM_ref2:
+      case DW_FORM_addrx2: r.u16(); break;
+      case DW_FORM_addrx3: r.skip(3); break;
+      case DW_FORM_ref4:
+      case DW_FORM_ref_sup4:
+      case DW_FORM_addrx4: r.u32(); break;
+      case DW_FORM_ref8:
+      case DW_FORM_ref_sig8:
+      case DW_FORM_ref_sup8: r.u64(); break;
+      case DW_FORM_data16: r.skip(16); break;
+      case DW_FORM_ref_udata:
+      case DW_FORM_addrx:
+      case DW_FORM_GNU_addr_index:
+      case DW_FORM_loclistx:
+      case DW_FORM_rnglistx: r.uleb128(); break;
+      case DW_FORM_strp_sup:
+      case DW_FORM_GNU_ref_alt:
+      case DW_FORM_GNU_strp_alt: r.skip(u.offset_size); break;
+      // Version 2 references are address-sized
+      case DW_FORM_ref_addr: r.skip(u.version == 2 ? u.address_size : u.offset_size); break;
+      case DW_FORM_block1: r.skip(r.u8()); break;
+      case DW_FORM_block2: r.skip(r.u16()); break;
+      case DW_FORM_block4: r.skip(r.u32()); break;
+      case DW_FORM_block:
+      case DW_FORM_exprloc: r.skip(r.uleb128()); break;
+      case DW_FORM_indirect: {
+        uint64_t actual = r.uleb128();
+        // An indirect form can't name itself or carry an implicit constant
+        if(actual == DW_FORM_indirect || actual == DW_FORM_implicit_const) r.fail();
+        else readValue(r, actual, 0, u, s, v);
+        break;
+      }
+      // An unknown form has an unknown size, so nothing after it can be read
+      default: r.fail();
+    }
+  }
+
+  /// Find the attribute specifications for an abbreviation code. Returns false if there is none.
+  static bool findAbbrev(const section& abbrev, uint64_t offset, uint64_t code, ehframe::reader& specs,
+                         uint64_t& tag) {
+    if(offset >= abbrev.size)
+      return false;
+    specs.seek(offset);
+    while(!specs.done()) {
+      uint64_t c = specs.uleb128();
+      if(c == 0) return false;
+      tag = specs.uleb128();
+      specs.u8();
+      if(c == code) return !specs.failed();
+
+      // Skip this abbreviation's attribute specifications
+      uint64_t attr, form;
+      do {
+        attr = specs.uleb128();
+        form = specs.uleb128();
+        if(form == DW_FORM_implicit_const) specs.sleb128();
+      } while(!specs.failed() && (attr != 0 || form != 0));
+    }
+    return false;
+  }
+
+  /// Read the first entry of the unit at the reader's position. Returns false if the unit has no
+  /// source path. The reader is left somewhere inside the unit.
+  static bool readUnit(ehframe::reader& r, size_t unit_end, uint16_t version, uint8_t offset_size,
+                       const sections& s, unit& result) {
+    unit_header u;
+    u.version = version;
+    u.offset_size = offset_size;
+
+    uint64_t abbrev_offset;
+    if(version >= 5) {
+      uint8_t type = r.u8();
+      u.address_size = r.u8();
+      abbrev_offset = offset_size == 8 ? r.u64() : r.u32();
+      if(type != DW_UT_compile && type != DW_UT_partial && type != DW_UT_skeleton)
+        return false;
+      // Skeleton units have an ID for their split unit
+      if(type == DW_UT_skeleton) r.u64();
+    } else {
+      abbrev_offset = offset_size == 8 ? r.u64() : r.u32();
+      u.address_size = r.u8();
+    }
+    if(r.failed() || (u.address_size != 4 && u.address_size != 8))
+      return false;
+
+    ehframe::reader specs(s.abbrev.data, s.abbrev.size, 0);
+    uint64_t tag;
+    if(!findAbbrev(s.abbrev, abbrev_offset, r.uleb128(), specs, tag) ||
+       (tag != DW_TAG_compile_unit && tag != DW_TAG_partial_unit && tag != DW_TAG_skeleton_unit))
+      return false;
+
+    value name, comp_dir, low_pc, high_pc, str_offsets_base;
+    while(!specs.failed() && !r.failed() && r.offset() <= unit_end) {
+      uint64_t attr = specs.uleb128();
+      uint64_t form = specs.uleb128();
+      int64_t implicit = form == DW_FORM_implicit_const ? specs.sleb128() : 0;
+      if(attr == 0 && form == 0) break;
+
+      value v;
+      readValue(r, form, implicit, u, s, v);
+      switch(attr) {
+        case DW_AT_name: name = v; break;
+        case DW_AT_comp_dir: comp_dir = v; break;
+        case DW_AT_low_pc: low_pc = v; break;
+        case DW_AT_high_pc: high_pc = v; break;
+        case DW_AT_str_offsets_base: str_offsets_base = v; break;
+      }
+    }
+    if(specs.failed() || r.failed() || r.offset() > unit_end)
+      return false;
+
+    // Indexed strings are found through the unit's slice of the string offsets table, which
+    // starts after the table's 8-byte header if the unit doesn't say where
+    uint64_t base = str_offsets_base.number != 0 ? str_offsets_base.number : 8;
+    for(value* v : { &name, &comp_dir }) {
+      if(!v->indexed) continue;
+      if(base > s.str_offsets.size || v->number >= (s.str_offsets.size - base) / offset_size) continue;
+      uint64_t entry = base + v->number * offset_size;
+      ehframe::reader offsets(s.str_offsets.data, s.str_offsets.size, 0);
+      offsets.seek(entry);
+      v->string = getString(s.str, offset_size == 8 ? offsets.u64() : offsets.u32());
+    }
+
+    if(name.string == NULL || name.string[0] == '\0')
+      return false;
+    if(name.string[0] == '/' || comp_dir.string == NULL || comp_dir.string[0] == '\0')
+      result.path = name.string;
+    else
+      result.path = std::string(comp_dir.string) + "/" + name.string;
+
+    // The high PC is either an address or the size of the unit's code
+    if(!low_pc.constant && !low_pc.indexed && low_pc.number != 0 && high_pc.number != 0) {
+      uint64_t limit = high_pc.constant ? low_pc.number + high_pc.number : high_pc.number;
+      if(limit > low_pc.number)
+        result.ranges.push_back(interval(low_pc.number, limit));
+    }
+    return true;
+  }
+
+  /// Read the ranges for each unit from .debug_aranges. `units` maps the offset of each unit in
+  /// .debug_info to its index in `ranges`.
+  static void readAranges(const section& aranges, const std::map<uint64_t, size_t>& units,
+                          std::vector<std::vector<interval>>& ranges) {
+    ehframe::reader r(aranges.data, aranges.size, 0);
+    while(!r.done()) {
+      size_t set_start = r.offset();
+      uint64_t length = r.u32();
+      uint8_t offset_size = 4;
+      if(length == 0xffffffff) {
+        length = r.u64();
+        offset_size = 8;
+      }
+      if(r.failed() || length > aranges.size - r.offset())
+        return;
+      size_t set_end = r.offset() + length;
+
+      r.u16();
+      uint64_t info_offset = offset_size == 8 ? r.u64() : r.u32();
+      uint8_t address_size = r.u8();
+      uint8_t segment_size = r.u8();
+      if(r.failed() || (address_size != 4 && address_size != 8) || segment_size != 0)
+        return;
+
+      // Tuples start at a multiple of their size from the start of the set
+      size_t tuple_size = 2 * address_size;
+      r.seek(set_start + (r.offset() - set_start + tuple_size - 1) / tuple_size * tuple_size);
+
+      std::map<uint64_t, size_t>::const_iterator u = units.find(info_offset);
+      while(!r.failed() && r.offset() + tuple_size <= set_end) {
+        uint64_t base = address_size == 4 ? r.u32() : r.u64();
+        uint64_t size = address_size == 4 ? r.u32() : r.u64();
+        if(base == 0 && size == 0) break;
+        if(u != units.end() && base != 0 && size != 0)
+          ranges[u->second].push_back(interval(base, base + size));
+      }
+      r.seek(set_end);
+    }
+  }
+
+  /// Get the source path and code ranges of every compilation unit. Units without a name or
+  /// without code are left out.
+  static std::vector<unit> getUnits(const sections& s) {
+    std::vector<unit> result;
+    if(s.info.data == NULL || s.abbrev.data == NULL)
+      return result;
+
+    // Offsets of each unit in .debug_info, for matching address ranges to units
+    std::map<uint64_t, size_t> units;
+    ehframe::reader r(s.info.data, s.info.size, 0);
+    while(!r.done()) {
+      size_t unit_start = r.offset();
+      uint64_t length = r.u32();
+      uint8_t offset_size = 4;
+      if(length == 0xffffffff) {
+        length = r.u64();
+        offset_size = 8;
+      }
+      if(r.failed() || length == 0 || length > s.info.size - r.offset())
+        break;
+      size_t unit_end = r.offset() + length;
+      uint16_t version = r.u16();
+
+      unit u;
+      if(version >= 2 && version <= 5 && readUnit(r, unit_end, version, offset_size, s, u)) {
+        units.emplace(unit_start, result.size());
+        result.push_back(u);
+      }
+      r.seek(unit_end);
+    }
+
+    // Address ranges replace each unit's low and high PC, which may not cover all of its code
+    size_t ranged = 0;
+    std::vector<std::vector<interval>> aranges(result.size());
+    readAranges(s.aranges, units, aranges);
+    for(size_t i = 0; i < result.size(); i++) {
+      if(aranges[i].size() > 0) {
+        result[i].ranges.swap(aranges[i]);
+        ranged++;
+      }
+    }
+
+    INFO("Found %lu compilation units, %lu with address ranges", result.size(), ranged);
+
+    std::vector<unit> with_code;
+    for(unit& u : result) {
+      if(u.ranges.size() > 0) with_code.push_back(u);
+    }
+    return with_code;
+  }
+}
+
+#endif
@@ -0,0 +1,213 @@
+#if !defined(CAUSAL_RUNTIME_EHFRAME_H)
+#define CAUSAL_RUNTIME_EHFRAME_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+#include "interval.h"
+#include "log.h"
+
+/// Minimal .eh_frame reader. Every FDE (frame description entry) covers the code range of one
+/// function, which lets us recover function boundaries from binaries without a symbol table.
+/// The .eh_frame_hdr search table only indexes these same FDEs, so it isn't needed here.
+namespace ehframe {
+  /// DWARF exception header pointer encodings
+  enum {
+    DW_EH_PE_absptr = 0x00,
+    DW_EH_PE_uleb128 = 0x01,
+    DW_EH_PE_udata2 = 0x02,
+    DW_EH_PE_udata4 = 0x03,
+    DW_EH_PE_udata8 = 0x04,
+    DW_EH_PE_sleb128 = 0x09,
+    DW_EH_PE_sdata2 = 0x0a,
+    DW_EH_PE_sdata4 = 0x0b,
+    DW_EH_PE_sdata8 = 0x0c,
+    DW_EH_PE_pcrel = 0x10,
+    DW_EH_PE_datarel = 0x30,
+    DW_EH_PE_indirect = 0x80,
+    DW_EH_PE_omit = 0xff
+  };
+
+  /// Cursor over the bytes of the mapped section that also tracks their link-time address
+  class reader {
+  private:
+    const uint8_t* _base;
+    const uint8_t* _p;
+    const uint8_t* _end;
+    uintptr_t _vaddr;
+    bool _error = false;
+
+    template<typename T> T read() {
+      if(_p + sizeof(T) > _end) {
+        _error = true;
+        return 0;
+      }
+      T result;
+      memcpy(&result, _p, sizeof(T));
+      _p += sizeof(T);
+      return result;
+    }
+
+  public:
+    reader(const uint8_t* base, size_t size, uintptr_t vaddr) :
+      _base(base), _p(base), _end(base + size), _vaddr(vaddr) {}
+
+    bool done() const { return _error || _p >= _end; }
+    bool failed() const { return _error; }
+    size_t offset() const { return _p - _base; }
+    uintptr_t vaddr() const { return _vaddr + offset(); }
+    const uint8_t* position() const { return _p; }
+
+    void seek(size_t offset) {
+      if(_base + offset > _end) _error = true;
+      else _p = _base + offset;
+    }
+
+    /// Move past `size` bytes, failing if there aren't that many left
+    void skip(uint64_t size) {
+      if(size > (uint64_t)(_end - _p)) _error = true;
+      else _p += size;
+    }
+
+    /// Mark the data as unreadable, for callers that find something they can't parse
+    void fail() { _error = true; }
+
+    uint8_t u8() { return read<uint8_t>(); }
+    uint16_t u16() { return read<uint16_t>(); }
+    uint32_t u32() { return read<uint32_t>(); }
+    uint64_t u64() { return read<uint64_t>(); }
+
+    uint64_t uleb128() {
+      uint64_t result = 0;
+      unsigned shift = 0;
+      uint8_t b;
+      do {
+        b = u8();
+        if(shift < 64) result |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+      } while(!_error && (b & 0x80));
+      return result;
+    }
+
+    int64_t sleb128() {
+      int64_t result = 0;
+      unsigned shift = 0;
+      uint8_t b;
+      do {
+        b = u8();
+        if(shift < 64) result |= (int64_t)(b & 0x7f) << shift;
+        shift += 7;
+      } while(!_error && (b & 0x80));
+      if(shift < 64 && (b & 0x40)) result |= -((int64_t)1 << shift);
+      return result;
+    }
+
+    const char* string() {
+      const char* s = (const char*)_p;
+      size_t len = strnlen(s, _end - _p);
+      if(_p + len >= _end) {
+        _error = true;
+        return "";
+      }
+      _p += len + 1;
+      return s;
+    }
+
+    /// Read a pointer with the given encoding. Only the value format and pc-relative
+    /// application are needed for FDE ranges; other applications are reported as failures.
+    uintptr_t pointer(uint8_t encoding) {
+      uintptr_t field = vaddr();
+      uintptr_t value;
+      switch(encoding & 0x0f) {
+        case DW_EH_PE_absptr: value = read<uintptr_t>(); break;
+        case DW_EH_PE_uleb128: value = uleb128(); break;
+        case DW_EH_PE_udata2: value = u16(); break;
+        case DW_EH_PE_udata4: value = u32(); break;
+        case DW_EH_PE_udata8: value = u64(); break;
+        case DW_EH_PE_sleb128: value = sleb128(); break;
+        case DW_EH_PE_sdata2: value = (int16_t)u16(); break;
+        case DW_EH_PE_sdata4: value = (int32_t)u32(); break;
+        case DW_EH_PE_sdata8: value = (int64_t)u64(); break;
+        default: _error = true; return 0;
+      }
+
+      switch(encoding & 0x70) {
+        case DW_EH_PE_absptr: return value;
+        case DW_EH_PE_pcrel: return value + field;
+        default: _error = true; return 0;
+      }
+    }
+  };
+
+  /// Get the code ranges of all FDEs in an .eh_frame section. The section is at `data` in
+  /// memory and `vaddr` at link time. Returns false if the section couldn't be fully parsed.
+  static bool getRanges(const uint8_t* data, size_t size, uintptr_t vaddr, std::vector<interval>& ranges) {
+    reader r(data, size, vaddr);
+    // FDE pointer encodings, indexed by the section offset of their CIE
+    std::map<size_t, uint8_t> cie_encodings;
+
+    while(!r.done()) {
+      size_t record_offset = r.offset();
+      uint64_t length = r.u32();
+      // A zero length terminates the section
+      if(length == 0) break;
+      // An all-ones length is followed by the 64-bit length
+      if(length == 0xffffffff) length = r.u64();
+
+      size_t id_offset = r.offset();
+      size_t record_end = id_offset + length;
+      uint32_t id = r.u32();
+
+      if(id == 0) {
+        // This is a CIE. Find the FDE pointer encoding in its augmentation data.
+        uint8_t version = r.u8();
+        const char* augmentation = r.string();
+        uint8_t encoding = DW_EH_PE_absptr;
+
+        // Skip the code and data alignment factors and return address register
+        r.uleb128();
+        r.sleb128();
+        if(version == 1) r.u8();
+        else r.uleb128();
+
+        if(augmentation[0] == 'z') {
+          r.uleb128();
+          for(const char* a = augmentation + 1; *a != '\0' && !r.failed(); a++) {
+            if(*a == 'R') {
+              encoding = r.u8();
+            } else if(*a == 'L') {
+              r.u8();
+            } else if(*a == 'P') {
+              // Skip over the personality routine pointer, whatever its application
+              r.pointer(r.u8() & 0x0f);
+            } else if(*a != 'S' && *a != 'B') {
+              // Unknown augmentation. The rest of the data can't be interpreted.
+              break;
+            }
+          }
+        }
+        cie_encodings[record_offset] = encoding;
+
+      } else {
+        // This is an FDE. The ID is the distance back to its CIE.
+        std::map<size_t, uint8_t>::iterator cie = cie_encodings.find(id_offset - id);
+        if(cie != cie_encodings.end() && cie->second != DW_EH_PE_omit) {
+          uintptr_t pc_begin = r.pointer(cie->second);
+          uintptr_t pc_range = r.pointer(cie->second & 0x0f);
+          if(!r.failed() && pc_begin != 0 && pc_range != 0)
+            ranges.push_back(interval(pc_begin, pc_begin + pc_range));
+        }
+      }
+
+      if(r.failed()) return false;
+      r.seek(record_end);
+    }
+
+    return !r.failed();
+  }
+}
+
+#endif
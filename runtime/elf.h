@@ -3,15 +3,24 @@
 
 #include <elf.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "arch.h"
+#include "dwarf.h"
+#include "ehframe.h"
 #include "interval.h"
 #include "log.h"
+#include "symbols.h"
 #include "util.h"
 
 using std::map;
@@ -21,28 +30,70 @@ using std::pair;
 // is always going to be the same. Define header, section header, and symbol types for convenience.
 _X86(typedef Elf32_Ehdr ELFHeader);
 _X86(typedef Elf32_Shdr ELFSectionHeader);
+_X86(typedef Elf32_Phdr ELFProgramHeader);
 _X86(typedef Elf32_Sym ELFSymbol);
+_X86(typedef Elf32_Nhdr ELFNote);
 _X86_64(typedef Elf64_Ehdr ELFHeader);
 _X86_64(typedef Elf64_Shdr ELFSectionHeader);
+_X86_64(typedef Elf64_Phdr ELFProgramHeader);
 _X86_64(typedef Elf64_Sym ELFSymbol);
+_X86_64(typedef Elf64_Nhdr ELFNote);
 
 #if _IS_X86
 # define ELFSymbolType(x) ELF32_ST_TYPE(x)
+# define ELFSymbolBinding(x) ELF32_ST_BIND(x)
 #else
 # define ELFSymbolType(x) ELF64_ST_TYPE(x)
+# define ELFSymbolBinding(x) ELF64_ST_BIND(x)
 #endif
 
+enum {
+  SyntheticNameSize = 24
+};
+
 class ELFFile {
 private:
   int _fd;
   size_t _size;
   ELFHeader* _header;
+  /// Storage for names of functions found without symbols
+  mutable std::vector<std::unique_ptr<char[]>> _synthetic_names;
+  /// Storage for the source paths of compilation units
+  mutable std::vector<std::unique_ptr<char[]>> _source_paths;
+  
   ELFFile(int fd, size_t size, ELFHeader* header) : _fd(fd), _size(size), _header(header) {}
   
   template<typename T> T* getData(ptrdiff_t offset) const {
     return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(_header) + offset);
   }
   
+  wrapped_array<ELFSectionHeader> getSections() const {
+    ELFSectionHeader* sections = getData<ELFSectionHeader>(_header->e_shoff);
+    REQUIRE(_header->e_shentsize == sizeof(ELFSectionHeader), 
+      "ELF section header size does not match loaded file");
+
+    // Get the number of section headers
+    size_t section_count = _header->e_shnum;
+    if(section_count == 0)
+      section_count = sections->sh_size;
+    
+    return wrap(sections, section_count);
+  }
+  
+  /// Find a section by name. Returns NULL if there is no such section.
+  ELFSectionHeader* getSection(const char* name) const {
+    wrapped_array<ELFSectionHeader> sections = getSections();
+    if(_header->e_shstrndx == SHN_UNDEF || _header->e_shstrndx >= sections.size())
+      return NULL;
+    
+    const char* shstrtab = getData<const char>(sections[_header->e_shstrndx].sh_offset);
+    for(ELFSectionHeader& section : sections) {
+      if(strcmp(shstrtab + section.sh_name, name) == 0)
+        return &section;
+    }
+    return NULL;
+  }
+  
 public:
   /// Delete the copy constructor
   ELFFile(const ELFFile&) = delete;
@@ -55,25 +106,153 @@ public:
       WARNING("Failed to close ELF file");
   }
   
+  /// Get the file contents for a range of link-time addresses, or NULL if the range isn't
+  /// entirely backed by one loadable segment. This lets code be read without loading the file.
+  const uint8_t* getLoadedData(interval range) const {
+    if(_header->e_phentsize != sizeof(ELFProgramHeader))
+      return NULL;
+    
+    for(ELFProgramHeader& phdr : wrap(getData<ELFProgramHeader>(_header->e_phoff), _header->e_phnum)) {
+      if(phdr.p_type == PT_LOAD && range.getBase() >= phdr.p_vaddr &&
+         range.getLimit() <= phdr.p_vaddr + phdr.p_filesz &&
+         phdr.p_offset + phdr.p_filesz <= _size) {
+        return getData<const uint8_t>(phdr.p_offset + range.getBase() - phdr.p_vaddr);
+      }
+    }
+    return NULL;
+  }
+  
   /// Is this a dynamic shared library?
   bool isDynamic() const {
     return _header->e_type == ET_DYN;
   }
   
-  std::map<std::string, interval> getFunctions() const {
-    std::map<std::string, interval> functions;
+  /// Get the GNU build-id as a hex string, or an empty string if the file doesn't have one
+  std::string getBuildID() const {
+    for(ELFSectionHeader& section : getSections()) {
+      if(section.sh_type != SHT_NOTE)
+        continue;
+      
+      // Walk the notes in this section. Names and descriptors are padded to 4 bytes.
+      size_t offset = 0;
+      while(offset + sizeof(ELFNote) <= section.sh_size) {
+        ELFNote* note = getData<ELFNote>(section.sh_offset + offset);
+        const char* name = getData<const char>(section.sh_offset + offset + sizeof(ELFNote));
+        const uint8_t* desc = getData<const uint8_t>(section.sh_offset + offset + sizeof(ELFNote) +
+                                                     ((note->n_namesz + 3) & ~3));
+        
+        if(note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+          static const char digits[] = "0123456789abcdef";
+          std::string result;
+          for(size_t i = 0; i < note->n_descsz; i++) {
+            result += digits[desc[i] >> 4];
+            result += digits[desc[i] & 0xf];
+          }
+          return result;
+        }
+        
+        offset += sizeof(ELFNote) + ((note->n_namesz + 3) & ~3) + ((note->n_descsz + 3) & ~3);
+      }
+    }
+    return "";
+  }
+  
+  /// Get the file name and CRC from the .gnu_debuglink section. Returns false if there isn't one.
+  bool getDebugLink(std::string& name, uint32_t& crc) const {
+    ELFSectionHeader* section = getSection(".gnu_debuglink");
+    if(section == NULL || section->sh_type == SHT_NOBITS)
+      return false;
     
-    ELFSectionHeader* sections = getData<ELFSectionHeader>(_header->e_shoff);
-    REQUIRE(_header->e_shentsize == sizeof(ELFSectionHeader), 
-      "ELF section header size does not match loaded file");
-
-    // Get the number of section headers
-    size_t section_count = _header->e_shnum;
-    if(section_count == 0)
-      section_count = sections->sh_size;
+    // The name is padded to a multiple of four bytes, followed by the CRC
+    const char* data = getData<const char>(section->sh_offset);
+    size_t name_length = strnlen(data, section->sh_size);
+    size_t crc_offset = (name_length + 4) & ~3;
+    if(name_length == 0 || crc_offset + sizeof(uint32_t) > section->sh_size)
+      return false;
+    
+    name = std::string(data, name_length);
+    memcpy(&crc, data + crc_offset, sizeof(uint32_t));
+    return true;
+  }
+  
+  /// Compute the CRC-32 of the whole file, as used by .gnu_debuglink
+  uint32_t getCRC() const {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if(!table_ready) {
+      for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++) {
+          c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+      }
+      table_ready = true;
+    }
+    
+    uint32_t crc = 0xffffffff;
+    for(const uint8_t& b : wrap(getData<const uint8_t>(0), _size)) {
+      crc = table[(crc ^ b) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+  }
+  
+  /// Find and open the separate debug file for this file, or return NULL if there isn't one.
+  /// Looks in the build-id directory first, then follows .gnu_debuglink next to the file,
+  /// in its .debug subdirectory, and under the debug root.
+  ELFFile* openDebugFile(const std::string& filename, const std::string& debug_root) const {
+    std::string build_id = getBuildID();
+    
+    if(build_id.size() > 2) {
+      std::string path = debug_root + "/.build-id/" + build_id.substr(0, 2) + "/" + build_id.substr(2) + ".debug";
+      ELFFile* debug = openDebugCandidate(path, build_id, 0);
+      if(debug != NULL) return debug;
+    }
+    
+    std::string link;
+    uint32_t crc;
+    if(getDebugLink(link, crc)) {
+      size_t slash = filename.rfind('/');
+      std::string dir = (slash == std::string::npos) ? "." : filename.substr(0, slash);
+      
+      for(const std::string& path : { dir + "/" + link, dir + "/.debug/" + link, debug_root + dir + "/" + link }) {
+        // Don't open the file itself again if it names itself in its debug link
+        if(path == filename)
+          continue;
+        ELFFile* debug = openDebugCandidate(path, build_id, crc);
+        if(debug != NULL) return debug;
+      }
+    }
+    
+    return NULL;
+  }
+  
+  /// Get all functions in this file, indexed by address. Symbols from a separate debug file
+  /// are merged in, if one is given, so stripped libraries still get full function attribution.
+  /// Function names point into the mapped files, so they are only valid while both files are open.
+  function_table getFunctions(const ELFFile* debug = NULL) const {
+    std::vector<function_symbol> symbols;
+    
+    addSymbolFunctions(symbols);
+    if(debug != NULL)
+      debug->addSymbolFunctions(symbols);
+    
+    function_table functions(symbols);
+    addUnwindFunctions(functions);
+    
+    // Debug info is usually in the separate debug file if there is one
+    if(debug == NULL || !debug->addUnitSources(functions))
+      addUnitSources(functions);
+    
+    return functions;
+  }
+  
+  /// Add functions from this file's symbol tables
+  void addSymbolFunctions(std::vector<function_symbol>& functions) const {
+    wrapped_array<ELFSectionHeader> sections = getSections();
 
     // Loop over section headers
-    for(ELFSectionHeader& section : wrap(sections, section_count)) {
+    for(ELFSectionHeader& section : sections) {
       // Is this a symbol table section?
       if(section.sh_type == SHT_SYMTAB || section.sh_type == SHT_DYNSYM) {
         // Get the corresponding string table section header
@@ -85,19 +264,159 @@ public:
    
         // Get the base pointer to this section's data
         ELFSymbol* symbols = getData<ELFSymbol>(section.sh_offset);
+        
+        // Local symbols follow the STT_FILE entry for the source file they came from
+        const char* source = NULL;
    
         // Loop over symbols in this section
         for(ELFSymbol& symbol : wrap(symbols, section.sh_size / sizeof(ELFSymbol))) {
+          if(ELFSymbolType(symbol.st_info) == STT_FILE) {
+            source = strtab[symbol.st_name] == '\0' ? NULL : strtab + symbol.st_name;
+            continue;
+          }
+          
           // Only handle function symbols with a defined value
-          if(ELFSymbolType(symbol.st_info) == STT_FUNC && symbol.st_value != 0) {
-            const char* name = strtab + symbol.st_name;
-            functions[name] = interval(symbol.st_value, symbol.st_value + symbol.st_size);
+          if(ELFSymbolType(symbol.st_info) == STT_FUNC && symbol.st_value != 0 &&
+             symbol.st_shndx != SHN_UNDEF) {
+            function_symbol fn;
+            fn.base = symbol.st_value;
+            fn.size = symbol.st_size;
+            fn.name = strtab + symbol.st_name;
+            fn.source = ELFSymbolBinding(symbol.st_info) == STB_LOCAL ? source : NULL;
+            
+            // Prefer global names, then weak names, over local names
+            switch(ELFSymbolBinding(symbol.st_info)) {
+              case STB_GLOBAL: fn.rank = 0; break;
+              case STB_WEAK: fn.rank = 1; break;
+              default: fn.rank = 2;
+            }
+            
+            // Zero-size symbols may run to the end of their section
+            if(symbol.st_shndx < sections.size()) {
+              ELFSectionHeader& code_section = sections[symbol.st_shndx];
+              fn.section_limit = code_section.sh_addr + code_section.sh_size;
+            } else {
+              fn.section_limit = symbol.st_value;
+            }
+            
+            functions.push_back(fn);
           }
         }
       }
     }
+  }
+  
+  /// Add functions recovered from .eh_frame for any code not covered by a symbol.
+  /// This is the only source of function boundaries in a stripped binary.
+  void addUnwindFunctions(function_table& functions) const {
+    ELFSectionHeader* eh_frame = getSection(".eh_frame");
+    if(eh_frame == NULL || eh_frame->sh_type == SHT_NOBITS)
+      return;
+    
+    std::vector<interval> ranges;
+    if(!ehframe::getRanges(getData<const uint8_t>(eh_frame->sh_offset), eh_frame->sh_size,
+                           eh_frame->sh_addr, ranges)) {
+      WARNING("Failed to parse .eh_frame section");
+    }
     
-    return functions;
+    // Find FDE ranges that aren't covered by symbols, skipping duplicates
+    std::sort(ranges.begin(), ranges.end(), [](const interval& a, const interval& b) {
+      return a.getBase() < b.getBase();
+    });
+    std::vector<interval> uncovered;
+    for(const interval& r : ranges) {
+      if(!functions.covers(r) && (uncovered.empty() || uncovered.back().getLimit() <= r.getBase()))
+        uncovered.push_back(r);
+    }
+    
+    if(uncovered.size() == 0)
+      return;
+    
+    // Generate names for the new functions in one block that lives as long as this file
+    char* names = new char[uncovered.size() * SyntheticNameSize];
+    _synthetic_names.push_back(std::unique_ptr<char[]>(names));
+    
+    std::vector<std::pair<interval, const char*>> extra;
+    for(const interval& r : uncovered) {
+      snprintf(names, SyntheticNameSize, "sub_%lx", (unsigned long)r.getBase());
+      extra.push_back(std::make_pair(r, names));
+      names += SyntheticNameSize;
+    }
+    functions.addUncovered(extra);
+    
+    INFO("Found %lu functions without symbols in .eh_frame", uncovered.size());
+  }
+  
+  /// Get the contents of a debug section, or an empty section if it is missing or compressed
+  dwarf::section getDebugSection(const char* name) const {
+    dwarf::section result;
+    ELFSectionHeader* section = getSection(name);
+    if(section != NULL && section->sh_type != SHT_NOBITS && (section->sh_flags & SHF_COMPRESSED) == 0 &&
+       section->sh_offset <= _size && section->sh_size <= _size - section->sh_offset) {
+      result.data = getData<const uint8_t>(section->sh_offset);
+      result.size = section->sh_size;
+    }
+    return result;
+  }
+  
+  /// Give each function the source path of the compilation unit that contains it. Unlike
+  /// STT_FILE symbols, these include the source file's directory and cover global functions.
+  /// Returns false if the file has no usable debug info.
+  bool addUnitSources(function_table& functions) const {
+    dwarf::sections s;
+    s.info = getDebugSection(".debug_info");
+    s.abbrev = getDebugSection(".debug_abbrev");
+    s.aranges = getDebugSection(".debug_aranges");
+    s.str = getDebugSection(".debug_str");
+    s.line_str = getDebugSection(".debug_line_str");
+    s.str_offsets = getDebugSection(".debug_str_offsets");
+    
+    std::vector<dwarf::unit> units = dwarf::getUnits(s);
+    if(units.size() == 0)
+      return false;
+    
+    // Copy the paths into one block that lives as long as this file
+    size_t total = 0;
+    for(const dwarf::unit& u : units) {
+      total += u.path.size() + 1;
+    }
+    char* paths = new char[total];
+    _source_paths.push_back(std::unique_ptr<char[]>(paths));
+    
+    std::vector<std::pair<interval, const char*>> sources;
+    for(const dwarf::unit& u : units) {
+      memcpy(paths, u.path.c_str(), u.path.size() + 1);
+      for(const interval& r : u.ranges) {
+        sources.push_back(std::make_pair(r, paths));
+      }
+      paths += u.path.size() + 1;
+    }
+    functions.setSources(sources);
+    return true;
+  }
+  
+  /// Open a possible debug file, and check that it matches by build-id or CRC
+  static ELFFile* openDebugCandidate(const std::string& path, const std::string& build_id, uint32_t crc) {
+    if(access(path.c_str(), R_OK) != 0)
+      return NULL;
+    
+    ELFFile* debug = open(path);
+    if(debug == NULL)
+      return NULL;
+    
+    // Prefer the build-id, since checking the CRC reads the whole debug file
+    bool matches;
+    if(!build_id.empty()) matches = (debug->getBuildID() == build_id);
+    else matches = (debug->getCRC() == crc);
+    
+    if(!matches) {
+      WARNING("Ignoring mismatched debug file %s", path.c_str());
+      delete debug;
+      return NULL;
+    }
+    
+    INFO("Found debug file %s", path.c_str());
+    return debug;
   }
   
   static ELFFile* open(std::string filename) {
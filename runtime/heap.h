@@ -1,41 +1,252 @@
 #if !defined(CAUSAL_RUNTIME_HEAP_H)
 #define CAUSAL_RUNTIME_HEAP_H
 
+#include <pthread.h>
+
+#include <atomic>
 #include <heaplayers>
 #include <new>
 #include <string>
 
+#include "hugepages.h"
+
 using HL::BumpAlloc;
 using HL::LockedHeap;
 using HL::MmapHeap;
 using HL::PosixLockType;
 
-typedef SizeHeap<LockedHeap<PosixLockType, FreelistHeap<BumpAlloc<0x200000, PrivateMmapHeap>>>> SourceHeap;
+/// Chunks come from huge pages when CAUSAL_HUGE_PAGES asks for them
+typedef SizeHeap<LockedHeap<PosixLockType, FreelistHeap<BumpAlloc<hugepages::ChunkAlignment, hugepages::HugePageMmapHeap>>>> SourceHeap;
 typedef KingsleyHeap<SourceHeap, MmapHeap> CausalHeap;
 
+/// The shared private heap. Every allocation takes its lock.
 CausalHeap& getPrivateHeap();
 
+/// A cache of free objects in front of the shared private heap, owned by one thread. Sampled
+/// threads allocate sample blocks from their own heap in the signal handler, so they don't
+/// contend for the shared heap's lock. An object freed by another thread, like a sample block
+/// freed by the profiler thread, is pushed onto its owner's lock-free remote list, and the
+/// owner takes the whole list back the next time it runs out of free objects.
+///
+/// Heaps are never destroyed, because other threads may still free their objects. A heap
+/// detached from an exiting thread is reused by the next thread that attaches one, so heavy
+/// thread creation doesn't grow the number of heaps. Threads without a heap, and objects
+/// larger than the biggest size class, use the shared heap directly.
+class ThreadHeap {
+public:
+  enum {
+    /// The smallest size class. Classes are powers of two from here, and include the header
+    /// so each object fills a whole block of the shared heap.
+    MinClassSize = 32,
+    ClassCount = 13,
+    /// Each size class keeps this many bytes of free objects, or at least MinCachedObjects
+    /// objects, before it returns them to the shared heap
+    MaxCachedBytes = 0x40000,
+    MinCachedObjects = 4
+  };
+
+private:
+  /// Placed before every object. The header keeps objects 16-byte aligned.
+  struct header {
+    ThreadHeap* owner;    ///< NULL for objects allocated directly from the shared heap
+    size_t size_class;
+  };
+
+  /// Objects freed by other threads. Written by any thread, so it has a cache line to itself.
+  std::atomic<header*> _remote;
+  char _padding[64 - sizeof(std::atomic<header*>)];
+  header* _free[ClassCount];
+  size_t _free_count[ClassCount];
+  /// Set while the owner is using the heap, so a signal handler that interrupts it goes around
+  bool _busy;
+  /// The next heap in the list of detached heaps
+  ThreadHeap* _next_detached;
+
+  ThreadHeap() : _remote(nullptr), _busy(false), _next_detached(NULL) {
+    for(size_t c = 0; c < ClassCount; c++) {
+      _free[c] = NULL;
+      _free_count[c] = 0;
+    }
+  }
+
+  /// The next pointer of a free object is kept where its data would go
+  static header*& getNext(header* obj) { return *(header**)(obj + 1); }
+
+  static size_t getClassSize(size_t c) { return (size_t)MinClassSize << c; }
+
+  static size_t getClass(size_t sz) {
+    size_t c = 0;
+    while(c < ClassCount && getClassSize(c) < sz) c++;
+    return c;
+  }
+
+  static size_t getMaxCached(size_t c) {
+    size_t n = MaxCachedBytes / getClassSize(c);
+    return n < MinCachedObjects ? MinCachedObjects : n;
+  }
+
+  static ThreadHeap*& getCurrent() {
+    static __thread ThreadHeap* current = NULL;
+    return current;
+  }
+
+  /// Protects the list of detached heaps
+  static pthread_mutex_t& getDetachedLock() {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    return lock;
+  }
+
+  static ThreadHeap*& getDetached() {
+    static ThreadHeap* detached = NULL;
+    return detached;
+  }
+
+  /// Allocate an object and its header from the shared heap
+  static header* allocateShared(size_t size, ThreadHeap* owner, size_t c) {
+    header* obj = (header*)getPrivateHeap().malloc(size);
+    if(obj == NULL) return NULL;
+    obj->owner = owner;
+    obj->size_class = c;
+    return obj;
+  }
+
+  void pushRemote(header* obj) {
+    header* next = _remote.load(std::memory_order_relaxed);
+    do {
+      getNext(obj) = next;
+    } while(!_remote.compare_exchange_weak(next, obj, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  /// Return a free object to its size class, or to the shared heap if the class is full
+  void release(header* obj) {
+    size_t c = obj->size_class;
+    if(_free_count[c] >= getMaxCached(c)) {
+      getPrivateHeap().free(obj);
+    } else {
+      getNext(obj) = _free[c];
+      _free[c] = obj;
+      _free_count[c]++;
+    }
+  }
+
+  /// Move every object freed by other threads to the free lists
+  void collectRemote() {
+    header* obj = _remote.exchange(nullptr, std::memory_order_acquire);
+    while(obj != NULL) {
+      header* next = getNext(obj);
+      release(obj);
+      obj = next;
+    }
+  }
+
+  header* take(size_t c) {
+    if(_free[c] == NULL) collectRemote();
+
+    header* obj = _free[c];
+    if(obj != NULL) {
+      _free[c] = getNext(obj);
+      _free_count[c]--;
+      return obj;
+    }
+
+    return allocateShared(getClassSize(c), this, c);
+  }
+
+public:
+  static void* malloc(size_t sz) {
+    size_t c = getClass(sizeof(header) + sz);
+    ThreadHeap* h = getCurrent();
+    header* obj;
+    if(c == ClassCount || h == NULL || h->_busy) {
+      obj = allocateShared(sizeof(header) + sz, NULL, c);
+    } else {
+      h->_busy = true;
+      obj = h->take(c);
+      h->_busy = false;
+    }
+    return obj == NULL ? NULL : obj + 1;
+  }
+
+  static void free(void* p) {
+    if(p == NULL) return;
+
+    header* obj = (header*)p - 1;
+    ThreadHeap* owner = obj->owner;
+    if(owner == NULL) {
+      getPrivateHeap().free(obj);
+      return;
+    }
+
+    if(owner == getCurrent() && !owner->_busy) {
+      owner->_busy = true;
+      owner->release(obj);
+      owner->_busy = false;
+    } else {
+      owner->pushRemote(obj);
+    }
+  }
+
+  /// Give the current thread a heap, reusing a detached one if there is one. Call this before
+  /// the thread's first sampling interrupt, since it takes a lock.
+  static void attach() {
+    if(getCurrent() != NULL) return;
+
+    pthread_mutex_lock(&getDetachedLock());
+    ThreadHeap* h = getDetached();
+    if(h != NULL) getDetached() = h->_next_detached;
+    pthread_mutex_unlock(&getDetachedLock());
+
+    if(h == NULL) {
+      void* p = getPrivateHeap().malloc(sizeof(ThreadHeap));
+      if(p == NULL) return;
+      h = new(p) ThreadHeap();
+    }
+    h->_next_detached = NULL;
+    getCurrent() = h;
+  }
+
+  /// Give up the current thread's heap so another thread can reuse it. Call this after the
+  /// thread's last sampling interrupt.
+  static void detach() {
+    ThreadHeap* h = getCurrent();
+    if(h == NULL) return;
+    getCurrent() = NULL;
+
+    pthread_mutex_lock(&getDetachedLock());
+    h->_next_detached = getDetached();
+    getDetached() = h;
+    pthread_mutex_unlock(&getDetachedLock());
+  }
+};
+
+/// A heap layer that allocates from the current thread's heap, for use with STLAllocator
+class PrivateHeap {
+public:
+  void* malloc(size_t sz) { return ThreadHeap::malloc(sz); }
+  void free(void* p) { ThreadHeap::free(p); }
+};
+
 class PrivateAllocated {
 public:
   /// Override new
-  void* operator new(size_t sz) { return getPrivateHeap().malloc(sz); }
+  void* operator new(size_t sz) { return ThreadHeap::malloc(sz); }
   /// Override nothrow version of new
-  void* operator new(size_t sz, const std::nothrow_t&) { return getPrivateHeap().malloc(sz); }
+  void* operator new(size_t sz, const std::nothrow_t&) { return ThreadHeap::malloc(sz); }
   
   /// Override new[]
-  void* operator new[](size_t sz) { return getPrivateHeap().malloc(sz); }
+  void* operator new[](size_t sz) { return ThreadHeap::malloc(sz); }
   /// Override nothrow version of new[]
-  void* operator new[](size_t sz, const std::nothrow_t&) { return getPrivateHeap().malloc(sz); }
+  void* operator new[](size_t sz, const std::nothrow_t&) { return ThreadHeap::malloc(sz); }
   
   /// Override delete
-  void operator delete(void* p) { getPrivateHeap().free(p); }
+  void operator delete(void* p) { ThreadHeap::free(p); }
   /// Override nothrow version of delete
-  void operator delete(void* p, const std::nothrow_t&) { getPrivateHeap().free(p); }
+  void operator delete(void* p, const std::nothrow_t&) { ThreadHeap::free(p); }
   
   /// Override delete[]
-  void operator delete[](void* p) { getPrivateHeap().free(p); }
+  void operator delete[](void* p) { ThreadHeap::free(p); }
   /// Override nothrow version of delete[]
-  void operator delete[](void* p, const std::nothrow_t&) { getPrivateHeap().free(p); }
+  void operator delete[](void* p, const std::nothrow_t&) { ThreadHeap::free(p); }
 };
 
 #endif
@@ -0,0 +1,140 @@
+#if !defined(CAUSAL_RUNTIME_HUGEPAGES_H)
+#define CAUSAL_RUNTIME_HUGEPAGES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "options.h"
+
+/// Huge page backing for the private heap's chunks, which hold every sample block. The
+/// CAUSAL_HUGE_PAGES option picks the kind of pages: `hugetlb` maps chunks from the kernel's
+/// reserved huge page pool with MAP_HUGETLB, and `thp` aligns ordinary mappings to huge page
+/// boundaries and advises the kernel to back them with transparent huge pages. A chunk that
+/// can't get huge pages falls back to the next kind, down to ordinary pages, so the option
+/// never makes an allocation fail.
+namespace hugepages {
+  enum mode {
+    Off,
+    Transparent,
+    HugeTLB
+  };
+
+  enum {
+    /// Chunks are rounded up to, and transparent huge page mappings aligned to, this size
+    ChunkAlignment = 0x200000
+  };
+
+  /// The number of chunks mapped with each kind of page, by mode. Inline, so every file that
+  /// includes this header shares the counts.
+  inline std::atomic<size_t>* getChunkCounts() {
+    static std::atomic<size_t> counts[HugeTLB + 1];
+    return counts;
+  }
+
+  /// Get the requested kind of pages. The option is read when the first chunk is mapped.
+  inline mode getMode() {
+    static mode m = [] {
+      const char* value = options::getString("CAUSAL_HUGE_PAGES");
+      if(value == NULL) return Off;
+      if(strcmp(value, "hugetlb") == 0) return HugeTLB;
+      if(strcmp(value, "thp") == 0) return Transparent;
+      return Off;
+    }();
+    return m;
+  }
+
+  static size_t getChunks(mode m) {
+    return getChunkCounts()[m].load();
+  }
+
+  /// Get the size of the pages MAP_HUGETLB maps, from /proc/meminfo
+  static size_t getHugeTLBPageSize() {
+    size_t kb = ChunkAlignment / 1024;
+    FILE* f = fopen("/proc/meminfo", "r");
+    if(f == NULL) return kb * 1024;
+    char line[128];
+    while(fgets(line, sizeof(line), f) != NULL) {
+      if(sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb * 1024;
+  }
+
+  /// Get the largest page size backing any chunk. Chunks advised for transparent huge pages
+  /// are reported with the huge page size, although the kernel decides whether each one is
+  /// actually backed by huge pages.
+  static size_t getPageSize() {
+    if(getChunks(HugeTLB) > 0) return getHugeTLBPageSize();
+    if(getChunks(Transparent) > 0) return ChunkAlignment;
+    return sysconf(_SC_PAGESIZE);
+  }
+
+  static const char* getName(mode m) {
+    switch(m) {
+      case HugeTLB: return "hugetlb";
+      case Transparent: return "thp";
+      default: return "off";
+    }
+  }
+
+  /// A heap layer that maps private anonymous chunks with the requested kind of pages.
+  /// BumpAlloc never returns its chunks, so neither does this layer.
+  class HugePageMmapHeap {
+  private:
+    static size_t roundUp(size_t sz) {
+      return (sz + ChunkAlignment - 1) & ~((size_t)ChunkAlignment - 1);
+    }
+
+    static void* map(size_t size, int flags) {
+      void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+      return p == MAP_FAILED ? NULL : p;
+    }
+
+    /// Map a chunk aligned to a huge page boundary, so the kernel can back all of it with huge
+    /// pages. Extra space is mapped and the unaligned ends are unmapped.
+    static void* mapAligned(size_t size) {
+      char* p = (char*)map(size + ChunkAlignment, 0);
+      if(p == NULL) return NULL;
+      char* aligned = (char*)(((uintptr_t)p + ChunkAlignment - 1) & ~((uintptr_t)ChunkAlignment - 1));
+      if(aligned > p) munmap(p, aligned - p);
+      char* end = p + size + ChunkAlignment;
+      if(end > aligned + size) munmap(aligned + size, end - (aligned + size));
+      return aligned;
+    }
+
+  public:
+    void* malloc(size_t sz) {
+      mode m = getMode();
+
+      if(m == HugeTLB) {
+        void* p = map(roundUp(sz), MAP_HUGETLB);
+        if(p != NULL) {
+          getChunkCounts()[HugeTLB]++;
+          return p;
+        }
+      }
+
+      if(m != Off) {
+        size_t size = roundUp(sz);
+        void* p = mapAligned(size);
+        if(p != NULL) {
+          getChunkCounts()[madvise(p, size, MADV_HUGEPAGE) == 0 ? Transparent : Off]++;
+          return p;
+        }
+      }
+
+      void* p = map(sz, 0);
+      if(p != NULL) getChunkCounts()[Off]++;
+      return p;
+    }
+
+    void free(void* p) {}
+  };
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include "causal.h"
 #include "counter.h"
 #include "heap.h"
+#include "loader.h"
 #include "log.h"
 #include "real.h"
 
@@ -89,6 +90,11 @@ extern "C" {
     Real::pthread_exit()(arg);
   }
 
+  int dlclose(void* handle) {
+    // Don't let the profiler read a library's code while it is being unmapped
+    return loader::unload(handle);
+  }
+
 	int fork() {
     int result = Real::fork()();
   	if(result == 0) Causal::getInstance().reinitialize();
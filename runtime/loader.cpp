@@ -0,0 +1,172 @@
+#include "loader.h"
+
+#include <link.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "log.h"
+#include "real.h"
+#include "util.h"
+
+using std::atomic;
+using std::string;
+using std::vector;
+
+namespace loader {
+  /// Incremented after every dlclose, for loaders that don't report load and unload counts
+  atomic<size_t> unload_count = ATOMIC_VAR_INIT(0);
+  /// The number of dlclose calls in progress. Only incremented with the mappings locked for
+  /// writing, so it can't become nonzero while another thread has them locked.
+  atomic<size_t> unloading = ATOMIC_VAR_INIT(0);
+  /// Held for reading while code is in use, and briefly for writing before a library is unloaded.
+  /// Prefer writers so a busy profiler thread can't hold off dlclose indefinitely.
+  pthread_rwlock_t mappings_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+  
+  /// Get the full path to the main executable
+  static string getExecutablePath() {
+    char buf[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", buf, PATH_MAX - 1);
+    if(len == -1) {
+      WARNING("Failed to find main executable path");
+      return "";
+    }
+    buf[len] = '\0';
+    return buf;
+  }
+  
+  /// Get the GNU build-id from a loaded PT_NOTE segment, or an empty string if it has none
+  static string getBuildID(const uint8_t* notes, size_t size) {
+    size_t offset = 0;
+    while(offset + sizeof(ElfW(Nhdr)) <= size) {
+      const ElfW(Nhdr)* note = reinterpret_cast<const ElfW(Nhdr)*>(notes + offset);
+      const char* name = reinterpret_cast<const char*>(note + 1);
+      const uint8_t* desc = reinterpret_cast<const uint8_t*>(name) + ((note->n_namesz + 3) & ~3);
+      
+      if(note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+        static const char digits[] = "0123456789abcdef";
+        string result;
+        for(size_t i = 0; i < note->n_descsz; i++) {
+          result += digits[desc[i] >> 4];
+          result += digits[desc[i] & 0xf];
+        }
+        return result;
+      }
+      
+      offset += sizeof(ElfW(Nhdr)) + ((note->n_namesz + 3) & ~3) + ((note->n_descsz + 3) & ~3);
+    }
+    return "";
+  }
+  
+  /// Callback for dl_iterate_phdr. Records the executable segments of each loaded object.
+  static int addMapping(struct dl_phdr_info* info, size_t size, void* data) {
+    vector<mapping>& mappings = *reinterpret_cast<vector<mapping>*>(data);
+    
+    uintptr_t base = UINTPTR_MAX;
+    uintptr_t limit = 0;
+    string build_id;
+    for(const ElfW(Phdr)& phdr : wrap(const_cast<ElfW(Phdr)*>(info->dlpi_phdr), info->dlpi_phnum)) {
+      if(phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+        uintptr_t segment_base = info->dlpi_addr + phdr.p_vaddr;
+        if(segment_base < base) base = segment_base;
+        if(segment_base + phdr.p_memsz > limit) limit = segment_base + phdr.p_memsz;
+      } else if(phdr.p_type == PT_NOTE && build_id.empty()) {
+        // Notes are mapped with the file, so the build-id can be read without opening it
+        build_id = getBuildID(reinterpret_cast<const uint8_t*>(info->dlpi_addr + phdr.p_vaddr), phdr.p_memsz);
+      }
+    }
+    
+    // Skip objects without any code
+    if(base >= limit)
+      return 0;
+    
+    // The main executable is reported with an empty name
+    string name = info->dlpi_name;
+    if(name.empty())
+      name = getExecutablePath();
+    
+    mappings.push_back(mapping{ name, interval(base, limit), info->dlpi_addr, build_id });
+    return 0;
+  }
+  
+  vector<mapping> getMappings() {
+    vector<mapping> mappings;
+    dl_iterate_phdr(addMapping, &mappings);
+    return mappings;
+  }
+  
+  /// Callback for dl_iterate_phdr. Stops when a readable segment contains the range.
+  static int findReadable(struct dl_phdr_info* info, size_t size, void* data) {
+    const interval& range = *reinterpret_cast<interval*>(data);
+    for(const ElfW(Phdr)& phdr : wrap(const_cast<ElfW(Phdr)*>(info->dlpi_phdr), info->dlpi_phnum)) {
+      uintptr_t segment_base = info->dlpi_addr + phdr.p_vaddr;
+      if(phdr.p_type == PT_LOAD && (phdr.p_flags & PF_R) &&
+         range.getBase() >= segment_base && range.getLimit() <= segment_base + phdr.p_memsz) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  
+  bool isReadable(interval range) {
+    return dl_iterate_phdr(findReadable, &range) != 0;
+  }
+  
+  /// Callback for dl_iterate_phdr. Reads the loader's load and unload counts from the first object.
+  static int getCounts(struct dl_phdr_info* info, size_t size, void* data) {
+    size_t& result = *reinterpret_cast<size_t*>(data);
+    if(size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+      result = info->dlpi_adds + info->dlpi_subs;
+    } else {
+      result = unload_count.load();
+    }
+    return 1;
+  }
+  
+  size_t getGeneration() {
+    size_t result = 0;
+    dl_iterate_phdr(getCounts, &result);
+    return result;
+  }
+  
+  int unload(void* handle) {
+    // Wait for readers to finish with the code, and keep new readers away from it until dlclose
+    // returns. The lock isn't held across dlclose, since a destructor that calls dlclose again
+    // would deadlock, and one that waits for another thread could wait on the lock's readers.
+    pthread_rwlock_wrlock(&mappings_lock);
+    unloading++;
+    pthread_rwlock_unlock(&mappings_lock);
+    
+    int result = Real::dlclose()(handle);
+    unload_count++;
+    unloading--;
+    return result;
+  }
+  
+  bool isUnloading() {
+    return unloading.load() > 0;
+  }
+  
+  void lockMappings() {
+    pthread_rwlock_rdlock(&mappings_lock);
+  }
+  
+  void unlockMappings() {
+    pthread_rwlock_unlock(&mappings_lock);
+  }
+  
+  void reset() {
+    // The copied lock may count readers from the parent's profiler and worker threads, which
+    // would keep the child's dlclose waiting forever
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&mappings_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    unloading.store(0);
+  }
+}
@@ -0,0 +1,47 @@
+#if !defined(CAUSAL_RUNTIME_LOADER_H)
+#define CAUSAL_RUNTIME_LOADER_H
+
+#include <string>
+#include <vector>
+
+#include "interval.h"
+
+namespace loader {
+  /// An executable file mapped into the process
+  struct mapping {
+    std::string name;
+    interval range;         ///< The loaded range of the file's executable segments
+    uintptr_t load_offset;  ///< The difference between loaded and link-time addresses
+    std::string build_id;   ///< GNU build-id as a hex string, read from the loaded notes
+  };
+  
+  /// Get all executable files currently mapped into the process
+  std::vector<mapping> getMappings();
+  
+  /// Check if a range of addresses is entirely inside one readable segment of a loaded file
+  bool isReadable(interval range);
+  
+  /// Get the mapping generation. This changes whenever a file has been loaded or unloaded.
+  size_t getGeneration();
+  
+  /// Unload a library with dlclose. Waits until no thread has the mappings locked, but doesn't
+  /// hold the lock during dlclose, since library destructors may call dlclose themselves.
+  int unload(void* handle);
+  
+  /// Prevent code from being unmapped. Anything that reads code must hold this lock, and must
+  /// not read code if isUnloading returns true.
+  void lockMappings();
+  
+  /// Check if a dlclose is in progress, so code may be unmapped at any moment. Once the mappings
+  /// are locked, this can't change from false to true until they are unlocked.
+  bool isUnloading();
+  
+  /// Allow code to be unmapped again
+  void unlockMappings();
+  
+  /// Forget the locks and unloads of threads that don't exist anymore. Call this in the child
+  /// after a fork, where only the forking thread is left.
+  void reset();
+}
+
+#endif
@@ -0,0 +1,200 @@
+#if !defined(CAUSAL_RUNTIME_LOOPS_H)
+#define CAUSAL_RUNTIME_LOOPS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "cfg.h"
+
+/// A natural loop in a function's control flow graph
+struct loop_info {
+  size_t header;              ///< Index of the block every entry to the loop passes through
+  std::vector<size_t> blocks; ///< Indices of the blocks in the loop body, sorted, including the header
+  int parent;                 ///< Index of the innermost enclosing loop, or -1 for outermost loops
+  size_t depth;               ///< Nesting depth, starting at 1 for outermost loops
+};
+
+/// Dominator and natural loop analysis over the blocks found by cfg::findBlocks.
+/// The first block is the function's entry. Blocks it can't reach are ignored.
+namespace loops {
+  enum : size_t {
+    /// Marks blocks that are unreachable from the entry
+    Unreachable = SIZE_MAX
+  };
+
+  /// Get each block's predecessors from the successor lists
+  static std::vector<std::vector<size_t>> getPredecessors(const std::vector<block_info>& blocks) {
+    std::vector<std::vector<size_t>> preds(blocks.size());
+    for(size_t b = 0; b < blocks.size(); b++) {
+      for(uint32_t s : blocks[b].successors) {
+        if(s < blocks.size()) preds[s].push_back(b);
+      }
+    }
+    return preds;
+  }
+
+  /// Order the blocks reachable from the entry in reverse postorder
+  static std::vector<size_t> getReversePostorder(const std::vector<block_info>& blocks) {
+    std::vector<size_t> order;
+    if(blocks.size() == 0)
+      return order;
+
+    // Depth-first search with an explicit stack of (block, next successor to visit)
+    std::vector<bool> visited(blocks.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.emplace_back(0, 0);
+    visited[0] = true;
+
+    while(stack.size() > 0) {
+      size_t b = stack.back().first;
+      size_t& next = stack.back().second;
+
+      if(next < blocks[b].successors.size()) {
+        size_t s = blocks[b].successors[next];
+        next++;
+        if(s < blocks.size() && !visited[s]) {
+          visited[s] = true;
+          stack.emplace_back(s, 0);
+        }
+      } else {
+        order.push_back(b);
+        stack.pop_back();
+      }
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+
+  /// Find each block's immediate dominator with the iterative algorithm from Cooper, Harvey,
+  /// and Kennedy, "A Simple, Fast Dominance Algorithm". The entry is its own dominator.
+  static std::vector<size_t> getDominators(const std::vector<block_info>& blocks,
+                                           const std::vector<std::vector<size_t>>& preds) {
+    std::vector<size_t> idom(blocks.size(), Unreachable);
+    std::vector<size_t> order = getReversePostorder(blocks);
+    if(order.size() == 0)
+      return idom;
+
+    // Position of each block in reverse postorder
+    std::vector<size_t> position(blocks.size(), Unreachable);
+    for(size_t i = 0; i < order.size(); i++) {
+      position[order[i]] = i;
+    }
+
+    // Walk up the dominator tree from two blocks until they meet
+    auto intersect = [&](size_t a, size_t b) {
+      while(a != b) {
+        while(position[a] > position[b]) a = idom[a];
+        while(position[b] > position[a]) b = idom[b];
+      }
+      return a;
+    };
+
+    idom[order[0]] = order[0];
+
+    bool changed = true;
+    while(changed) {
+      changed = false;
+      for(size_t i = 1; i < order.size(); i++) {
+        size_t b = order[i];
+        size_t new_idom = Unreachable;
+        for(size_t p : preds[b]) {
+          if(idom[p] == Unreachable) continue;
+          new_idom = (new_idom == Unreachable) ? p : intersect(p, new_idom);
+        }
+        if(new_idom != idom[b]) {
+          idom[b] = new_idom;
+          changed = true;
+        }
+      }
+    }
+
+    return idom;
+  }
+
+  /// Check if block a dominates block b
+  static bool dominates(const std::vector<size_t>& idom, size_t a, size_t b) {
+    if(idom[b] == Unreachable)
+      return false;
+    while(b != a && idom[b] != b) {
+      b = idom[b];
+    }
+    return b == a;
+  }
+
+  /// Find the natural loops in a function. Back edges to the same header are merged into one
+  /// loop. Outer loops come before the loops nested in them, so a loop's parent always has a
+  /// lower index. Irreducible cycles have no single header and are not reported.
+  static std::vector<loop_info> findLoops(const std::vector<block_info>& blocks) {
+    std::vector<loop_info> loops;
+    std::vector<std::vector<size_t>> preds = getPredecessors(blocks);
+    std::vector<size_t> idom = getDominators(blocks, preds);
+
+    // Find back edges, where a block branches to one of its dominators
+    std::vector<std::vector<size_t>> back_edges(blocks.size());
+    for(size_t b = 0; b < blocks.size(); b++) {
+      for(uint32_t h : blocks[b].successors) {
+        if(h < blocks.size() && dominates(idom, h, b))
+          back_edges[h].push_back(b);
+      }
+    }
+
+    // Each header's loop body is the header plus every block that reaches a back edge
+    // without passing through the header
+    for(size_t h = 0; h < blocks.size(); h++) {
+      if(back_edges[h].size() == 0)
+        continue;
+
+      std::vector<bool> in_body(blocks.size(), false);
+      std::vector<size_t> worklist;
+      in_body[h] = true;
+      for(size_t b : back_edges[h]) {
+        if(!in_body[b]) {
+          in_body[b] = true;
+          worklist.push_back(b);
+        }
+      }
+
+      while(worklist.size() > 0) {
+        size_t b = worklist.back();
+        worklist.pop_back();
+        for(size_t p : preds[b]) {
+          if(!in_body[p] && idom[p] != Unreachable) {
+            in_body[p] = true;
+            worklist.push_back(p);
+          }
+        }
+      }
+
+      loop_info l;
+      l.header = h;
+      l.parent = -1;
+      l.depth = 1;
+      for(size_t b = 0; b < blocks.size(); b++) {
+        if(in_body[b]) l.blocks.push_back(b);
+      }
+      loops.push_back(l);
+    }
+
+    // A nested loop's body is a strict subset of its parent's, so order larger loops first
+    std::stable_sort(loops.begin(), loops.end(), [](const loop_info& a, const loop_info& b) {
+      return a.blocks.size() > b.blocks.size();
+    });
+
+    // The innermost enclosing loop is the smallest earlier loop that contains the header
+    for(size_t i = 0; i < loops.size(); i++) {
+      for(size_t j = i; j-- > 0;) {
+        if(std::binary_search(loops[j].blocks.begin(), loops[j].blocks.end(), loops[i].header)) {
+          loops[i].parent = j;
+          loops[i].depth = loops[j].depth + 1;
+          break;
+        }
+      }
+    }
+
+    return loops;
+  }
+}
+
+#endif
@@ -0,0 +1,36 @@
+#if !defined(CAUSAL_RUNTIME_OPTIONS_H)
+#define CAUSAL_RUNTIME_OPTIONS_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/// Runtime options are read from CAUSAL_* environment variables, since the runtime is
+/// loaded with LD_PRELOAD and has no other way to receive arguments.
+namespace options {
+  /// Get a string option, or a default value if it is unset or empty
+  static const char* getString(const char* name, const char* def = NULL) {
+    const char* value = getenv(name);
+    if(value == NULL || value[0] == '\0') return def;
+    return value;
+  }
+
+  /// Get an unsigned integer option, or a default value if it is unset or malformed
+  static size_t getSize(const char* name, size_t def) {
+    const char* value = getString(name);
+    if(value == NULL) return def;
+    char* end;
+    unsigned long long result = strtoull(value, &end, 0);
+    if(*end != '\0') return def;
+    return result;
+  }
+
+  /// Get a boolean option. "0", "no", "off", and "false" are false, anything else is true.
+  static bool getBool(const char* name, bool def) {
+    const char* value = getString(name);
+    if(value == NULL) return def;
+    return strcmp(value, "0") != 0 && strcasecmp(value, "no") != 0 &&
+           strcasecmp(value, "off") != 0 && strcasecmp(value, "false") != 0;
+  }
+}
+
+#endif
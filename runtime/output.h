@@ -3,35 +3,598 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
 
 #include "bins.h"
 #include "interval.h"
 #include "log.h"
+#include "pprof.h"
+#include "profile.h"
 
+/// The result of one speedup experiment
+struct Experiment {
+  const char* kind;             ///< "block" or "loop"
+  std::string file;
+  std::string function;
+  interval range;               ///< The sped-up block, or the header block of the sped-up loop
+  size_t range_count;           ///< Number of address ranges that were sped up
+  size_t duration;              ///< Length of the experiment in nanoseconds
+  size_t delay_size;
+  size_t delays;                ///< Number of delays executed
+  std::vector<size_t> progress; ///< Visits to each progress counter during the experiment
+};
+
+/// The combined results of every experiment in a run that sped up the same code
+struct ExperimentSummary {
+  const Experiment* experiment; ///< The first experiment, which describes the sped-up code
+  size_t count;
+  double speedup;               ///< Mean fraction of each experiment the code was sped up by
+  double change;                ///< Mean relative change in the rate of progress
+};
+
+/// Combine a run's experiments by the code they sped up. Delays pause the rest of the program,
+/// so each experiment's progress rate is measured over its duration minus the delays it
+/// inserted, and compared to the rate over all of the run's experiments. Returns nothing if
+/// no progress points were visited.
+static std::vector<ExperimentSummary> summarizeExperiments(const std::vector<Experiment>& experiments) {
+  std::vector<ExperimentSummary> result;
+  double total_progress = 0;
+  double total_time = 0;
+  
+  auto getProgress = [](const Experiment& e) {
+    size_t sum = 0;
+    for(size_t p : e.progress) sum += p;
+    return sum;
+  };
+  
+  auto getTime = [](const Experiment& e) {
+    return (double)e.duration - (double)e.delays * e.delay_size;
+  };
+  
+  for(const Experiment& e : experiments) {
+    if(getTime(e) <= 0) continue;
+    total_progress += getProgress(e);
+    total_time += getTime(e);
+  }
+  
+  if(total_progress == 0)
+    return result;
+  
+  double baseline = total_progress / total_time;
+  std::map<std::tuple<std::string, std::string, std::string, uintptr_t, uintptr_t>, size_t> index;
+  
+  for(const Experiment& e : experiments) {
+    if(getTime(e) <= 0) continue;
+    
+    auto key = std::make_tuple(std::string(e.kind), e.file, e.function, e.range.getBase(), e.range.getLimit());
+    auto i = index.find(key);
+    if(i == index.end()) {
+      i = index.emplace(key, result.size()).first;
+      result.push_back(ExperimentSummary{ &e, 0, 0, 0 });
+    }
+    
+    ExperimentSummary& s = result[i->second];
+    s.count++;
+    s.speedup += (double)e.delays * e.delay_size / e.duration;
+    s.change += getProgress(e) / getTime(e) / baseline - 1;
+  }
+  
+  for(ExperimentSummary& s : result) {
+    s.speedup /= s.count;
+    s.change /= s.count;
+  }
+  return result;
+}
+
+/// Information about the profiled process, written at the start of each run
+struct RunInfo {
+  std::string command;          ///< Command line, with arguments separated by spaces
+  std::string host;
+  size_t pid;
+  size_t start_time;            ///< Wall clock time in nanoseconds since the epoch
+  size_t end_time;
+  size_t threads;               ///< Number of threads that were sampled
+};
+
+/// Writes the records for one run of the profiler. Records are collected in memory and the
+/// whole run is appended at once while holding an exclusive flock on the file, so runs from
+/// concurrent processes sharing one output file never interleave.
 class Output {
+protected:
+  /// Take an exclusive lock on an output file, waiting for other processes to finish writing
+  static bool lockFile(int fd) {
+    while(flock(fd, LOCK_EX) == -1) {
+      if(errno != EINTR) return false;
+    }
+    return true;
+  }
+  
+  static void unlockFile(int fd) {
+    flock(fd, LOCK_UN);
+  }
+  
+public:
+  virtual ~Output() {}
+  
+  /// Record a loaded file, so raw addresses can be symbolized after the program exits. The
+  /// retire time is when the file was found to be unloaded, or zero if it is still loaded.
+  virtual void writeMapping(const File& file, size_t retire_time) = 0;
+  /// Record the samples at one raw program counter
+  virtual void writePCStats(uintptr_t pc, const PCBin& bin) = 0;
+  virtual void writeBlockStats(const std::string& filename, const char* function_name, const BasicBlock& block) = 0;
+  virtual void writeLoopStats(const std::string& filename, const char* function_name, const Loop& loop) = 0;
+  virtual void writeExperiment(const Experiment& e) = 0;
+  virtual void writeRunInfo(const RunInfo& run) = 0;
+  /// Record the runtime's own cost in one category: the number of measured events and their
+  /// total time in nanoseconds
+  virtual void writeOverhead(const char* category, size_t count, size_t nanos) = 0;
+  
+  /// Check if the output file was opened
+  virtual bool isOpen() const = 0;
+  
+  /// Open the output for a run in the given format: "text", "binary", "pprof", or "folded".
+  /// The run is appended to the file at `path`, or replaces its contents if `append` is false.
+  /// pprof profiles always replace the file. Returns NULL if the file can't be opened.
+  static Output* open(const char* format, const std::string& path, bool append,
+                      const char* basename, size_t cycle_period, size_t inst_period);
+  
+  /// Get the default output path for a format
+  static const char* getDefaultPath(const char* format) {
+    if(strcmp(format, "binary") == 0) return "out.czp";
+    if(strcmp(format, "pprof") == 0) return "out.pb";
+    if(strcmp(format, "folded") == 0) return "out.folded";
+    return "out.czl";
+  }
+  
+  /// Expand an output path pattern. %p is the process ID, %t is the start time in seconds,
+  /// %e is the name of the executable, %h is the host name, and %% is a literal %.
+  static std::string expandPath(const char* pattern, const RunInfo& run) {
+    std::string result;
+    for(const char* p = pattern; *p != '\0'; p++) {
+      if(*p != '%' || p[1] == '\0') {
+        result.push_back(*p);
+        continue;
+      }
+      
+      p++;
+      if(*p == 'p') {
+        result += std::to_string(run.pid);
+      } else if(*p == 't') {
+        result += std::to_string(run.start_time / Time_s);
+      } else if(*p == 'h') {
+        result += run.host;
+      } else if(*p == 'e') {
+        char exe[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", exe, PATH_MAX - 1);
+        if(len > 0) {
+          exe[len] = '\0';
+          const char* slash = strrchr(exe, '/');
+          result += slash == NULL ? exe : slash + 1;
+        } else {
+          result += "unknown";
+        }
+      } else {
+        // Keep %% as a single %, and anything unrecognized as it was written
+        if(*p != '%') result.push_back('%');
+        result.push_back(*p);
+      }
+    }
+    return result;
+  }
+};
+
+/// Tab-separated records
+class TextOutput : public Output {
 private:
-  std::ofstream f;
+  int _fd;
+  std::ostringstream f;
 public:
-  Output(const char* basename, size_t cycle_period, size_t inst_period) {
-    f.open("out.czl", std::ofstream::out | std::ofstream::app);
-    REQUIRE(f.is_open(), "Failed to open out.czl for output");
+  TextOutput(const std::string& path, bool append, const char* basename, size_t cycle_period, size_t inst_period) {
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
     
     f << "basename\t" << basename << "\n";
     f << "cycle period\t" << cycle_period << "\n";
     f << "instruction period\t" << inst_period << "\n";
   }
   
-  ~Output() {
-    f.close();
+  ~TextOutput() {
+    if(_fd == -1)
+      return;
+    bool ok = lockFile(_fd);
+    if(ok) {
+      std::string data = f.str();
+      profile::buffered_writer out(_fd);
+      out.write(data.data(), data.size());
+      ok = out.flush();
+      unlockFile(_fd);
+    }
+    
+    if(!ok)
+      WARNING("Failed to write text profile");
+    close(_fd);
   }
   
-  void writeBlockStats(const std::string& filename, const std::string& function_name, const BasicBlock& block) {
+  bool isOpen() const { return _fd != -1; }
+  
+  void writeRunInfo(const RunInfo& run) {
+    f << "command\t" << run.command << "\n";
+    f << "host\t" << run.host << "\n";
+    f << "pid\t" << run.pid << "\n";
+    f << "start time\t" << run.start_time << "\n";
+    f << "end time\t" << run.end_time << "\n";
+    f << "threads\t" << run.threads << "\n";
+  }
+  
+  void writeMapping(const File& file, size_t retire_time) {
+    f << "mapping\t" << file.getName() << "\t" << file.getRange() << "\t0x" << std::hex 
+      << file.getLoadOffset() << std::dec << "\t" << (file.getBuildID().empty() ? "-" : file.getBuildID()) << "\t";
+    if(retire_time == 0) f << "-\n";
+    else f << retire_time << "\n";
+  }
+  
+  void writePCStats(uintptr_t pc, const PCBin& bin) {
+    f << "pcstats\t0x" << std::hex << pc << std::dec << "\t" 
+      << bin.getCycleSamples() << "\t" << bin.getInstructionSamples() << "\t" << bin.getTime() << "\n";
+  }
+  
+  void writeBlockStats(const std::string& filename, const char* function_name, const BasicBlock& block) {
     f << "blockstats\t" << filename << "\t" << function_name << "\t" << block << "\n";
   }
+  
+  void writeLoopStats(const std::string& filename, const char* function_name, const Loop& loop) {
+    f << "loopstats\t" << filename << "\t" << function_name << "\t" << loop << "\n";
+  }
+  
+  void writeExperiment(const Experiment& e) {
+    f << "experiment\t" << e.kind << "\t" << e.file << "\t" << e.function << "\t" << e.range << "\t"
+      << e.range_count << "\t" << e.duration << "\t" << e.delay_size << "\t" << e.delays;
+    for(size_t p : e.progress) {
+      f << "\t" << p;
+    }
+    f << "\n";
+  }
+  
+  void writeOverhead(const char* category, size_t count, size_t nanos) {
+    f << "overhead\t" << category << "\t" << count << "\t" << nanos << "\n";
+  }
 };
 
+/// Records in the binary profile format, written as one segment when the run ends
+class BinaryOutput : public Output {
+private:
+  int _fd;
+  profile::writer _writer;
+public:
+  BinaryOutput(const std::string& path, bool append, const char* basename, size_t cycle_period, size_t inst_period) :
+      _writer(basename, cycle_period, inst_period) {
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+  }
+  
+  ~BinaryOutput() {
+    if(_fd == -1)
+      return;
+    
+    bool ok = lockFile(_fd);
+    if(ok) {
+      ok = _writer.write(_fd);
+      unlockFile(_fd);
+    }
+    
+    if(!ok)
+      WARNING("Failed to write binary profile");
+    close(_fd);
+  }
+  
+  bool isOpen() const { return _fd != -1; }
+  
+  void writeRunInfo(const RunInfo& run) {
+    profile::run_record r;
+    r.pid = run.pid;
+    r.start_time = run.start_time;
+    r.end_time = run.end_time;
+    r.threads = run.threads;
+    r.command = _writer.addString(run.command);
+    r.host = _writer.addString(run.host);
+    _writer.setRun(r);
+  }
+  
+  void writeMapping(const File& file, size_t retire_time) {
+    profile::mapping_record r;
+    r.base = file.getRange().getBase();
+    r.limit = file.getRange().getLimit();
+    r.load_offset = file.getLoadOffset();
+    r.name = _writer.addString(file.getName());
+    r.build_id = _writer.addString(file.getBuildID());
+    _writer.addMapping(r, retire_time);
+  }
+  
+  void writePCStats(uintptr_t pc, const PCBin& bin) {
+    _writer.addPC(profile::pc_record{ pc, bin.getCycleSamples(), bin.getInstructionSamples() }, bin.getTime());
+  }
+  
+  void writeBlockStats(const std::string& filename, const char* function_name, const BasicBlock& block) {
+    profile::block_record r;
+    r.base = block.getRange().getBase();
+    r.limit = block.getRange().getLimit();
+    r.file = _writer.addString(filename);
+    r.function = _writer.addString(function_name);
+    r.length = block.getLength();
+    r.cycle_samples = block.getCycleSamples();
+    r.inst_samples = block.getInstructionSamples();
+    _writer.addBlock(r);
+  }
+  
+  void writeLoopStats(const std::string& filename, const char* function_name, const Loop& loop) {
+    profile::loop_record r;
+    r.base = loop.getHeader().getBase();
+    r.limit = loop.getHeader().getLimit();
+    r.file = _writer.addString(filename);
+    r.function = _writer.addString(function_name);
+    r.depth = loop.getDepth();
+    r.block_count = loop.getBlocks().size();
+    r.cycle_samples = loop.getCycleSamples();
+    r.inst_samples = loop.getInstructionSamples();
+    _writer.addLoop(r);
+  }
+  
+  void writeExperiment(const Experiment& e) {
+    profile::experiment_record r;
+    r.kind = _writer.addString(e.kind);
+    r.file = _writer.addString(e.file);
+    r.function = _writer.addString(e.function);
+    r.range_count = e.range_count;
+    r.base = e.range.getBase();
+    r.limit = e.range.getLimit();
+    r.duration = e.duration;
+    r.delay_size = e.delay_size;
+    r.delays = e.delays;
+    _writer.addExperiment(r, e.progress);
+  }
+  
+  void writeOverhead(const char* category, size_t count, size_t nanos) {
+    profile::overhead_record r;
+    r.category = _writer.addString(category);
+    r.reserved = 0;
+    r.count = count;
+    r.nanos = nanos;
+    _writer.addOverhead(r);
+  }
+};
+
+/// A pprof profile. Each block is a location at its start address with one sample. Offline
+/// runs write a sample at each raw PC instead, and pprof symbolizes them from the mappings.
+/// Experiment results are attached to the sped-up code as two more sample values, in parts
+/// per million: the mean change in progress rate and the mean virtual speedup. Loops would
+/// count their blocks' samples twice, so they are left out.
+class PprofOutput : public Output {
+private:
+  enum {
+    CycleSamples,
+    Cycles,
+    InstructionSamples,
+    Instructions,
+    ProgressChange,
+    Speedup,
+    ValueCount
+  };
+  
+  int _fd;
+  size_t _cycle_period;
+  size_t _inst_period;
+  pprof::builder _builder;
+  std::vector<Experiment> _experiments;
+  
+  std::vector<int64_t> getValues(const SampleBin& bin) const {
+    std::vector<int64_t> values(ValueCount, 0);
+    values[CycleSamples] = bin.getCycleSamples();
+    values[Cycles] = bin.getCycleSamples() * _cycle_period;
+    values[InstructionSamples] = bin.getInstructionSamples();
+    values[Instructions] = bin.getInstructionSamples() * _inst_period;
+    return values;
+  }
+  
+public:
+  PprofOutput(const std::string& path, const char* basename, size_t cycle_period, size_t inst_period) :
+      _cycle_period(cycle_period), _inst_period(inst_period) {
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    _builder.addSampleType("samples", "count");
+    _builder.addSampleType("cycles", "count");
+    _builder.addSampleType("instruction_samples", "count");
+    _builder.addSampleType("instructions", "count");
+    _builder.addSampleType("causal_progress_change", "ppm");
+    _builder.addSampleType("causal_speedup", "ppm");
+    _builder.setDefaultSampleType("samples");
+    _builder.setPeriod("cycles", "count", cycle_period);
+    _builder.addComment(std::string("basename: ") + basename);
+  }
+  
+  ~PprofOutput() {
+    if(_fd == -1)
+      return;
+    
+    for(const ExperimentSummary& s : summarizeExperiments(_experiments)) {
+      const Experiment& e = *s.experiment;
+      std::vector<int64_t> values(ValueCount, 0);
+      values[ProgressChange] = (int64_t)(s.change * 1000000);
+      values[Speedup] = (int64_t)(s.speedup * 1000000);
+      
+      std::vector<pprof::label> labels;
+      labels.push_back(pprof::label{ "experiment", e.kind, 0 });
+      labels.push_back(pprof::label{ "experiments", "", (int64_t)s.count });
+      _builder.addSample(_builder.addLocation(e.range.getBase(), e.function.c_str(), e.file), values, labels);
+    }
+    
+    bool ok = lockFile(_fd);
+    if(ok) {
+      ok = _builder.write(_fd);
+      unlockFile(_fd);
+    }
+    
+    if(!ok)
+      WARNING("Failed to write pprof profile");
+    close(_fd);
+  }
+  
+  bool isOpen() const { return _fd != -1; }
+  
+  void writeRunInfo(const RunInfo& run) {
+    _builder.setTime(run.start_time, run.end_time - run.start_time);
+    _builder.addComment("command: " + run.command);
+    _builder.addComment("host: " + run.host);
+    _builder.addComment("pid: " + std::to_string(run.pid));
+    _builder.addComment("threads: " + std::to_string(run.threads));
+  }
+  
+  void writeMapping(const File& file, size_t retire_time) {
+    // The file's first loaded segment normally starts at the beginning of the file
+    _builder.addMapping(file.getRange().getBase(), file.getRange().getLimit(), 0,
+                        file.getName(), file.getBuildID());
+  }
+  
+  void writePCStats(uintptr_t pc, const PCBin& bin) {
+    _builder.addSample(_builder.addLocation(pc, NULL, ""), getValues(bin));
+  }
+  
+  void writeBlockStats(const std::string& filename, const char* function_name, const BasicBlock& block) {
+    if(block.getCycleSamples() == 0 && block.getInstructionSamples() == 0)
+      return;
+    uint64_t location = _builder.addLocation(block.getRange().getBase(), function_name, filename);
+    _builder.addSample(location, getValues(block));
+  }
+  
+  void writeLoopStats(const std::string& filename, const char* function_name, const Loop& loop) {}
+  
+  void writeExperiment(const Experiment& e) {
+    _experiments.push_back(e);
+  }
+  
+  void writeOverhead(const char* category, size_t count, size_t nanos) {
+    _builder.addComment(std::string("overhead: ") + category + " " + std::to_string(count) + " events, " +
+                        std::to_string(nanos) + "ns");
+  }
+};
+
+/// Folded stacks, one line per sampled block, for flame graph tools. Each line is the file,
+/// function, and block address separated by semicolons, followed by the block's cycle samples.
+/// Experiment results go under separate "[causal speedup]" and "[causal slowdown]" roots,
+/// weighted by the mean change in progress rate in hundredths of a percent. Runs are appended
+/// like text output, and tools add up repeated lines.
+class FoldedOutput : public Output {
+private:
+  int _fd;
+  std::ostringstream f;
+  std::vector<Experiment> _experiments;
+  
+  /// Get a frame name without the separators the format uses
+  static std::string frame(const std::string& name) {
+    std::string result = name;
+    for(char& c : result) {
+      if(c == ';' || c == '\n') c = ':';
+    }
+    return result;
+  }
+  
+  /// Use the last component of a file's path as its frame
+  static std::string fileFrame(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return frame(slash == std::string::npos ? path : path.substr(slash + 1));
+  }
+  
+  void writeStack(const std::string& filename, const std::string& function_name, uintptr_t address) {
+    f << fileFrame(filename) << ";" << frame(function_name) << ";0x" << std::hex << address << std::dec;
+  }
+  
+public:
+  FoldedOutput(const std::string& path, bool append) {
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+  }
+  
+  ~FoldedOutput() {
+    if(_fd == -1)
+      return;
+    
+    for(const ExperimentSummary& s : summarizeExperiments(_experiments)) {
+      size_t weight = (size_t)(fabs(s.change) * 10000 + 0.5);
+      if(weight == 0) continue;
+      f << (s.change > 0 ? "[causal speedup];" : "[causal slowdown];") << s.experiment->kind << ";";
+      writeStack(s.experiment->file, s.experiment->function, s.experiment->range.getBase());
+      f << " " << weight << "\n";
+    }
+    
+    bool ok = lockFile(_fd);
+    if(ok) {
+      std::string data = f.str();
+      profile::buffered_writer out(_fd);
+      out.write(data.data(), data.size());
+      ok = out.flush();
+      unlockFile(_fd);
+    }
+    
+    if(!ok)
+      WARNING("Failed to write folded stacks");
+    close(_fd);
+  }
+  
+  bool isOpen() const { return _fd != -1; }
+  
+  void writeRunInfo(const RunInfo& run) {}
+  void writeMapping(const File& file, size_t retire_time) {}
+  
+  /// Offline runs have no symbols, so raw PCs get a frame of their own
+  void writePCStats(uintptr_t pc, const PCBin& bin) {
+    if(bin.getCycleSamples() == 0) return;
+    f << "[unknown];0x" << std::hex << pc << std::dec << " " << bin.getCycleSamples() << "\n";
+  }
+  
+  void writeBlockStats(const std::string& filename, const char* function_name, const BasicBlock& block) {
+    if(block.getCycleSamples() == 0) return;
+    writeStack(filename, function_name, block.getRange().getBase());
+    f << " " << block.getCycleSamples() << "\n";
+  }
+  
+  void writeLoopStats(const std::string& filename, const char* function_name, const Loop& loop) {}
+  
+  void writeExperiment(const Experiment& e) {
+    _experiments.push_back(e);
+  }
+  
+  /// Overhead is measured in time, not samples, so it has no place in the stacks
+  void writeOverhead(const char* category, size_t count, size_t nanos) {}
+};
+
+inline Output* Output::open(const char* format, const std::string& path, bool append,
+                            const char* basename, size_t cycle_period, size_t inst_period) {
+  Output* result;
+  if(strcmp(format, "binary") == 0) {
+    result = new BinaryOutput(path, append, basename, cycle_period, inst_period);
+  } else if(strcmp(format, "pprof") == 0) {
+    result = new PprofOutput(path, basename, cycle_period, inst_period);
+  } else if(strcmp(format, "folded") == 0) {
+    result = new FoldedOutput(path, append);
+  } else {
+    if(strcmp(format, "text") != 0)
+      WARNING("Unknown output format %s, using text", format);
+    result = new TextOutput(path, append, basename, cycle_period, inst_period);
+  }
+  
+  if(!result->isOpen()) {
+    delete result;
+    return NULL;
+  }
+  return result;
+}
+
 #endif
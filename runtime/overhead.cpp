@@ -0,0 +1,87 @@
+#include "overhead.h"
+
+#include <atomic>
+
+namespace overhead {
+  /// Shared totals for each category, on separate cache lines
+  struct alignas(64) totals {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> cycles;
+  };
+  
+  totals shared[CategoryCount];
+  
+  /// Interrupt time not yet added to the shared totals
+  __thread uint64_t local_count[CategoryCount];
+  __thread uint64_t local_cycles[CategoryCount];
+  
+  /// The innermost running timer on this thread
+  __thread timer* current_timer;
+  
+  uint64_t start_cycles;
+  size_t start_time;
+  
+  const char* getName(category c) {
+    switch(c) {
+      case Handler: return "handler";
+      case Delay: return "delay";
+      case Profiler: return "profiler";
+      case Blocks: return "blocks";
+      case Symbols: return "symbols";
+      case Output: return "output";
+      default: return "unknown";
+    }
+  }
+  
+  void add(category c, uint64_t cycles) {
+    shared[c].count.fetch_add(1, std::memory_order_relaxed);
+    shared[c].cycles.fetch_add(cycles, std::memory_order_relaxed);
+  }
+  
+  void addLocal(category c, uint64_t cycles) {
+    local_count[c]++;
+    local_cycles[c] += cycles;
+  }
+  
+  void flushLocal() {
+    for(size_t c = 0; c < CategoryCount; c++) {
+      if(local_count[c] == 0) continue;
+      shared[c].count.fetch_add(local_count[c], std::memory_order_relaxed);
+      shared[c].cycles.fetch_add(local_cycles[c], std::memory_order_relaxed);
+      local_count[c] = 0;
+      local_cycles[c] = 0;
+    }
+  }
+  
+  uint64_t getCount(category c) {
+    return shared[c].count.load(std::memory_order_relaxed);
+  }
+  
+  uint64_t getNanos(category c) {
+    if(timing::isCalibrated())
+      return timing::toNanos(shared[c].cycles.load(std::memory_order_relaxed));
+    
+    uint64_t elapsed_cycles = timing::getCycles() - start_cycles;
+    size_t elapsed_time = timing::getTime() - start_time;
+    uint64_t cycles = shared[c].cycles.load(std::memory_order_relaxed);
+    if(elapsed_cycles == 0)
+      return cycles;
+    return (uint64_t)((double)cycles * elapsed_time / elapsed_cycles);
+  }
+  
+  void initialize() {
+    start_cycles = timing::getCycles();
+    start_time = timing::getTime();
+  }
+  
+  timer::timer(category c) : _category(c), _start(timing::getCycles()), _parent(current_timer) {
+    current_timer = this;
+  }
+  
+  timer::~timer() {
+    uint64_t elapsed = timing::getCycles() - _start;
+    add(_category, elapsed - _nested);
+    if(_parent != NULL) _parent->_nested += elapsed;
+    current_timer = _parent;
+  }
+}
@@ -0,0 +1,66 @@
+#if !defined(CAUSAL_RUNTIME_OVERHEAD_H)
+#define CAUSAL_RUNTIME_OVERHEAD_H
+
+#include <stdint.h>
+
+#include "timing.h"
+
+/// Measures the runtime's own cost. Time is counted in timestamp counter cycles, which take a
+/// few nanoseconds to read, and converted to nanoseconds when it is reported. Where one
+/// measured activity runs inside another, like symbol loading on the profiler thread, the
+/// inner time is only counted once, in the inner category.
+namespace overhead {
+  enum category {
+    /// Sampling interrupts in program threads, not counting delays
+    Handler,
+    /// Delays inserted by speedup and slowdown experiments
+    Delay,
+    /// Attributing samples on the profiler thread
+    Profiler,
+    /// Finding basic blocks, on the profiler thread or the block finder threads
+    Blocks,
+    /// Loading symbols and the symbol cache
+    Symbols,
+    /// Writing profiles and snapshots
+    Output,
+    CategoryCount
+  };
+  
+  const char* getName(category c);
+  
+  /// Add time to a category from any thread
+  void add(category c, uint64_t cycles);
+  
+  /// Add time to a category from a sampling interrupt. The time is kept in the thread until
+  /// flushLocal is called, so interrupts don't contend on shared counters.
+  void addLocal(category c, uint64_t cycles);
+  
+  /// Move the current thread's interrupt time into the shared counters
+  void flushLocal();
+  
+  /// Get the number of measured events in a category
+  uint64_t getCount(category c);
+  
+  /// Get the total time spent in a category, in nanoseconds. Cycles are converted with the
+  /// clock's calibration if the timestamp counter is in use, or else with the rate the counter
+  /// has advanced since the runtime started.
+  uint64_t getNanos(category c);
+  
+  /// Record the starting cycle count and time used to convert cycles to nanoseconds
+  void initialize();
+  
+  /// Measures a scope. Time spent in nested timers on the same thread is left out.
+  class timer {
+  private:
+    category _category;
+    uint64_t _start;
+    uint64_t _nested = 0;
+    timer* _parent;
+    
+  public:
+    timer(category c);
+    ~timer();
+  };
+}
+
+#endif
@@ -1,14 +1,9 @@
 #include "papi.h"
 
 #include <papi.h>
-
-#include <string>
+#include <pthread.h>
 
 #include "log.h"
-#include "util.h"
-
-using std::map;
-using std::string;
 
 namespace papi {
   __thread int _event_set;
@@ -73,22 +68,4 @@ namespace papi {
     REQUIRE(PAPI_destroy_eventset(&_event_set) == PAPI_OK, "Failed to destroy event set");
     REQUIRE(PAPI_unregister_thread() == PAPI_OK, "Failed to unregister thread");
   }
-  
-  map<string, interval> getFiles() {
-    map<string, interval> files;
-    
-  	const PAPI_exe_info_t* info = PAPI_get_executable_info();
-  	if(info) {
-      files[info->fullname] = interval(info->address_info.text_start, info->address_info.text_end);
-  	}
-    
-    const PAPI_shlib_info_t* lib_info = PAPI_get_shared_lib_info();
-    if(lib_info) {
-      for(const PAPI_address_map_t& lib : wrap(lib_info->map, lib_info->count)) {
-        files[lib.name] = interval(lib.text_start, lib.text_end);
-      }
-    }
-    
-    return files;
-  }
 }
@@ -3,11 +3,6 @@
 
 #include <papi.h>
 
-#include <map>
-#include <string>
-
-#include "interval.h"
-
 namespace papi {
   typedef void (*overflow_handler_t)(int, void*, long long, void*);
   
@@ -19,9 +14,6 @@ namespace papi {
   
   /// Stop PAPI sampling in the current thread
   void stopThread();
-  
-  /// Get loaded executable files identified by PAPI
-  std::map<std::string, interval> getFiles();
 }
 
 #endif
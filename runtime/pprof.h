@@ -0,0 +1,313 @@
+#if !defined(CAUSAL_RUNTIME_PPROF_H)
+#define CAUSAL_RUNTIME_PPROF_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "profile.h"
+
+/// Writes profiles in pprof's format, the `perftools.profiles.Profile` protocol buffer from
+/// profile.proto. Only the few wire types the format uses are implemented. The output is not
+/// compressed; pprof reads both compressed and uncompressed profiles.
+namespace pprof {
+  enum wire_type : uint32_t {
+    Varint = 0,
+    LengthDelimited = 2
+  };
+
+  /// Field numbers from profile.proto
+  enum : uint32_t {
+    ProfileSampleType = 1,
+    ProfileSample = 2,
+    ProfileMapping = 3,
+    ProfileLocation = 4,
+    ProfileFunction = 5,
+    ProfileStringTable = 6,
+    ProfileTimeNanos = 9,
+    ProfileDurationNanos = 10,
+    ProfilePeriodType = 11,
+    ProfilePeriod = 12,
+    ProfileComment = 13,
+    ProfileDefaultSampleType = 14,
+
+    ValueTypeType = 1,
+    ValueTypeUnit = 2,
+
+    SampleLocationId = 1,
+    SampleValue = 2,
+    SampleLabel = 3,
+
+    LabelKey = 1,
+    LabelStr = 2,
+    LabelNum = 3,
+
+    MappingId = 1,
+    MappingMemoryStart = 2,
+    MappingMemoryLimit = 3,
+    MappingFileOffset = 4,
+    MappingFilename = 5,
+    MappingBuildId = 6,
+    MappingHasFunctions = 7,
+
+    LocationId = 1,
+    LocationMappingId = 2,
+    LocationAddress = 3,
+    LocationLine = 4,
+
+    LineFunctionId = 1,
+
+    FunctionId = 1,
+    FunctionName = 2,
+    FunctionSystemName = 3,
+    FunctionFilename = 4
+  };
+
+  /// Encodes the fields of one message
+  class encoder {
+  private:
+    std::string _data;
+
+  public:
+    const std::string& getData() const { return _data; }
+
+    void varint(uint64_t v) {
+      while(v >= 0x80) {
+        _data.push_back((char)(v | 0x80));
+        v >>= 7;
+      }
+      _data.push_back((char)v);
+    }
+
+    void tag(uint32_t field, wire_type type) {
+      varint((uint64_t)field << 3 | type);
+    }
+
+    /// Write an integer field. Zero is the default for every field, so it is left out.
+    /// Negative int64 values are written as ten-byte varints, like any protobuf encoder.
+    void number(uint32_t field, uint64_t v) {
+      if(v == 0) return;
+      tag(field, Varint);
+      varint(v);
+    }
+
+    void bytes(uint32_t field, const void* data, size_t size) {
+      tag(field, LengthDelimited);
+      varint(size);
+      _data.append((const char*)data, size);
+    }
+
+    void string(uint32_t field, const std::string& s) {
+      bytes(field, s.data(), s.size());
+    }
+
+    void message(uint32_t field, const encoder& e) {
+      bytes(field, e._data.data(), e._data.size());
+    }
+
+    /// Write a repeated integer field in packed form
+    template<typename T> void packed(uint32_t field, const std::vector<T>& values) {
+      if(values.size() == 0) return;
+      encoder e;
+      for(T v : values) {
+        e.varint((uint64_t)v);
+      }
+      message(field, e);
+    }
+  };
+
+  /// A key and value attached to a sample. Labels have either a string or a number.
+  struct label {
+    std::string key;
+    std::string str;
+    int64_t num;
+  };
+
+  /// Builds a profile. Mappings, functions, and locations are given ids as they are added,
+  /// and every string is stored once in the string table. Samples, locations, and functions
+  /// are encoded as they are added, so only the encoded profile is kept in memory.
+  class builder {
+  private:
+    struct mapping {
+      uint64_t limit;
+      uint64_t id;
+      uint64_t file_offset;
+      int64_t filename;
+      int64_t build_id;
+      bool has_functions;   ///< Set when a symbolized location is added in the mapping
+    };
+
+    encoder _records;
+    std::vector<std::string> _strings;
+    std::unordered_map<std::string, int64_t> _string_index;
+    std::map<uint64_t, mapping> _mappings;            ///< By start address
+    std::unordered_map<uint64_t, uint64_t> _locations;  ///< Location ids by address
+    std::map<std::pair<int64_t, int64_t>, uint64_t> _functions;  ///< By name and file strings
+    std::vector<std::pair<int64_t, int64_t>> _sample_types;
+    std::vector<int64_t> _comments;
+    std::pair<int64_t, int64_t> _period_type;
+    uint64_t _period = 0;
+    uint64_t _time = 0;
+    uint64_t _duration = 0;
+    int64_t _default_sample_type = 0;
+
+    /// Find the mapping that contains an address, or NULL if there isn't one
+    mapping* findMapping(uint64_t address) {
+      auto i = _mappings.upper_bound(address);
+      if(i == _mappings.begin()) return NULL;
+      --i;
+      return address < i->second.limit ? &i->second : NULL;
+    }
+
+    static void writeValueType(encoder& out, uint32_t field, std::pair<int64_t, int64_t> type) {
+      encoder e;
+      e.number(ValueTypeType, type.first);
+      e.number(ValueTypeUnit, type.second);
+      out.message(field, e);
+    }
+
+  public:
+    builder() : _period_type(0, 0) {
+      addString("");
+    }
+
+    /// Get a string's index in the string table, adding it if needed
+    int64_t addString(const std::string& s) {
+      auto i = _string_index.find(s);
+      if(i != _string_index.end())
+        return i->second;
+      int64_t index = _strings.size();
+      _strings.push_back(s);
+      _string_index.emplace(s, index);
+      return index;
+    }
+
+    /// Add a sample value type. Every sample has one value for each type, in this order.
+    void addSampleType(const std::string& type, const std::string& unit) {
+      _sample_types.emplace_back(addString(type), addString(unit));
+    }
+
+    void setDefaultSampleType(const std::string& type) { _default_sample_type = addString(type); }
+    void setPeriod(const std::string& type, const std::string& unit, uint64_t period) {
+      _period_type = std::make_pair(addString(type), addString(unit));
+      _period = period;
+    }
+    void setTime(uint64_t time_nanos, uint64_t duration_nanos) {
+      _time = time_nanos;
+      _duration = duration_nanos;
+    }
+    void addComment(const std::string& comment) { _comments.push_back(addString(comment)); }
+
+    /// Add a loaded file. Mappings must be added before the locations inside them. The first
+    /// mapping added at an address wins. Mappings without any symbolized locations are marked
+    /// so pprof can symbolize them from the file's build-id.
+    void addMapping(uint64_t start, uint64_t limit, uint64_t file_offset,
+                    const std::string& filename, const std::string& build_id) {
+      if(_mappings.find(start) != _mappings.end())
+        return;
+      _mappings.emplace(start, mapping{ limit, _mappings.size() + 1, file_offset,
+                                        addString(filename), addString(build_id), false });
+    }
+
+    /// Get the id of the location at an address, adding it if needed. Pass a NULL function
+    /// name to leave the location unsymbolized.
+    uint64_t addLocation(uint64_t address, const char* function_name, const std::string& filename) {
+      auto i = _locations.find(address);
+      if(i != _locations.end())
+        return i->second;
+
+      uint64_t id = _locations.size() + 1;
+      _locations.emplace(address, id);
+
+      mapping* m = findMapping(address);
+      encoder e;
+      e.number(LocationId, id);
+      e.number(LocationMappingId, m == NULL ? 0 : m->id);
+      e.number(LocationAddress, address);
+
+      if(function_name != NULL) {
+        if(m != NULL) m->has_functions = true;
+
+        std::pair<int64_t, int64_t> key(addString(function_name), addString(filename));
+        auto f = _functions.find(key);
+        if(f == _functions.end()) {
+          f = _functions.emplace(key, _functions.size() + 1).first;
+          encoder fn;
+          fn.number(FunctionId, f->second);
+          fn.number(FunctionName, key.first);
+          fn.number(FunctionSystemName, key.first);
+          fn.number(FunctionFilename, key.second);
+          _records.message(ProfileFunction, fn);
+        }
+
+        encoder line;
+        line.number(LineFunctionId, f->second);
+        e.message(LocationLine, line);
+      }
+
+      _records.message(ProfileLocation, e);
+      return id;
+    }
+
+    /// Add a sample with one value per sample type
+    void addSample(uint64_t location, const std::vector<int64_t>& values,
+                   const std::vector<label>& labels = std::vector<label>()) {
+      encoder e;
+      e.packed(SampleLocationId, std::vector<uint64_t>(1, location));
+      e.packed(SampleValue, values);
+      for(const label& l : labels) {
+        encoder le;
+        le.number(LabelKey, addString(l.key));
+        if(!l.str.empty()) le.number(LabelStr, addString(l.str));
+        else le.number(LabelNum, l.num);
+        e.message(SampleLabel, le);
+      }
+      _records.message(ProfileSample, e);
+    }
+
+    /// Write the whole profile. Returns false if the write failed.
+    bool write(int fd) {
+      encoder header;
+      for(const auto& t : _sample_types) {
+        writeValueType(header, ProfileSampleType, t);
+      }
+
+      for(const auto& i : _mappings) {
+        encoder e;
+        e.number(MappingId, i.second.id);
+        e.number(MappingMemoryStart, i.first);
+        e.number(MappingMemoryLimit, i.second.limit);
+        e.number(MappingFileOffset, i.second.file_offset);
+        e.number(MappingFilename, i.second.filename);
+        e.number(MappingBuildId, i.second.build_id);
+        e.number(MappingHasFunctions, i.second.has_functions ? 1 : 0);
+        header.message(ProfileMapping, e);
+      }
+
+      encoder trailer;
+      for(const std::string& s : _strings) {
+        trailer.string(ProfileStringTable, s);
+      }
+      trailer.number(ProfileTimeNanos, _time);
+      trailer.number(ProfileDurationNanos, _duration);
+      writeValueType(trailer, ProfilePeriodType, _period_type);
+      trailer.number(ProfilePeriod, _period);
+      for(int64_t c : _comments) {
+        trailer.number(ProfileComment, c);
+      }
+      trailer.number(ProfileDefaultSampleType, _default_sample_type);
+
+      profile::buffered_writer out(fd);
+      out.write(header.getData().data(), header.getData().size());
+      out.write(_records.getData().data(), _records.getData().size());
+      out.write(trailer.getData().data(), trailer.getData().size());
+      return out.flush();
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,314 @@
+#if !defined(CAUSAL_RUNTIME_PROFILE_H)
+#define CAUSAL_RUNTIME_PROFILE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Binary profile format. Each run appends one segment to the profile. A segment starts with
+/// a header, followed by sections of fixed-width records, and ends with an index that gives
+/// the type, record size, offset, and count of every section. Offsets are relative to the start
+/// of the segment, so segments are self-contained and can be concatenated or appended to
+/// without changing earlier runs. Strings are stored once per segment in a string table and
+/// referenced by offset. Offset zero is always the empty string.
+namespace profile {
+  enum {
+    Version = 1
+  };
+
+  static const char Magic[8] = { 'C', 'Z', 'P', 'R', 'O', 'F', 'I', 'L' };
+
+  struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t size;            ///< Size of the segment in bytes, including this header
+    uint64_t index_offset;
+    uint64_t cycle_period;
+    uint64_t inst_period;
+    uint32_t basename;        ///< String table offset of the run's name
+    uint32_t reserved;
+  };
+
+  /// Section types
+  enum section_type : uint32_t {
+    Strings = 1,
+    Mappings = 2,
+    PCs = 3,
+    Blocks = 4,
+    Loops = 5,
+    Experiments = 6,
+    Progress = 7,             ///< Progress counter deltas for experiments, as uint64_t
+    Run = 8,                  ///< A single record describing the profiled process
+    Overhead = 9,
+    MappingTimes = 10,        ///< Retire time of each mapping, as uint64_t, or zero if still loaded
+    PCTimes = 11              ///< Time of the latest sample at each PC, as uint64_t
+  };
+
+  struct index_entry {
+    uint32_t type;
+    uint32_t record_size;
+    uint64_t offset;
+    uint64_t count;
+  };
+
+  /// The process a segment's run was recorded in
+  struct run_record {
+    uint64_t pid;
+    uint64_t start_time;      ///< Wall clock time in nanoseconds since the epoch
+    uint64_t end_time;
+    uint64_t threads;
+    uint32_t command;
+    uint32_t host;
+  };
+
+  /// A file loaded in the profiled process, for offline symbolization
+  struct mapping_record {
+    uint64_t base;
+    uint64_t limit;
+    uint64_t load_offset;
+    uint32_t name;
+    uint32_t build_id;        ///< Empty if the file has no build-id
+  };
+
+  /// Samples at one raw program counter
+  struct pc_record {
+    uint64_t pc;
+    uint64_t cycle_samples;
+    uint64_t inst_samples;
+  };
+
+  struct block_record {
+    uint64_t base;
+    uint64_t limit;
+    uint32_t file;
+    uint32_t function;
+    uint64_t length;
+    uint64_t cycle_samples;
+    uint64_t inst_samples;
+  };
+
+  /// A natural loop, identified by its header block
+  struct loop_record {
+    uint64_t base;
+    uint64_t limit;
+    uint32_t file;
+    uint32_t function;
+    uint32_t depth;
+    uint32_t block_count;
+    uint64_t cycle_samples;
+    uint64_t inst_samples;
+  };
+
+  /// Time the runtime spent on one kind of work
+  struct overhead_record {
+    uint32_t category;        ///< "handler", "delay", "profiler", "blocks", "symbols", or "output"
+    uint32_t reserved;
+    uint64_t count;           ///< Number of measured events
+    uint64_t nanos;
+  };
+
+  struct experiment_record {
+    uint32_t kind;            ///< "block" or "loop"
+    uint32_t file;
+    uint32_t function;
+    uint32_t range_count;
+    uint64_t base;
+    uint64_t limit;
+    uint64_t duration;
+    uint64_t delay_size;
+    uint64_t delays;
+    uint64_t first_progress;  ///< Index of this experiment's first entry in the progress section
+    uint64_t progress_count;
+  };
+
+  /// Writes to a file descriptor through a fixed-size buffer
+  class buffered_writer {
+  private:
+    enum { BufferSize = 64 * 1024 };
+    int _fd;
+    size_t _used = 0;
+    bool _ok = true;
+    char _buffer[BufferSize];
+
+    void writeAll(const char* p, size_t size) {
+      while(_ok && size > 0) {
+        ssize_t n = ::write(_fd, p, size);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) _ok = false;
+        else {
+          p += n;
+          size -= n;
+        }
+      }
+    }
+
+  public:
+    buffered_writer(int fd) : _fd(fd) {}
+
+    void write(const void* data, size_t size) {
+      const char* p = (const char*)data;
+      // Large writes skip the buffer
+      if(size >= BufferSize) {
+        flush();
+        writeAll(p, size);
+        return;
+      }
+      if(_used + size > BufferSize)
+        flush();
+      memcpy(_buffer + _used, p, size);
+      _used += size;
+    }
+
+    /// Write out any buffered data. Returns false if any write has failed.
+    bool flush() {
+      writeAll(_buffer, _used);
+      _used = 0;
+      return _ok;
+    }
+  };
+
+  /// Collects the records for one run, then writes them as a segment
+  class writer {
+  private:
+    uint64_t _cycle_period;
+    uint64_t _inst_period;
+    uint32_t _basename;
+    std::vector<run_record> _run;
+    std::string _strtab;
+    std::unordered_map<std::string, uint32_t> _strings;
+    std::vector<mapping_record> _mappings;
+    std::vector<uint64_t> _mapping_times;
+    std::vector<pc_record> _pcs;
+    std::vector<uint64_t> _pc_times;
+    std::vector<block_record> _blocks;
+    std::vector<loop_record> _loops;
+    std::vector<experiment_record> _experiments;
+    std::vector<uint64_t> _progress;
+    std::vector<overhead_record> _overhead;
+
+    /// Round an offset up so every section is 8-byte aligned
+    static uint64_t align(uint64_t offset) {
+      return (offset + 7) & ~(uint64_t)7;
+    }
+
+    template<typename T> void addSection(std::vector<index_entry>& index, uint64_t& offset,
+                                         uint32_t type, const std::vector<T>& records) {
+      index.push_back(index_entry{ type, sizeof(T), offset, records.size() });
+      offset = align(offset + records.size() * sizeof(T));
+    }
+
+    template<typename T> static void writeSection(buffered_writer& out, uint64_t& pos, const index_entry& e,
+                                                  const std::vector<T>& records) {
+      static const char padding[8] = { 0 };
+      out.write(padding, e.offset - pos);
+      out.write(records.data(), records.size() * sizeof(T));
+      pos = e.offset + records.size() * sizeof(T);
+    }
+
+  public:
+    writer(const char* basename, size_t cycle_period, size_t inst_period) :
+        _cycle_period(cycle_period), _inst_period(inst_period) {
+      addString("");
+      _basename = addString(basename);
+    }
+
+    /// Add a string to the string table if it isn't already there, and return its offset
+    uint32_t addString(const std::string& s) {
+      auto i = _strings.find(s);
+      if(i != _strings.end())
+        return i->second;
+      uint32_t offset = _strtab.size();
+      _strtab.append(s);
+      _strtab.push_back('\0');
+      _strings.emplace(s, offset);
+      return offset;
+    }
+
+    void setRun(const run_record& r) { _run.assign(1, r); }
+    void addBlock(const block_record& r) { _blocks.push_back(r); }
+    void addLoop(const loop_record& r) { _loops.push_back(r); }
+    void addOverhead(const overhead_record& r) { _overhead.push_back(r); }
+
+    /// Add a mapping with its retire time, or zero if it is still loaded. The times go in a
+    /// separate section so readers of older profiles see the same mapping records.
+    void addMapping(const mapping_record& r, uint64_t retire_time) {
+      _mappings.push_back(r);
+      _mapping_times.push_back(retire_time);
+    }
+
+    /// Add the samples at one PC with the time of its latest sample
+    void addPC(const pc_record& r, uint64_t time) {
+      _pcs.push_back(r);
+      _pc_times.push_back(time);
+    }
+
+    void addExperiment(experiment_record r, const std::vector<size_t>& progress) {
+      r.first_progress = _progress.size();
+      r.progress_count = progress.size();
+      _experiments.push_back(r);
+      _progress.insert(_progress.end(), progress.begin(), progress.end());
+    }
+
+    /// Write the records as one segment, with a single sequential pass over the output
+    bool write(int fd) {
+      // Lay out the sections before writing anything, so the header can come first
+      std::vector<index_entry> index;
+      uint64_t offset = align(sizeof(header));
+      index.push_back(index_entry{ Strings, 1, offset, _strtab.size() });
+      offset = align(offset + _strtab.size());
+      addSection(index, offset, Mappings, _mappings);
+      addSection(index, offset, PCs, _pcs);
+      addSection(index, offset, Blocks, _blocks);
+      addSection(index, offset, Loops, _loops);
+      addSection(index, offset, Experiments, _experiments);
+      addSection(index, offset, Progress, _progress);
+      addSection(index, offset, Run, _run);
+      addSection(index, offset, Overhead, _overhead);
+      addSection(index, offset, MappingTimes, _mapping_times);
+      addSection(index, offset, PCTimes, _pc_times);
+
+      header h;
+      memcpy(h.magic, Magic, sizeof(Magic));
+      h.version = Version;
+      h.section_count = index.size();
+      h.index_offset = offset;
+      h.size = offset + index.size() * sizeof(index_entry);
+      h.cycle_period = _cycle_period;
+      h.inst_period = _inst_period;
+      h.basename = _basename;
+      h.reserved = 0;
+
+      buffered_writer out(fd);
+      uint64_t pos = sizeof(header);
+      out.write(&h, sizeof(h));
+
+      static const char padding[8] = { 0 };
+      out.write(padding, index[0].offset - pos);
+      out.write(_strtab.data(), _strtab.size());
+      pos = index[0].offset + _strtab.size();
+
+      writeSection(out, pos, index[1], _mappings);
+      writeSection(out, pos, index[2], _pcs);
+      writeSection(out, pos, index[3], _blocks);
+      writeSection(out, pos, index[4], _loops);
+      writeSection(out, pos, index[5], _experiments);
+      writeSection(out, pos, index[6], _progress);
+      writeSection(out, pos, index[7], _run);
+      writeSection(out, pos, index[8], _overhead);
+      writeSection(out, pos, index[9], _mapping_times);
+      writeSection(out, pos, index[10], _pc_times);
+
+      out.write(padding, h.index_offset - pos);
+      out.write(index.data(), index.size() * sizeof(index_entry));
+      return out.flush();
+    }
+  };
+}
+
+#endif
@@ -18,6 +18,7 @@ public:
   MAKE_WRAPPER(exit, RTLD_NEXT);
   MAKE_WRAPPER(_exit, RTLD_NEXT);
   MAKE_WRAPPER(_Exit, RTLD_NEXT);
+  MAKE_WRAPPER(dlclose, RTLD_NEXT);
   MAKE_WRAPPER(fork, RTLD_NEXT);
   MAKE_WRAPPER(pthread_create, RTLD_NEXT);
   MAKE_WRAPPER(pthread_exit, RTLD_NEXT);
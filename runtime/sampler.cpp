@@ -1,16 +1,30 @@
 #include "sampler.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <atomic>
 #include <list>
 #include <new>
+#include <vector>
 
+#include "overhead.h"
 #include "papi.h"
 
 using std::list;
+using std::vector;
 
-typedef list<SampleBlock*, STLAllocator<SampleBlock*, CausalHeap>> GlobalBlockList;
+typedef list<SampleBlock*, STLAllocator<SampleBlock*, PrivateHeap>> GlobalBlockList;
+
+/// Address ranges that samples are recorded in
+struct ScopeRanges : public PrivateAllocated {
+  vector<interval, STLAllocator<interval, PrivateHeap>> ranges;
+  /// The next replaced set of ranges waiting to be freed
+  ScopeRanges* next_retired = nullptr;
+};
 
 /// Mutex to protect the global block list
 pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
@@ -26,8 +40,10 @@ GlobalBlockList& getGlobalBlocks() {
 
 /// The current sampler mode
 atomic<SamplerMode> mode = ATOMIC_VAR_INIT(SamplerMode::Normal);
-/// The range of addresses used for speedup/slowdown
-interval perturbed_range;
+/// The ranges of addresses used for speedup/slowdown, sorted by address
+interval perturbed_ranges[MaxPerturbedRanges];
+/// The number of perturbed ranges in use
+size_t perturbed_count = 0;
 /// The size of the delay to insert in slowdown/speedup mode
 size_t delay_size;
 
@@ -47,13 +63,35 @@ __thread size_t local_delay_count;
 __thread int local_magic;
 /// The thread-local sample block pointer
 __thread SampleBlock* local_block;
+/// The current thread's kernel thread ID, recorded in its sample blocks
+__thread pid_t local_thread;
 /// Set to false when sampling should finish up
 atomic<bool> active = ATOMIC_VAR_INIT(true);
+/// Set while samples are being dropped
+atomic<bool> paused = ATOMIC_VAR_INIT(false);
+/// The number of samples dropped while paused
+atomic<size_t> dropped_samples = ATOMIC_VAR_INIT(0);
+/// The ranges samples are recorded in, or NULL to record every sample
+atomic<ScopeRanges*> scope = ATOMIC_VAR_INIT(nullptr);
+/// A handler may still be reading the old ranges when they are replaced. Each handler that
+/// reads the ranges counts itself in the reader count for the parity of the current epoch.
+/// Advancing the epoch sends new handlers to the other count, so the count for the previous
+/// epoch drains even while other threads keep sampling.
+atomic<size_t> scope_epoch = ATOMIC_VAR_INIT(0);
+atomic<size_t> scope_readers[2];
+/// Ranges replaced since the epoch last advanced. Only used by setScope and reclaimScopes.
+ScopeRanges* retired_scopes = nullptr;
+/// Ranges replaced before the epoch last advanced, freed once the previous epoch's readers finish
+ScopeRanges* draining_scopes = nullptr;
+/// The number of samples dropped because they were out of scope
+atomic<size_t> filtered_samples = ATOMIC_VAR_INIT(0);
 
 /// Push the current thread's sample block to the global list
 void submitLocalBlock() {
   // Finish the current block (sets the end time)
   local_block->done();
+  // Publish this thread's handler time along with its samples
+  overhead::flushLocal();
   // Lock the global blocks list
   pthread_mutex_lock(&mtx);
   // Add the local block to the global list
@@ -68,13 +106,13 @@ void submitLocalBlock() {
 SampleBlock* getLocalBlock() {
   if(local_magic != 0xD00FCA75 || local_block == NULL) {
     local_magic = 0xD00FCA75;
-    local_block = new SampleBlock(mode);
+    local_block = new SampleBlock(mode, local_thread);
   } else if(local_block->isFull()) {
     submitLocalBlock();
-    local_block = new SampleBlock(mode);
+    local_block = new SampleBlock(mode, local_thread);
   } else if(local_block->getMode() != mode) {
     submitLocalBlock();
-    local_block = new SampleBlock(mode);
+    local_block = new SampleBlock(mode, local_thread);
   }
   
   return local_block;
@@ -84,8 +122,64 @@ SampleBlock* getLocalBlock() {
 void flushLocalBlock() {
   if(local_magic == 0xD00FCA75 && local_block != NULL) {
     submitLocalBlock();
-    local_block = new SampleBlock(mode);
+    local_block = new SampleBlock(mode, local_thread);
+  }
+}
+
+/// Check if an address is in one of a set of sorted, non-overlapping ranges
+static bool inRanges(const interval* ranges, size_t count, uintptr_t p) {
+  // Binary search for the first range that ends after p
+  size_t lo = 0;
+  size_t hi = count;
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if(ranges[mid].getLimit() <= p) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < count && ranges[lo].contains(p);
+}
+
+/// Check if an address is in one of the perturbed ranges
+static bool inPerturbedRange(uintptr_t p) {
+  return inRanges(perturbed_ranges, perturbed_count, p);
+}
+
+/// Check if samples at an address should be recorded
+static bool inScope(uintptr_t p) {
+  if(scope.load() == nullptr)
+    return true;
+
+  // Count this handler as a reader before loading the ranges it reads. Retry if the epoch
+  // advanced in between, so the handler is always counted for the epoch it read.
+  size_t epoch = scope_epoch.load();
+  scope_readers[epoch & 1]++;
+  while(scope_epoch.load() != epoch) {
+    scope_readers[epoch & 1]--;
+    epoch = scope_epoch.load();
+    scope_readers[epoch & 1]++;
+  }
+
+  ScopeRanges* s = scope.load();
+  bool result = s == nullptr || inRanges(s->ranges.data(), s->ranges.size(), p);
+  scope_readers[epoch & 1]--;
+  return result;
+}
+
+/// Set the perturbed ranges and start a new delay round
+static void startDelays(const interval* ranges, size_t count, size_t d) {
+  if(count > MaxPerturbedRanges)
+    count = MaxPerturbedRanges;
+  for(size_t i = 0; i < count; i++) {
+    perturbed_ranges[i] = ranges[i];
   }
+  perturbed_count = count;
+  delay_size = d;
+  
+  // Advance to the next delay round (causes threads to reset their local counts to zero)
+  delay_round++;
+  // Reset the global delay count
+  delay_count.store(0);
+  executed_delay_count.store(0);
 }
 
 enum {
@@ -93,21 +187,30 @@ enum {
   InstructionSampleMask = 0x2
 };
 
-/// Signal handler for PAPI's instruction and cycle sampling
-static void overflowHandler(int event_set, void* address, long long vec, void* context) {
-  if(!active) {
-    flushLocalBlock();
-    return;
-  }
+/// Insert one delay, and return the cycles it took
+static uint64_t delay() {
+  uint64_t start = timing::getCycles();
+  wait(delay_size);
+  uint64_t cycles = timing::getCycles() - start;
+  overhead::addLocal(overhead::Delay, cycles);
+  return cycles;
+}
+
+/// Record a sample and insert any delays it calls for. Returns the cycles spent in delays.
+static uint64_t handleSample(uintptr_t address, long long vec) {
+  uint64_t delayed = 0;
+  bool in_scope = inScope(address);
   
   if(vec & CycleSampleMask) {
-    getLocalBlock()->add(SampleType::Cycle, (uintptr_t)address);
+    if(in_scope) getLocalBlock()->add(SampleType::Cycle, address);
+    else filtered_samples++;
   }
 
   if(vec & InstructionSampleMask) {
-    getLocalBlock()->add(SampleType::Instruction, (uintptr_t)address);
+    if(in_scope) getLocalBlock()->add(SampleType::Instruction, address);
+    else filtered_samples++;
     
-    if(mode.load() == SamplerMode::Slowdown && perturbed_range.contains((uintptr_t)address)) {
+    if(mode.load() == SamplerMode::Slowdown && inPerturbedRange(address)) {
       // Reset the local delay count if this is a new round
       if(local_delay_round != delay_round) {
         local_delay_round = delay_round;
@@ -115,7 +218,7 @@ static void overflowHandler(int event_set, void* address, long long vec, void* c
       }
       delay_count++;
       local_delay_count++;
-      wait(delay_size);
+      delayed += delay();
       
     } else if(mode.load() == SamplerMode::Speedup) {
       // Reset the local delay count if this is a new round
@@ -128,45 +231,57 @@ static void overflowHandler(int event_set, void* address, long long vec, void* c
       while(local_delay_count < delay_count.load()) {
         size_t old_local_count = local_delay_count;
         local_delay_count++;
-        wait(delay_size);
+        delayed += delay();
         // Update the executed delay count if this thread was the straggler
         executed_delay_count.compare_exchange_strong(old_local_count, local_delay_count);
       }
       
       // When we get a sample in the perturbed range, make other threads delay
-      if(perturbed_range.contains((uintptr_t)address)) {
+      if(inPerturbedRange(address)) {
         local_delay_count++;
         delay_count++;
       }
     }
   }
+  
+  return delayed;
+}
+
+/// Signal handler for PAPI's instruction and cycle sampling
+static void overflowHandler(int event_set, void* address, long long vec, void* context) {
+  if(!active) {
+    flushLocalBlock();
+    return;
+  }
+  
+  // Samples taken while paused are counted and dropped, and no delays are inserted
+  if(paused.load()) {
+    dropped_samples++;
+    return;
+  }
+  
+  uint64_t start = timing::getCycles();
+  uint64_t delayed = handleSample((uintptr_t)address, vec);
+  overhead::addLocal(overhead::Handler, timing::getCycles() - start - delayed);
 }
 
 // The public API
 namespace sampler {
   void startSlowdown(interval r, size_t d) {
-    perturbed_range = r;
-    delay_size = d;
-    
-    // Advance to the next delay round (causes threads to reset their local counts to zero)
-    delay_round++;
-    // Reset the global delay count
-    delay_count.store(0);
-    executed_delay_count.store(0);
-    
+    startSlowdown(&r, 1, d);
+  }
+  
+  void startSlowdown(const interval* ranges, size_t count, size_t d) {
+    startDelays(ranges, count, d);
     mode.store(SamplerMode::Slowdown);
   }
   
   void startSpeedup(interval r, size_t d) {
-    perturbed_range = r;
-    delay_size = d;
-    
-    // Advance to the next delay round (causes threads to reset their local counts to zero)
-    delay_round++;
-    // Reset the global delay count
-    delay_count.store(0);
-    executed_delay_count.store(0);
-    
+    startSpeedup(&r, 1, d);
+  }
+  
+  void startSpeedup(const interval* ranges, size_t count, size_t d) {
+    startDelays(ranges, count, d);
     mode.store(SamplerMode::Speedup);
   }
   
@@ -175,16 +290,83 @@ namespace sampler {
     return executed_delay_count.load();
   }
   
-  SampleBlock* getNextBlock() {
+  void pause() {
+    paused.store(true);
+  }
+  
+  void resume() {
+    paused.store(false);
+  }
+  
+  bool isPaused() {
+    return paused.load();
+  }
+  
+  size_t getDroppedSamples() {
+    return dropped_samples.load();
+  }
+  
+  void setScope(const interval* ranges, size_t count) {
+    ScopeRanges* s = new ScopeRanges();
+    s->ranges.assign(ranges, ranges + count);
+    ScopeRanges* old = scope.exchange(s);
+    if(old != nullptr) {
+      old->next_retired = retired_scopes;
+      retired_scopes = old;
+    }
+    reclaimScopes();
+  }
+  
+  void reclaimScopes() {
+    // Handlers counted for the previous epoch may still hold ranges replaced before it ended
+    size_t epoch = scope_epoch.load();
+    if(scope_readers[(epoch + 1) & 1].load() != 0)
+      return;
+    
+    while(draining_scopes != nullptr) {
+      ScopeRanges* next = draining_scopes->next_retired;
+      delete draining_scopes;
+      draining_scopes = next;
+    }
+    
+    // Handlers that start after the epoch advances can only find the current ranges
+    if(retired_scopes != nullptr) {
+      draining_scopes = retired_scopes;
+      retired_scopes = nullptr;
+      scope_epoch++;
+    }
+  }
+  
+  size_t getFilteredSamples() {
+    return filtered_samples.load();
+  }
+  
+  SampleBlock* getNextBlock(size_t timeout) {
+    // Find the absolute deadline for a timed wait
+    struct timespec deadline;
+    if(timeout > 0) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      size_t nanos = deadline.tv_nsec + timeout;
+      deadline.tv_sec += nanos / Time_s;
+      deadline.tv_nsec = nanos % Time_s;
+    }
+    
     // Lock the global blocks list
     pthread_mutex_lock(&mtx);
     // Wait while the list is empty
     while(getGlobalBlocks().size() == 0) {
       // When sampling is inactive and there are no global blocks, just return NULL
       if(!active.load()) {
+        pthread_mutex_unlock(&mtx);
+        return NULL;
+      }
+      
+      if(timeout == 0) {
+        pthread_cond_wait(&cv, &mtx);
+      } else if(pthread_cond_timedwait(&cv, &mtx, &deadline) == ETIMEDOUT) {
+        pthread_mutex_unlock(&mtx);
         return NULL;
       }
-      pthread_cond_wait(&cv, &mtx);
     }
     // Take the first block off the list
     SampleBlock* result = getGlobalBlocks().front();
@@ -192,12 +374,29 @@ namespace sampler {
     pthread_mutex_unlock(&mtx);
     return result;
   }
+  
+  size_t getPendingBlocks() {
+    pthread_mutex_lock(&mtx);
+    size_t result = getGlobalBlocks().size();
+    pthread_mutex_unlock(&mtx);
+    return result;
+  }
+  
+  bool isFinished() {
+    pthread_mutex_lock(&mtx);
+    bool result = !active.load() && getGlobalBlocks().size() == 0;
+    pthread_mutex_unlock(&mtx);
+    return result;
+  }
 
   void initializeThread(size_t cycle_period, size_t inst_period) {
     // Set the thread-local delay round and counts to match the global executed count
     // This thread is just being created, so it should inherit from the source thread
     local_delay_round = delay_round.load();
     local_delay_count = executed_delay_count.load();
+    local_thread = syscall(SYS_gettid);
+    // Sample blocks come from this thread's own heap, which has to exist before the first interrupt
+    ThreadHeap::attach();
     
     papi::startThread(cycle_period, inst_period, overflowHandler);
   }
@@ -205,6 +404,8 @@ namespace sampler {
   void shutdownThread() {
     papi::stopThread();
     flushLocalBlock();
+    overhead::flushLocal();
+    ThreadHeap::detach();
   }
   
   void finish() {
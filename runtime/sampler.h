@@ -1,12 +1,16 @@
 #if !defined(CAUSAL_RUNTIME_SAMPLES_H)
 #define CAUSAL_RUNTIME_SAMPLES_H
 
+#include <sys/types.h>
+
 #include "heap.h"
 #include "interval.h"
 #include "util.h"
 
 enum {
-  BlockSize = 1024
+  BlockSize = 1024,
+  /// The most address ranges that can be perturbed at once
+  MaxPerturbedRanges = 64
 };
 
 enum class SampleType {
@@ -31,15 +35,19 @@ public:
 struct SampleBlock : public PrivateAllocated {
 private:
   SamplerMode _mode;
+  /// The kernel thread ID of the thread that took the samples
+  pid_t _thread;
   size_t _start_time;
   size_t _end_time;
   size_t _count = 0;
   Sample _samples[BlockSize];
   
 public:
-  SampleBlock(SamplerMode mode) : _mode(mode), _start_time(getTime()) {}
+  SampleBlock(SamplerMode mode, pid_t thread) : _mode(mode), _thread(thread), _start_time(getTime()) {}
   
   inline SamplerMode getMode() const { return _mode; }
+  inline pid_t getThread() const { return _thread; }
+  inline size_t getStartTime() const { return _start_time; }
   inline bool isFull() const { return _count >= BlockSize; }
   inline size_t getCount() const { return _count; }
   
@@ -62,18 +70,44 @@ public:
 };
 
 namespace sampler {
-  /// Take the oldest global sample chunk
-  SampleBlock* getNextBlock();
+  /// Take the oldest global sample chunk. Returns NULL once sampling has finished and every
+  /// block has been taken, or if no block arrives within `timeout` nanoseconds (zero waits forever).
+  SampleBlock* getNextBlock(size_t timeout = 0);
+  /// Check if sampling has finished and every block has been taken
+  bool isFinished();
+  /// Get the number of blocks waiting to be taken
+  size_t getPendingBlocks();
   /// Start sampling in the current thread
   void initializeThread(size_t cycle_period, size_t inst_period);
   /// Finish sampling in the current thread
   void shutdownThread();
   /// Start slowdown mode in an address range
   void startSlowdown(interval range, size_t delay_size);
+  /// Start slowdown mode in a set of sorted, non-overlapping address ranges
+  void startSlowdown(const interval* ranges, size_t count, size_t delay_size);
   /// Start speedup mode in an address range
   void startSpeedup(interval range, size_t delay_size);
+  /// Start speedup mode in a set of sorted, non-overlapping address ranges
+  void startSpeedup(const interval* ranges, size_t count, size_t delay_size);
   /// Return to normal sampling mode. Returns the total number of delays inserted.
   size_t reset();
+  /// Drop samples until resume is called. Threads still take sampling interrupts while paused.
+  void pause();
+  /// Start recording samples again after a pause
+  void resume();
+  /// Check if sampling is paused
+  bool isPaused();
+  /// Get the number of samples dropped while sampling was paused
+  size_t getDroppedSamples();
+  /// Only record samples in a set of sorted, non-overlapping address ranges. Samples outside
+  /// them are counted and dropped, but still insert delays during experiments. Calls must not
+  /// overlap.
+  void setScope(const interval* ranges, size_t count);
+  /// Free the ranges replaced by setScope once no signal handler can still be reading them.
+  /// Calls must not overlap with setScope. Ranges that may still be in use are kept for a later call.
+  void reclaimScopes();
+  /// Get the number of samples dropped because they were out of scope
+  size_t getFilteredSamples();
   /// Stop saving samples and flush all remaining
   void finish();
 }
@@ -0,0 +1,123 @@
+#if !defined(CAUSAL_RUNTIME_SCOPE_H)
+#define CAUSAL_RUNTIME_SCOPE_H
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "options.h"
+
+/// Include and exclude lists that limit profiling to chosen files, functions, and source
+/// files. Each list is read from an option as comma-separated patterns. An empty include list
+/// includes everything, and anything that matches an exclude pattern is left out.
+///
+/// File and source patterns match a path that starts with the pattern, or that contains it
+/// right after a slash, so `libfoo` matches `/usr/lib/libfoo.so.1` and `src/net` matches
+/// `/home/me/proj/src/net/socket.c`. Symbol patterns are prefixes, matched against every name
+/// a function has. Sources are the paths of DWARF compilation units when a file has debug info.
+/// Otherwise they come from the symbol table, which usually names sources without directories
+/// and only for local functions and their neighbors. Functions with an unknown source are
+/// never excluded by a source pattern, and never included by one.
+class ScopeFilter {
+private:
+  std::vector<std::string> _include_files;
+  std::vector<std::string> _exclude_files;
+  std::vector<std::string> _include_symbols;
+  std::vector<std::string> _exclude_symbols;
+  std::vector<std::string> _include_sources;
+  std::vector<std::string> _exclude_sources;
+
+  static std::vector<std::string> getList(const char* name) {
+    std::vector<std::string> result;
+    const char* value = options::getString(name);
+    if(value == NULL)
+      return result;
+
+    std::string list(value);
+    size_t start = 0;
+    while(start <= list.size()) {
+      size_t end = list.find(',', start);
+      if(end == std::string::npos) end = list.size();
+      if(end > start) result.push_back(list.substr(start, end - start));
+      start = end + 1;
+    }
+    return result;
+  }
+
+  static bool matchesPath(const char* path, const std::string& pattern) {
+    if(strncmp(path, pattern.c_str(), pattern.size()) == 0)
+      return true;
+    for(const char* p = strchr(path, '/'); p != NULL; p = strchr(p + 1, '/')) {
+      if(strncmp(p + 1, pattern.c_str(), pattern.size()) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  static bool matchesAnyPath(const char* path, const std::vector<std::string>& patterns) {
+    for(const std::string& pattern : patterns) {
+      if(matchesPath(path, pattern)) return true;
+    }
+    return false;
+  }
+
+  /// Check if a function's name or any of its aliases starts with one of the patterns
+  template<typename Aliases>
+  static bool matchesAnySymbol(const char* name, Aliases& aliases, const std::vector<std::string>& patterns) {
+    for(const std::string& pattern : patterns) {
+      if(strncmp(name, pattern.c_str(), pattern.size()) == 0)
+        return true;
+      for(const char* alias : aliases) {
+        if(strncmp(alias, pattern.c_str(), pattern.size()) == 0)
+          return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  /// Read the lists from the CAUSAL_INCLUDE_* and CAUSAL_EXCLUDE_* options
+  static ScopeFilter fromOptions() {
+    ScopeFilter f;
+    f._include_files = getList("CAUSAL_INCLUDE_FILES");
+    f._exclude_files = getList("CAUSAL_EXCLUDE_FILES");
+    f._include_symbols = getList("CAUSAL_INCLUDE_SYMBOLS");
+    f._exclude_symbols = getList("CAUSAL_EXCLUDE_SYMBOLS");
+    f._include_sources = getList("CAUSAL_INCLUDE_SOURCES");
+    f._exclude_sources = getList("CAUSAL_EXCLUDE_SOURCES");
+    return f;
+  }
+
+  /// Check if any pattern is set
+  bool isActive() const {
+    return !_include_files.empty() || !_exclude_files.empty() || hasFunctionFilters();
+  }
+
+  /// Check if any symbol or source pattern is set, so a file's functions are filtered one by one
+  bool hasFunctionFilters() const {
+    return !_include_symbols.empty() || !_exclude_symbols.empty() ||
+           !_include_sources.empty() || !_exclude_sources.empty();
+  }
+
+  bool includesFile(const std::string& path) const {
+    if(!_include_files.empty() && !matchesAnyPath(path.c_str(), _include_files))
+      return false;
+    return !matchesAnyPath(path.c_str(), _exclude_files);
+  }
+
+  /// Check if a function is in scope. `aliases` can be any container of names.
+  template<typename Aliases>
+  bool includesFunction(const char* name, Aliases& aliases, const char* source) const {
+    if(!_include_symbols.empty() && !matchesAnySymbol(name, aliases, _include_symbols))
+      return false;
+    if(matchesAnySymbol(name, aliases, _exclude_symbols))
+      return false;
+
+    if(!_include_sources.empty() && (source == NULL || !matchesAnyPath(source, _include_sources)))
+      return false;
+    return source == NULL || !matchesAnyPath(source, _exclude_sources);
+  }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#if !defined(CAUSAL_RUNTIME_STATS_H)
+#define CAUSAL_RUNTIME_STATS_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+
+/// Live statistics published in a shared memory file, so a monitor like causal-top can watch
+/// a running program without interrupting it. The profiler thread is the only writer. Readers
+/// map the file read-only and copy it under a sequence lock: the sequence number is odd while
+/// an update is in progress, and a copy is only consistent if the number was even and
+/// unchanged across the whole copy.
+namespace stats {
+  enum {
+    Version = 2,
+    MaxCounters = 64,
+    MaxThreads = 256,
+    NameSize = 128
+  };
+
+  static const char Magic[8] = { 'C', 'Z', 'S', 'T', 'A', 'T', 'S', '\0' };
+
+  struct counter_record {
+    char name[NameSize];      ///< The counter's source location, as file:line
+    uint64_t value;
+  };
+
+  /// Samples from one profiled thread
+  struct thread_record {
+    uint64_t tid;
+    uint64_t samples;
+    uint64_t rate;            ///< Samples per second over the last rate interval
+  };
+
+  /// The speedup experiment that is running, if any
+  struct experiment_record {
+    uint64_t running;
+    uint64_t start_time;      ///< Wall clock time in nanoseconds since the epoch
+    uint64_t base;
+    uint64_t limit;
+    char kind[16];
+    char function[NameSize];
+    char file[NameSize];
+  };
+
+  struct segment {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;            ///< Size of this structure, checked by readers
+    uint64_t pid;
+    uint64_t sequence;
+
+    // Everything below is protected by the sequence number
+    uint64_t start_time;      ///< Wall clock times in nanoseconds since the epoch
+    uint64_t update_time;
+    uint64_t finished;        ///< Set by the last update, when the program exits
+    uint64_t paused;
+    uint64_t samples;         ///< Samples the profiler thread has attributed
+    uint64_t dropped_samples; ///< Samples dropped while paused
+    uint64_t filtered_samples;  ///< Samples dropped because they were out of scope
+    uint64_t pending_blocks;  ///< Sample blocks waiting for the profiler thread
+    uint64_t deferred_functions;  ///< Functions with samples waiting for their blocks
+    uint64_t experiments;     ///< Completed speedup experiments
+    experiment_record experiment;
+    uint64_t counter_count;
+    counter_record counters[MaxCounters];
+    uint64_t thread_count;
+    thread_record threads[MaxThreads];
+  };
+
+  /// Copy a string into a fixed-size field, truncating it if needed
+  static void setName(char* field, const std::string& s) {
+    size_t n = s.size() < NameSize - 1 ? s.size() : NameSize - 1;
+    memcpy(field, s.data(), n);
+    memset(field + n, 0, NameSize - n);
+  }
+
+  /// Mark the start of an update. Readers retry until endWrite is called.
+  static void beginWrite(segment* s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    // Keep the updates below from becoming visible before the odd sequence number
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  static void endWrite(segment* s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+  }
+
+  /// Copy a consistent view of the segment. Returns false if every attempt overlapped an update.
+  static bool read(const segment* s, segment& copy, size_t attempts = 1000) {
+    for(size_t i = 0; i < attempts; i++) {
+      uint64_t before = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+      if(before & 1) {
+        usleep(10);
+        continue;
+      }
+      memcpy(&copy, (const void*)s, sizeof(segment));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) == before)
+        return true;
+    }
+    return false;
+  }
+
+  /// Create the shared file and map it for writing. Returns NULL on failure.
+  static segment* create(const std::string& path, uint64_t pid) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1)
+      return NULL;
+    if(ftruncate(fd, sizeof(segment)) == -1) {
+      ::close(fd);
+      unlink(path.c_str());
+      return NULL;
+    }
+
+    void* p = mmap(NULL, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) {
+      unlink(path.c_str());
+      return NULL;
+    }
+
+    // The file starts zeroed, so the sequence number is even. The magic is written last so
+    // readers never accept a half-initialized header.
+    segment* s = (segment*)p;
+    s->version = Version;
+    s->size = sizeof(segment);
+    s->pid = pid;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(s->magic, Magic, sizeof(Magic));
+    return s;
+  }
+
+  /// Map an existing statistics file for reading. Returns NULL if it can't be mapped or
+  /// doesn't match this version of the layout.
+  static const segment* open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+      return NULL;
+
+    void* p = MAP_FAILED;
+    if(lseek(fd, 0, SEEK_END) >= (off_t)sizeof(segment))
+      p = mmap(NULL, sizeof(segment), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED)
+      return NULL;
+
+    const segment* s = (const segment*)p;
+    if(memcmp(s->magic, Magic, sizeof(Magic)) != 0 || s->version != Version || s->size != sizeof(segment)) {
+      munmap(p, sizeof(segment));
+      return NULL;
+    }
+    return s;
+  }
+
+  static void detach(const segment* s) {
+    munmap((void*)s, sizeof(segment));
+  }
+}
+
+#endif
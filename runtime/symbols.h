@@ -0,0 +1,190 @@
+#if !defined(CAUSAL_RUNTIME_SYMBOLS_H)
+#define CAUSAL_RUNTIME_SYMBOLS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "interval.h"
+#include "util.h"
+
+/// A function symbol as it appears in a symbol table. The name is borrowed from the
+/// mapped string table of the file the symbol came from.
+struct function_symbol {
+  uintptr_t base;
+  size_t size;
+  const char* name;
+  int rank;                 ///< Preference for this name among aliases (lower is better)
+  uintptr_t section_limit;  ///< End of the containing section, for sizing zero-size symbols
+  const char* source;       ///< Source file from the symbol table's STT_FILE entries, or NULL
+};
+
+/// Functions in a file, indexed by address. Symbols at the same address are merged into one
+/// function with a list of aliases, and no two functions overlap.
+class function_table {
+public:
+  struct function {
+    interval range;
+    const char* name;
+    const char* source;     ///< Source file the function was compiled from, or NULL if unknown
+    size_t first_alias;
+    size_t alias_count;
+  };
+
+private:
+  std::vector<function> _functions;
+  std::vector<const char*> _aliases;
+
+  static bool byBase(const function& a, const function& b) {
+    return a.range.getBase() < b.range.getBase();
+  }
+
+  /// The symbol table only names the source file of local symbols. Global functions are
+  /// usually laid out next to the local functions from the same object file, so a function
+  /// with no known source is given the source of the functions on both sides of it, if they
+  /// have the same one.
+  void inferSources() {
+    size_t i = 0;
+    while(i < _functions.size()) {
+      if(_functions[i].source != NULL) {
+        i++;
+        continue;
+      }
+      
+      // Find the end of this run of functions without sources
+      size_t end = i;
+      while(end < _functions.size() && _functions[end].source == NULL) end++;
+      
+      if(i > 0 && end < _functions.size() && strcmp(_functions[i - 1].source, _functions[end].source) == 0) {
+        for(size_t j = i; j < end; j++) {
+          _functions[j].source = _functions[end].source;
+        }
+      }
+      i = end;
+    }
+  }
+
+  /// Count leading underscores, so public names like malloc win over __libc_malloc
+  static size_t underscores(const char* name) {
+    size_t n = 0;
+    while(name[n] == '_') n++;
+    return n;
+  }
+
+public:
+  /// Build the table from raw symbols. The symbol list is sorted in place.
+  function_table(std::vector<function_symbol>& symbols) {
+    // Order by address. At each address, put the largest and most preferred symbol first.
+    std::sort(symbols.begin(), symbols.end(), [](const function_symbol& a, const function_symbol& b) {
+      if(a.base != b.base) return a.base < b.base;
+      if(a.size != b.size) return a.size > b.size;
+      if(a.rank != b.rank) return a.rank < b.rank;
+      return underscores(a.name) < underscores(b.name);
+    });
+
+    _functions.reserve(symbols.size());
+
+    size_t i = 0;
+    while(i < symbols.size()) {
+      const function_symbol& primary = symbols[i];
+
+      // Find the first symbol at the next address
+      size_t next = i + 1;
+      while(next < symbols.size() && symbols[next].base == primary.base) {
+        next++;
+      }
+
+      function fn;
+      fn.name = primary.name;
+      fn.source = NULL;
+      fn.first_alias = _aliases.size();
+      fn.alias_count = 0;
+
+      // Any symbol at this address that names a source file gives the function's source
+      for(size_t j = i; j < next && fn.source == NULL; j++) {
+        fn.source = symbols[j].source;
+      }
+
+      // Record the other names at this address, skipping duplicates from overlapping tables
+      for(size_t j = i + 1; j < next; j++) {
+        bool duplicate = strcmp(symbols[j].name, primary.name) == 0;
+        for(size_t k = fn.first_alias; k < _aliases.size() && !duplicate; k++) {
+          duplicate = strcmp(symbols[j].name, _aliases[k]) == 0;
+        }
+        if(!duplicate) {
+          _aliases.push_back(symbols[j].name);
+          fn.alias_count++;
+        }
+      }
+
+      // Zero-size symbols extend to the next function or the end of their section
+      uintptr_t limit = primary.base + primary.size;
+      if(primary.size == 0)
+        limit = primary.section_limit;
+
+      // Trim functions that run into the next symbol so ranges never overlap
+      if(next < symbols.size() && limit > symbols[next].base)
+        limit = symbols[next].base;
+
+      if(limit > primary.base) {
+        fn.range = interval(primary.base, limit);
+        _functions.push_back(fn);
+      }
+
+      i = next;
+    }
+
+    inferSources();
+  }
+
+  /// Check if any function overlaps a range
+  bool covers(interval r) const {
+    auto f = std::upper_bound(_functions.begin(), _functions.end(), r.getBase(),
+      [](uintptr_t p, const function& fn) { return p < fn.range.getLimit(); });
+    return f != _functions.end() && f->range.getBase() < r.getLimit();
+  }
+
+  /// Add functions that aren't covered by any symbol. The names must outlive the table's users.
+  void addUncovered(const std::vector<std::pair<interval, const char*>>& extra) {
+    for(const auto& e : extra) {
+      function fn;
+      fn.range = e.first;
+      fn.name = e.second;
+      fn.source = NULL;
+      fn.first_alias = 0;
+      fn.alias_count = 0;
+      _functions.push_back(fn);
+    }
+    std::sort(_functions.begin(), _functions.end(), byBase);
+  }
+
+  /// Set the source of every function that starts in one of the given ranges, replacing any
+  /// source from the symbol table. The sources must outlive the table's users.
+  void setSources(std::vector<std::pair<interval, const char*>>& sources) {
+    std::sort(sources.begin(), sources.end(), [](const std::pair<interval, const char*>& a,
+                                                 const std::pair<interval, const char*>& b) {
+      return a.first.getBase() < b.first.getBase();
+    });
+    for(function& fn : _functions) {
+      auto s = std::upper_bound(sources.begin(), sources.end(), fn.range.getBase(),
+        [](uintptr_t p, const std::pair<interval, const char*>& s) { return p < s.first.getLimit(); });
+      if(s != sources.end() && s->first.contains(fn.range.getBase()))
+        fn.source = s->second;
+    }
+  }
+
+  size_t size() const { return _functions.size(); }
+
+  wrapped_array<function> getFunctions() {
+    return wrap(_functions.data(), _functions.size());
+  }
+
+  wrapped_array<const char*> getAliases(const function& fn) {
+    return wrap(_aliases.data() + fn.first_alias, fn.alias_count);
+  }
+};
+
+#endif
@@ -0,0 +1,330 @@
+#if !defined(CAUSAL_RUNTIME_SYMCACHE_H)
+#define CAUSAL_RUNTIME_SYMCACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "interval.h"
+#include "log.h"
+#include "util.h"
+
+/// On-disk cache of a file's function ranges and basic blocks, keyed by GNU build-id.
+/// All addresses are unshifted (relative to the file's load offset), so a cache entry is
+/// valid no matter where the file is loaded. The file is laid out as a header followed by
+/// fixed-width function and block records, block successor lists, and a string table, and is
+/// used in place via mmap.
+namespace symcache {
+  enum {
+    Version = 5,
+    /// String offset for a missing string
+    NoString = UINT32_MAX
+  };
+
+  static const char Magic[8] = { 'C', 'Z', 'S', 'Y', 'M', 'C', 'A', 'C' };
+
+  struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t function_count;
+    uint32_t block_count;
+    uint32_t strtab_size;
+    uint32_t alias_count;
+    uint32_t successor_count;
+    uint64_t functions_offset;
+    uint64_t blocks_offset;
+    uint64_t successors_offset;
+    uint64_t aliases_offset;
+    uint64_t strtab_offset;
+  };
+
+  struct function_record {
+    uint64_t base;
+    uint64_t limit;
+    uint32_t name;        ///< Offset of the name in the string table
+    uint32_t processed;   ///< Nonzero if the function's blocks are cached
+    uint32_t first_block;
+    uint32_t block_count;
+    uint32_t first_alias;
+    uint32_t alias_count;
+    uint32_t source;      ///< Offset of the source file name, or NoString if it isn't known
+    uint32_t reserved;
+  };
+
+  struct block_record {
+    uint64_t base;
+    uint64_t limit;
+    uint32_t length;
+    uint32_t entry;
+    uint32_t first_successor;
+    uint32_t successor_count;   ///< Successors are indices into the function's blocks
+  };
+
+  /// Get the cache file path for a build-id
+  static std::string getPath(const char* dir, const std::string& build_id) {
+    return std::string(dir) + "/" + build_id + ".czs";
+  }
+
+  /// A memory-mapped cache file
+  class reader {
+  private:
+    int _fd;
+    size_t _size;
+    header* _header;
+
+    reader(int fd, size_t size, header* h) : _fd(fd), _size(size), _header(h) {}
+
+    template<typename T> T* getData(uint64_t offset) const {
+      return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(_header) + offset);
+    }
+
+  public:
+    /// Delete the copy constructor
+    reader(const reader&) = delete;
+
+    /// Clean up the memory mapped file
+    ~reader() {
+      if(munmap(_header, _size) == -1)
+        WARNING("Failed to unmap symbol cache file");
+      if(close(_fd) == -1)
+        WARNING("Failed to close symbol cache file");
+    }
+
+    wrapped_array<function_record> getFunctions() const {
+      return wrap(getData<function_record>(_header->functions_offset), _header->function_count);
+    }
+
+    wrapped_array<block_record> getBlocks(const function_record& fn) const {
+      return wrap(getData<block_record>(_header->blocks_offset) + fn.first_block, fn.block_count);
+    }
+
+    wrapped_array<uint32_t> getSuccessors(const block_record& b) const {
+      return wrap(getData<uint32_t>(_header->successors_offset) + b.first_successor, b.successor_count);
+    }
+
+    const char* getName(const function_record& fn) const {
+      return getString(fn.name);
+    }
+
+    const char* getSource(const function_record& fn) const {
+      return fn.source == NoString ? NULL : getString(fn.source);
+    }
+
+    /// Get the string table offsets of a function's aliases
+    wrapped_array<uint32_t> getAliases(const function_record& fn) const {
+      return wrap(getData<uint32_t>(_header->aliases_offset) + fn.first_alias, fn.alias_count);
+    }
+
+    const char* getString(uint32_t offset) const {
+      return getData<const char>(_header->strtab_offset) + offset;
+    }
+
+    /// Check that count records of record_size bytes starting at offset fit within size bytes
+    static bool fits(uint64_t offset, uint64_t count, size_t record_size, uint64_t size) {
+      return offset <= size && count <= (size - offset) / record_size;
+    }
+
+    /// Check that a cache file's sections fit in the file, and that every function's names
+    /// and record ranges are inside their sections, so the accessors never read past the end
+    static bool validate(const header* h, size_t size) {
+      if(memcmp(h->magic, Magic, sizeof(Magic)) != 0 || h->version != Version ||
+         !fits(h->functions_offset, h->function_count, sizeof(function_record), size) ||
+         !fits(h->blocks_offset, h->block_count, sizeof(block_record), size) ||
+         !fits(h->successors_offset, h->successor_count, sizeof(uint32_t), size) ||
+         !fits(h->aliases_offset, h->alias_count, sizeof(uint32_t), size) ||
+         !fits(h->strtab_offset, h->strtab_size, 1, size) || h->strtab_size == 0 ||
+         ((const char*)h)[h->strtab_offset + h->strtab_size - 1] != '\0')
+        return false;
+
+      const char* base = (const char*)h;
+      const function_record* functions = (const function_record*)(base + h->functions_offset);
+      const block_record* blocks = (const block_record*)(base + h->blocks_offset);
+      const uint32_t* successors = (const uint32_t*)(base + h->successors_offset);
+      const uint32_t* aliases = (const uint32_t*)(base + h->aliases_offset);
+
+      for(size_t i = 0; i < h->function_count; i++) {
+        const function_record& fn = functions[i];
+        if(fn.name >= h->strtab_size || (fn.source != NoString && fn.source >= h->strtab_size) ||
+           fn.first_block > h->block_count || fn.block_count > h->block_count - fn.first_block ||
+           fn.first_alias > h->alias_count || fn.alias_count > h->alias_count - fn.first_alias)
+          return false;
+
+        for(size_t a = fn.first_alias; a < fn.first_alias + fn.alias_count; a++) {
+          if(aliases[a] >= h->strtab_size)
+            return false;
+        }
+
+        // Successors index the function's own blocks
+        for(size_t b = fn.first_block; b < fn.first_block + fn.block_count; b++) {
+          const block_record& block = blocks[b];
+          if(block.first_successor > h->successor_count ||
+             block.successor_count > h->successor_count - block.first_successor)
+            return false;
+
+          for(size_t n = block.first_successor; n < block.first_successor + block.successor_count; n++) {
+            if(successors[n] >= fn.block_count)
+              return false;
+          }
+        }
+      }
+
+      return true;
+    }
+
+    /// Open and validate a cache file. Returns NULL if there is no usable cache entry.
+    static reader* open(const std::string& path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if(fd == -1)
+        return NULL;
+
+      struct stat sb;
+      if(fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(header)) {
+        close(fd);
+        return NULL;
+      }
+
+      header* h = (header*)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(h == MAP_FAILED) {
+        WARNING("Failed to map symbol cache file %s", path.c_str());
+        close(fd);
+        return NULL;
+      }
+
+      size_t size = sb.st_size;
+      if(!validate(h, size)) {
+        WARNING("Ignoring invalid symbol cache file %s", path.c_str());
+        munmap(h, size);
+        close(fd);
+        return NULL;
+      }
+
+      return new reader(fd, size, h);
+    }
+  };
+
+  /// Accumulates function and block records, then writes them out as a cache file
+  class writer {
+  private:
+    std::vector<function_record> _functions;
+    std::vector<block_record> _blocks;
+    std::vector<uint32_t> _successors;
+    std::vector<uint32_t> _aliases;
+    std::string _strtab;
+
+    uint32_t addString(const char* s) {
+      uint32_t offset = _strtab.size();
+      _strtab.append(s);
+      _strtab.push_back('\0');
+      return offset;
+    }
+
+    static bool writeAll(int fd, const void* data, size_t size) {
+      const char* p = (const char*)data;
+      while(size > 0) {
+        ssize_t n = write(fd, p, size);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        size -= n;
+      }
+      return true;
+    }
+
+  public:
+    /// Add a function. Blocks added afterward belong to this function.
+    void addFunction(const char* name, const std::vector<const char*>& aliases, const char* source,
+                     interval range, bool processed) {
+      function_record r;
+      r.base = range.getBase();
+      r.limit = range.getLimit();
+      r.name = addString(name);
+      r.source = source == NULL ? NoString : addString(source);
+      r.reserved = 0;
+      r.processed = processed;
+      r.first_block = _blocks.size();
+      r.block_count = 0;
+      r.first_alias = _aliases.size();
+      r.alias_count = aliases.size();
+      _functions.push_back(r);
+
+      for(const char* alias : aliases) {
+        _aliases.push_back(addString(alias));
+      }
+    }
+
+    /// Add a basic block to the most recently added function
+    void addBlock(interval range, size_t length, bool entry, const std::vector<uint32_t>& successors) {
+      block_record r;
+      r.base = range.getBase();
+      r.limit = range.getLimit();
+      r.length = length;
+      r.entry = entry;
+      r.first_successor = _successors.size();
+      r.successor_count = successors.size();
+      _blocks.push_back(r);
+      _successors.insert(_successors.end(), successors.begin(), successors.end());
+      _functions.back().block_count++;
+    }
+
+    /// Write the cache file. The file is written to a temporary path and renamed into
+    /// place so concurrent processes never see a partial file.
+    bool commit(const std::string& path) {
+      // Make sure the string table is never empty
+      if(_strtab.size() == 0)
+        _strtab.push_back('\0');
+
+      header h;
+      memcpy(h.magic, Magic, sizeof(Magic));
+      h.version = Version;
+      h.function_count = _functions.size();
+      h.block_count = _blocks.size();
+      h.strtab_size = _strtab.size();
+      h.alias_count = _aliases.size();
+      h.successor_count = _successors.size();
+      h.functions_offset = sizeof(header);
+      h.blocks_offset = h.functions_offset + _functions.size() * sizeof(function_record);
+      h.successors_offset = h.blocks_offset + _blocks.size() * sizeof(block_record);
+      h.aliases_offset = h.successors_offset + _successors.size() * sizeof(uint32_t);
+      h.strtab_offset = h.aliases_offset + _aliases.size() * sizeof(uint32_t);
+
+      char tmp_path[PATH_MAX];
+      snprintf(tmp_path, PATH_MAX, "%s.%d.tmp", path.c_str(), getpid());
+
+      int fd = ::open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd == -1) {
+        WARNING("Failed to create symbol cache file %s", tmp_path);
+        return false;
+      }
+
+      bool ok = writeAll(fd, &h, sizeof(h)) &&
+                writeAll(fd, _functions.data(), _functions.size() * sizeof(function_record)) &&
+                writeAll(fd, _blocks.data(), _blocks.size() * sizeof(block_record)) &&
+                writeAll(fd, _successors.data(), _successors.size() * sizeof(uint32_t)) &&
+                writeAll(fd, _aliases.data(), _aliases.size() * sizeof(uint32_t)) &&
+                writeAll(fd, _strtab.data(), _strtab.size());
+
+      if(close(fd) == -1)
+        ok = false;
+
+      if(!ok || rename(tmp_path, path.c_str()) == -1) {
+        WARNING("Failed to write symbol cache file %s", path.c_str());
+        unlink(tmp_path);
+        return false;
+      }
+
+      return true;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,189 @@
+#if !defined(CAUSAL_RUNTIME_TIMING_H)
+#define CAUSAL_RUNTIME_TIMING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "options.h"
+
+/// The monotonic clock used for every interval the runtime measures: sample block timestamps,
+/// experiment windows, delays, and snapshot and statistics intervals. Once calibrated, time is
+/// read from the timestamp counter and converted to nanoseconds with a rate measured against
+/// CLOCK_MONOTONIC_RAW, which takes a few nanoseconds instead of a clock_gettime call. The
+/// timestamp counter is only used if it is invariant and the kernel trusts it as its own clock
+/// source, so it runs at a constant rate and is synchronized across CPUs. Otherwise, and until
+/// calibration finishes, time comes from CLOCK_MONOTONIC_RAW. Neither clock is slewed by NTP,
+/// so neither can be used for timestamps that leave the process.
+///
+/// Calibration doesn't delay startup. initialize records the counter and the raw clock, and
+/// the profiler thread calls finishCalibration until enough time has passed to measure the rate.
+///
+/// The CAUSAL_CLOCK option can force a clock: `tsc` uses the timestamp counter whenever it is
+/// invariant, and `monotonic` always uses CLOCK_MONOTONIC_RAW.
+namespace timing {
+  enum {
+    /// The shortest time, in nanoseconds, to measure the timestamp counter's rate over
+    CalibrationTime = 5000000,
+    /// Fixed-point fraction bits in the cycles-to-nanoseconds multiplier
+    RateShift = 32
+  };
+
+  /// The conversion from timestamp counter cycles to nanoseconds, set once by finishCalibration
+  struct calibration {
+    std::atomic<bool> enabled;
+    uint64_t base_cycles;
+    uint64_t base_nanos;
+    uint64_t rate;            ///< Nanoseconds per cycle, shifted left by RateShift
+    bool pending;             ///< Has initialize started a measurement that hasn't finished?
+    uint64_t start_cycles;    ///< The counter and raw clock when the measurement started
+    uint64_t start_nanos;
+  };
+
+  /// Inline, so every file that includes this header shares the calibration
+  inline calibration& getCalibration() {
+    static calibration c;
+    return c;
+  }
+
+  /// Read CLOCK_MONOTONIC_RAW in nanoseconds
+  static inline uint64_t getRawTime() {
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) {
+      perror("getRawTime():");
+      abort();
+    }
+    return ts.tv_nsec + ts.tv_sec * 1000000000ULL;
+  }
+
+  /// Read the timestamp counter. Falls back to nanoseconds without one.
+  static inline uint64_t getCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return getRawTime();
+#endif
+  }
+
+  /// Check if the timestamp counter's calibration is in use
+  static inline bool isCalibrated() {
+    return getCalibration().enabled.load(std::memory_order_acquire);
+  }
+
+  /// Convert a number of timestamp counter cycles to nanoseconds. Only valid once calibrated.
+  static inline uint64_t toNanos(uint64_t cycles) {
+#if defined(__SIZEOF_INT128__)
+    return (uint64_t)(((unsigned __int128)cycles * getCalibration().rate) >> RateShift);
+#else
+    return (uint64_t)((long double)cycles * getCalibration().rate / (1ULL << RateShift));
+#endif
+  }
+
+  /// Get the monotonic time in nanoseconds
+  static inline uint64_t getTime() {
+    if(!isCalibrated())
+      return getRawTime();
+
+    const calibration& c = getCalibration();
+    // Counters are synchronized across CPUs, but a read can still land just before the base
+    int64_t delta = (int64_t)(getCycles() - c.base_cycles);
+    return c.base_nanos + (delta > 0 ? toNanos(delta) : 0);
+  }
+
+  /// Check if the CPU's timestamp counter runs at a constant rate in every power state
+  static bool hasInvariantTSC() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+      return false;
+    return (edx & (1 << 8)) != 0;
+#else
+    return false;
+#endif
+  }
+
+  /// Check if the kernel keeps time with the timestamp counter, which it only does when the
+  /// counter is stable and synchronized across CPUs
+  static bool isKernelClockTSC() {
+    FILE* f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if(f == NULL) return false;
+    char name[32] = { 0 };
+    bool result = fgets(name, sizeof(name), f) != NULL && strncmp(name, "tsc", 3) == 0;
+    fclose(f);
+    return result;
+  }
+
+  /// Read the timestamp counter and the raw clock at nearly the same moment. The pair with
+  /// the fewest cycles between its two counter reads is kept.
+  static void readPair(uint64_t& cycles, uint64_t& nanos) {
+    uint64_t best = UINT64_MAX;
+    for(size_t i = 0; i < 5; i++) {
+      uint64_t before = getCycles();
+      uint64_t t = getRawTime();
+      uint64_t after = getCycles();
+      if(after - before < best) {
+        best = after - before;
+        cycles = before + (after - before) / 2;
+        nanos = t;
+      }
+    }
+  }
+
+  /// Start measuring the timestamp counter's rate, if the counter can be trusted. Returns
+  /// immediately; the clock switches to the counter when finishCalibration succeeds.
+  static void initialize() {
+    const char* clock = options::getString("CAUSAL_CLOCK");
+    if(clock != NULL && strcmp(clock, "monotonic") == 0)
+      return;
+    bool forced = clock != NULL && strcmp(clock, "tsc") == 0;
+    if(!hasInvariantTSC() || (!forced && !isKernelClockTSC()))
+      return;
+
+    calibration& c = getCalibration();
+    readPair(c.start_cycles, c.start_nanos);
+    c.pending = true;
+  }
+
+  /// Check if the counter's rate is still being measured
+  static bool isCalibrating() {
+    return getCalibration().pending;
+  }
+
+  /// Finish measuring the counter's rate once CalibrationTime has passed since initialize, and
+  /// switch to the counter. Returns true when the switch happens. Only one thread may call this.
+  static bool finishCalibration() {
+    calibration& c = getCalibration();
+    if(!c.pending || getRawTime() - c.start_nanos < CalibrationTime)
+      return false;
+    c.pending = false;
+
+    uint64_t end_cycles, end_nanos;
+    readPair(end_cycles, end_nanos);
+    if(end_cycles <= c.start_cycles)
+      return false;
+    c.rate = ((end_nanos - c.start_nanos) << RateShift) / (end_cycles - c.start_cycles);
+
+    // Time taken from the raw clock just before the switch must not be later than time taken
+    // from the counter just after it. The base uses the counter read before the raw clock, so
+    // the counter's time is never behind the raw clock at the switch.
+    c.base_cycles = getCycles();
+    c.base_nanos = getRawTime();
+    c.enabled.store(true, std::memory_order_release);
+    return true;
+  }
+
+  /// Get the name of the clock in use
+  static const char* getSource() {
+    return isCalibrated() ? "tsc" : "monotonic_raw";
+  }
+}
+
+#endif
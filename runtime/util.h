@@ -1,8 +1,15 @@
 #if !defined(CAUSAL_RUNTIME_UTIL_H)
 #define CAUSAL_RUNTIME_UTIL_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include <utility>
+
+#include "timing.h"
+
 enum Time {
   Time_ns = 1,
   Time_us = 1000 * Time_ns,
@@ -10,10 +17,16 @@ enum Time {
   Time_s = 1000 * Time_ms
 };
 
+/// Get the monotonic time in nanoseconds, for measuring intervals. See timing.h.
 static size_t getTime() {
+  return timing::getTime();
+}
+
+/// Get the wall clock time in nanoseconds since the epoch, for timestamps that leave the process
+static size_t getWallTime() {
   struct timespec ts;
   if(clock_gettime(CLOCK_REALTIME, &ts)) {
-    perror("getTime():");
+    perror("getWallTime():");
     abort();
   }
   return ts.tv_nsec + ts.tv_sec * Time_s;
@@ -25,7 +38,7 @@ static size_t wait(uint64_t nanos) {
   struct timespec ts;
   ts.tv_nsec = nanos % Time_s;
   ts.tv_sec = (nanos - ts.tv_nsec) / Time_s;
-  while(clock_nanosleep(CLOCK_REALTIME, 0, &ts, &ts)) {}
+  while(clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts)) {}
   return getTime() - start_time;
 }
 
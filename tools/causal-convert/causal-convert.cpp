@@ -0,0 +1,43 @@
+/// Convert a binary profile (written with CAUSAL_OUTPUT_FORMAT=binary) to the text format,
+/// for tools that only read text profiles. Each segment becomes one run, in the same order.
+///
+/// Usage: causal-convert [input [output]]
+/// The input defaults to out.czp and the output to stdout.
+
+#include <stdio.h>
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "../profile/profile-reader.h"
+
+int main(int argc, char** argv) {
+  if(argc > 3) {
+    fprintf(stderr, "Usage: %s [input [output]]\n", argv[0]);
+    return 1;
+  }
+  
+  const char* input_name = argc > 1 ? argv[1] : "out.czp";
+  std::unique_ptr<profile::reader> input(profile::reader::open(input_name));
+  if(!input) {
+    fprintf(stderr, "Failed to open profile %s\n", input_name);
+    return 1;
+  }
+  
+  std::ofstream output_file;
+  if(argc > 2) {
+    output_file.open(argv[2]);
+    if(!output_file.is_open()) {
+      fprintf(stderr, "Failed to open %s for output\n", argv[2]);
+      return 1;
+    }
+  }
+  std::ostream& output = argc > 2 ? output_file : std::cout;
+  
+  for(const profile::segment& s : input->getSegments()) {
+    s.writeText(output);
+  }
+  
+  return 0;
+}
@@ -0,0 +1,127 @@
+/// Combine the profiles written by several processes, for example with CAUSAL_OUTPUT=out-%p.czl,
+/// into one profile. Runs are ordered by their start time. The result is a binary profile if
+/// every input is binary, and a text profile otherwise. Binary runs are converted as needed.
+///
+/// Usage: causal-merge [-o output] input...
+/// The output defaults to stdout.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../profile/profile-reader.h"
+
+using std::string;
+using std::vector;
+
+/// One run from an input profile. Exactly one of `segment` and `text` is used.
+struct run {
+  uint64_t start_time;
+  const profile::segment* segment;
+  string text;
+};
+
+/// Split a text profile into runs. Each run starts with a basename record.
+static bool readTextRuns(const char* path, vector<run>& runs) {
+  std::ifstream input(path);
+  if(!input.is_open())
+    return false;
+  
+  string line;
+  while(std::getline(input, line)) {
+    if(line.compare(0, 9, "basename\t") == 0 || runs.size() == 0)
+      runs.push_back(run{ 0, NULL, "" });
+    
+    if(line.compare(0, 11, "start time\t") == 0)
+      runs.back().start_time = strtoull(line.c_str() + 11, NULL, 10);
+    
+    runs.back().text += line;
+    runs.back().text += "\n";
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const char* output_name = NULL;
+  vector<const char*> inputs;
+  
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output_name = argv[++i];
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  
+  if(inputs.size() == 0) {
+    fprintf(stderr, "Usage: %s [-o output] input...\n", argv[0]);
+    return 1;
+  }
+  
+  // Binary profiles are mapped, so keep them open until the output is written
+  vector<std::unique_ptr<profile::reader>> binaries;
+  vector<run> runs;
+  bool all_binary = true;
+  
+  for(const char* path : inputs) {
+    if(profile::reader::isProfile(path)) {
+      profile::reader* r = profile::reader::open(path);
+      if(r == NULL) {
+        fprintf(stderr, "Failed to open profile %s\n", path);
+        return 1;
+      }
+      binaries.emplace_back(r);
+      for(const profile::segment& s : r->getSegments()) {
+        const profile::run_record* info = s.getRun();
+        runs.push_back(run{ info == NULL ? 0 : info->start_time, &s, "" });
+      }
+    } else {
+      all_binary = false;
+      if(!readTextRuns(path, runs)) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 1;
+      }
+    }
+  }
+  
+  // Runs without a start time keep their order at the front
+  std::stable_sort(runs.begin(), runs.end(), [](const run& a, const run& b) {
+    return a.start_time < b.start_time;
+  });
+  
+  std::ofstream output_file;
+  if(output_name != NULL) {
+    output_file.open(output_name, std::ofstream::out | std::ofstream::binary);
+    if(!output_file.is_open()) {
+      fprintf(stderr, "Failed to open %s for output\n", output_name);
+      return 1;
+    }
+  }
+  std::ostream& output = output_name != NULL ? output_file : std::cout;
+  
+  for(const run& r : runs) {
+    if(r.segment == NULL) {
+      output << r.text;
+    } else if(all_binary) {
+      output.write((const char*)r.segment->getData(), r.segment->getSize());
+    } else {
+      r.segment->writeText(output);
+    }
+  }
+  
+  output.flush();
+  if(!output) {
+    fprintf(stderr, "Failed to write merged profile\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,1088 @@
+/// Summarize text or binary profiles. Reports the hottest functions, basic blocks, and loops
+/// with confidence intervals for their share of samples, estimates how many times each block
+/// ran, and ranks speedup experiment targets by their effect on progress.
+///
+/// Text profiles are mapped into memory and split at line boundaries, and the pieces are
+/// parsed in parallel without copying. Binary profiles are parsed one segment per task.
+///
+/// Every run in each input is included, so profiles from many processes and hosts can be
+/// combined into one ranking. Addresses are translated to offsets in their file using each
+/// run's mappings, and files are matched by build-id, so the same code lines up across runs
+/// no matter where it was loaded. With more than one run, confidence intervals come from the
+/// variation between runs rather than from sampling error within a single run.
+///
+/// Usage: causal-report [-n count] [-j threads] [input...]
+/// The input defaults to out.czl, or out.czp if there is no text profile. `-n` limits each
+/// table to its top `count` rows (default 20) and `-j` sets the number of parser threads
+/// (default: one per core).
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../profile/profile-reader.h"
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+enum {
+  DefaultRows = 20,
+  /// Text profiles smaller than this are parsed by a single task
+  MinChunkSize = 1024 * 1024,
+  /// Blocks are split into this many groups by hash, and each group is merged by one task
+  BlockShards = 64
+};
+
+/// z-score for a two-sided 95% confidence interval
+static const double Z95 = 1.959964;
+
+/// A string in a mapped input. Inputs stay mapped until the report is written.
+struct slice {
+  const char* data;
+  size_t size;
+
+  slice() : data(""), size(0) {}
+  slice(const char* d, size_t s) : data(d), size(s) {}
+  explicit slice(const char* s) : data(s), size(strlen(s)) {}
+
+  bool operator==(const slice& other) const {
+    return size == other.size && memcmp(data, other.data, size) == 0;
+  }
+
+  string str() const { return string(data, size); }
+
+  /// Get the last component of a path
+  slice filename() const {
+    const char* p = data + size;
+    while(p > data && p[-1] != '/') p--;
+    return slice(p, data + size - p);
+  }
+};
+
+/// FNV-1a, folded into a running hash
+static size_t hashBytes(size_t h, const void* data, size_t size) {
+  const uint8_t* p = (const uint8_t*)data;
+  for(size_t i = 0; i < size; i++) {
+    h = (h ^ p[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/// A block, loop, or experiment target: a range of code in a function
+struct location {
+  slice file;
+  slice module;       ///< Identifies the file across runs: its build-id if known, or its path
+  slice function;
+  uint64_t base;
+  uint64_t limit;
+
+  location() : base(0), limit(0) {}
+  location(slice f, slice fn, uint64_t b, uint64_t l) : file(f), module(f), function(fn), base(b), limit(l) {}
+
+  bool operator==(const location& other) const {
+    return base == other.base && limit == other.limit &&
+      function == other.function && module == other.module;
+  }
+};
+
+struct location_hash {
+  size_t operator()(const location& l) const {
+    size_t h = 14695981039346656037ULL;
+    h = hashBytes(h, l.module.data, l.module.size);
+    h = hashBytes(h, l.function.data, l.function.size);
+    h = hashBytes(h, &l.base, sizeof(l.base));
+    return hashBytes(h, &l.limit, sizeof(l.limit));
+  }
+};
+
+/// Open addressing hash table from locations to totals. Entries are kept in a vector in the
+/// order they were added, and the table only holds their hashes and indices, so a probe
+/// touches one small slot before comparing any strings.
+template<typename T> class location_table {
+private:
+  struct slot {
+    size_t hash;
+    size_t index;             ///< Index of the entry plus one, or zero for an empty slot
+  };
+
+  vector<slot> _slots;
+  vector<std::pair<location, T>> _entries;
+
+  void grow() {
+    vector<slot> slots(std::max((size_t)1024, _slots.size() * 2), slot{ 0, 0 });
+    size_t mask = slots.size() - 1;
+    for(const slot& s : _slots) {
+      if(s.index == 0) continue;
+      size_t i = s.hash & mask;
+      while(slots[i].index != 0) i = (i + 1) & mask;
+      slots[i] = s;
+    }
+    _slots.swap(slots);
+  }
+
+public:
+  /// Get the totals for a location, adding them if they aren't in the table
+  T& get(const location& l, size_t hash) {
+    if(_entries.size() * 2 >= _slots.size())
+      grow();
+
+    size_t mask = _slots.size() - 1;
+    size_t i = hash & mask;
+    while(_slots[i].index != 0) {
+      const slot& s = _slots[i];
+      if(s.hash == hash && _entries[s.index - 1].first == l)
+        return _entries[s.index - 1].second;
+      i = (i + 1) & mask;
+    }
+
+    _entries.emplace_back(l, T());
+    _slots[i] = slot{ hash, _entries.size() };
+    return _entries.back().second;
+  }
+
+  vector<std::pair<location, T>>& getEntries() { return _entries; }
+};
+
+/// A file loaded in a profiled process
+struct mapping_info {
+  uint64_t base;
+  uint64_t limit;
+  uint64_t load_offset;
+  slice module;
+};
+
+/// Counts for a block or function in one run
+struct block_sample {
+  location where;
+  size_t hash;
+  uint64_t length;          ///< Zero for functions
+  uint64_t cycle_samples;
+  uint64_t inst_samples;
+};
+
+/// Counts for a loop in one run
+struct loop_sample {
+  location where;
+  uint64_t depth;
+  uint64_t block_count;
+  uint64_t cycle_samples;
+  uint64_t inst_samples;
+};
+
+struct experiment {
+  slice kind;
+  location target;
+  size_t run;
+  uint64_t range_count;
+  uint64_t duration;
+  uint64_t delay_size;
+  uint64_t delays;
+  uint64_t progress;                ///< Visits to all progress counters
+};
+
+/// Time the runtime spent on one kind of work in one run
+struct overhead_sample {
+  slice category;
+  uint64_t count;
+  uint64_t nanos;
+};
+
+/// Records parsed from a contiguous piece of one run. A text chunk that starts in the middle
+/// of a run produces a part that continues the previous run. Each run lists a block once, so
+/// parts keep raw records and all aggregation happens in the merge.
+struct part {
+  bool starts_run = false;
+  slice basename;
+  uint64_t cycle_period = 0;        ///< Zero if this part doesn't set the period
+  uint64_t inst_period = 0;
+  uint64_t start_time = 0;          ///< Zero if this part doesn't describe the process
+  uint64_t end_time = 0;
+  uint64_t threads = 0;
+  size_t run = 0;                   ///< Index of the run this part belongs to, set after parsing
+  uint64_t cycle_samples = 0;
+  vector<mapping_info> mappings;
+  vector<block_sample> blocks;      ///< Blocks at their loaded addresses
+  vector<loop_sample> loops;
+  vector<experiment> experiments;
+  vector<overhead_sample> overhead;
+
+  /// Blocks and functions at their offsets in each file, grouped by hash for the parallel merge
+  vector<block_sample> block_shards[BlockShards];
+  vector<block_sample> function_shards[BlockShards];
+
+  void addBlock(const location& l, uint64_t length, uint64_t cycle_samples, uint64_t inst_samples) {
+    blocks.push_back(block_sample{ l, 0, length, cycle_samples, inst_samples });
+    this->cycle_samples += cycle_samples;
+  }
+
+  bool empty() const {
+    return mappings.size() == 0 && blocks.size() == 0 && loops.size() == 0 && experiments.size() == 0 &&
+           overhead.size() == 0 && threads == 0;
+  }
+};
+
+struct run_info {
+  slice basename;
+  uint64_t cycle_period = 0;
+  uint64_t inst_period = 0;
+  uint64_t cycle_samples = 0;
+  uint64_t thread_time = 0;         ///< Nanoseconds the run's threads were sampled, if known
+  vector<mapping_info> mappings;    ///< Sorted by base address
+};
+
+/// Samples for a function, block, or loop, summed over runs. Each run's counts are also
+/// squared and summed so the variance between runs can be estimated. A block is normally
+/// listed once per run, but counts for the same run are combined first in case it is
+/// listed again, for example when a file is loaded twice.
+struct totals {
+  uint64_t length = 0;              ///< Instructions in a block
+  uint64_t depth = 0;               ///< Nesting depth of a loop
+  uint64_t block_count = 0;         ///< Blocks in a loop
+  uint64_t cycle_samples = 0;
+  uint64_t inst_samples = 0;
+  double executions = 0;            ///< Estimated number of times a block ran
+  double executions_variance = 0;   ///< Variance of `executions` from sampling error alone
+  double cycle_squares = 0;         ///< Sum over runs of cycle samples squared
+  double cycle_products = 0;        ///< Sum over runs of cycle samples times the run's total
+  double execution_squares = 0;     ///< Sum over runs of estimated executions squared
+
+  size_t run = SIZE_MAX;            ///< The run whose counts are still being added up
+  uint64_t run_cycles = 0;
+  double run_executions = 0;
+
+  void add(const vector<run_info>& runs, size_t r, uint64_t length, uint64_t cycles, uint64_t insts) {
+    if(r != run) {
+      finish(runs);
+      run = r;
+    }
+    cycle_samples += cycles;
+    inst_samples += insts;
+    run_cycles += cycles;
+    if(length > 0) {
+      // Instruction samples are Poisson distributed, so each has variance one
+      double scale = (double)runs[r].inst_period / length;
+      executions += scale * insts;
+      executions_variance += scale * scale * insts;
+      run_executions += scale * insts;
+    }
+  }
+
+  /// Fold the last run's counts into the sums of squares
+  void finish(const vector<run_info>& runs) {
+    if(run == SIZE_MAX)
+      return;
+    cycle_squares += (double)run_cycles * run_cycles;
+    cycle_products += (double)run_cycles * runs[run].cycle_samples;
+    execution_squares += run_executions * run_executions;
+    run = SIZE_MAX;
+    run_cycles = 0;
+    run_executions = 0;
+  }
+};
+
+/// Totals over all runs, for computing shares and their intervals
+struct profile_totals {
+  size_t runs = 0;
+  uint64_t cycle_samples = 0;
+  double cycle_squares = 0;         ///< Sum over runs of each run's total squared
+};
+
+/// Find the mapping that contains an address, or NULL if there isn't one
+static const mapping_info* findMapping(const vector<mapping_info>& mappings, uint64_t address) {
+  auto i = std::upper_bound(mappings.begin(), mappings.end(), address,
+                            [](uint64_t a, const mapping_info& m) { return a < m.base; });
+  if(i == mappings.begin() || address >= (i - 1)->limit)
+    return NULL;
+  return &*(i - 1);
+}
+
+/// Translate a location's addresses to offsets in its file, and identify the file by its
+/// build-id. Locations outside every mapping keep their loaded addresses.
+static void relocate(location& l, const vector<mapping_info>& mappings) {
+  const mapping_info* m = findMapping(mappings, l.base);
+  if(m == NULL)
+    return;
+  l.module = m->module;
+  l.base -= m->load_offset;
+  l.limit -= m->load_offset;
+}
+
+/// Relocate a part's records and group its blocks and functions by hash
+static void distribute(part& p, const vector<run_info>& runs) {
+  const vector<mapping_info>& mappings = runs[p.run].mappings;
+  location_hash hasher;
+  // Functions have many blocks, so add up each function's samples in the part first
+  location_table<std::pair<uint64_t, uint64_t>> functions;
+
+  for(block_sample& b : p.blocks) {
+    relocate(b.where, mappings);
+    size_t hash = hasher(b.where);
+    p.block_shards[hash % BlockShards].push_back(block_sample{ b.where, hash / BlockShards, b.length,
+                                                               b.cycle_samples, b.inst_samples });
+
+    location f = b.where;
+    f.base = f.limit = 0;
+    std::pair<uint64_t, uint64_t>& counts = functions.get(f, hasher(f));
+    counts.first += b.cycle_samples;
+    counts.second += b.inst_samples;
+  }
+  vector<block_sample>().swap(p.blocks);
+
+  for(const auto& f : functions.getEntries()) {
+    size_t hash = hasher(f.first);
+    p.function_shards[hash % BlockShards].push_back(block_sample{ f.first, hash / BlockShards, 0,
+                                                                  f.second.first, f.second.second });
+  }
+
+  for(loop_sample& l : p.loops) {
+    relocate(l.where, mappings);
+  }
+  for(experiment& e : p.experiments) {
+    relocate(e.target, mappings);
+    e.run = p.run;
+  }
+}
+
+/// A read-only mapping of a whole text profile
+class mapped_file {
+private:
+  int _fd;
+  size_t _size;
+  const char* _data;
+
+  mapped_file(int fd, size_t size, const char* data) : _fd(fd), _size(size), _data(data) {}
+
+public:
+  mapped_file(const mapped_file&) = delete;
+
+  ~mapped_file() {
+    if(_size > 0) munmap(const_cast<char*>(_data), _size);
+    close(_fd);
+  }
+
+  const char* getData() const { return _data; }
+  size_t getSize() const { return _size; }
+
+  /// Map a file. Returns NULL if it can't be opened or mapped.
+  static mapped_file* open(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    if(fd == -1)
+      return NULL;
+
+    struct stat sb;
+    if(fstat(fd, &sb) == -1) {
+      close(fd);
+      return NULL;
+    }
+
+    if(sb.st_size == 0)
+      return new mapped_file(fd, 0, "");
+
+    void* data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+      close(fd);
+      return NULL;
+    }
+    madvise(data, sb.st_size, MADV_WILLNEED);
+    return new mapped_file(fd, sb.st_size, (const char*)data);
+  }
+};
+
+/// Tab-separated fields of one line
+class fields {
+private:
+  const char* _p;
+  const char* _end;
+
+public:
+  fields(const char* p, const char* end) : _p(p), _end(end) {}
+
+  bool done() const { return _p >= _end; }
+
+  slice next() {
+    const char* start = _p;
+    const char* tab = (const char*)memchr(_p, '\t', _end - _p);
+    if(tab == NULL) {
+      _p = _end;
+      return slice(start, _end - start);
+    }
+    _p = tab + 1;
+    return slice(start, tab - start);
+  }
+
+  /// Parse the next field as a decimal number, or a hexadecimal number with a 0x prefix
+  uint64_t nextNumber() {
+    slice s = next();
+    const char* p = s.data;
+    const char* end = s.data + s.size;
+    uint64_t n = 0;
+    if(s.size > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+      for(p += 2; p < end; p++) {
+        char c = *p;
+        if(c >= '0' && c <= '9') n = n * 16 + (c - '0');
+        else if(c >= 'a' && c <= 'f') n = n * 16 + (c - 'a' + 10);
+        else if(c >= 'A' && c <= 'F') n = n * 16 + (c - 'A' + 10);
+        else break;
+      }
+    } else {
+      for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (*p - '0');
+      }
+    }
+    return n;
+  }
+};
+
+/// Check if a line starts with a record name followed by a tab, and skip past it
+static bool startsRecord(const char*& p, const char* end, const char* name, size_t length) {
+  if((size_t)(end - p) <= length || p[length] != '\t' || memcmp(p, name, length) != 0)
+    return false;
+  p += length + 1;
+  return true;
+}
+
+#define RECORD(p, end, name) startsRecord(p, end, name, sizeof(name) - 1)
+
+/// Parse the lines in [begin, end), which must start at the beginning of a line
+static void parseText(const char* begin, const char* end, vector<part>& parts) {
+  parts.emplace_back();
+  part* current = &parts.back();
+
+  const char* line = begin;
+  while(line < end) {
+    const char* eol = (const char*)memchr(line, '\n', end - line);
+    if(eol == NULL) eol = end;
+    const char* p = line;
+    line = eol + 1;
+
+    // Dispatch on the first character so most lines are rejected with one comparison
+    switch(*p) {
+    case 'b':
+      if(RECORD(p, eol, "blockstats")) {
+        fields f(p, eol);
+        slice file = f.next();
+        slice function = f.next();
+        uint64_t base = f.nextNumber();
+        location l(file, function, base, f.nextNumber());
+        uint64_t length = f.nextNumber();
+        uint64_t cycle_samples = f.nextNumber();
+        current->addBlock(l, length, cycle_samples, f.nextNumber());
+      } else if(RECORD(p, eol, "basename")) {
+        // Keep the first part if nothing has been parsed into it yet
+        if(current->starts_run || current->cycle_period != 0 || current->inst_period != 0 ||
+           !current->empty()) {
+          parts.emplace_back();
+          current = &parts.back();
+        }
+        current->starts_run = true;
+        current->basename = slice(p, eol - p);
+      }
+      break;
+
+    case 'l':
+      if(RECORD(p, eol, "loopstats")) {
+        fields f(p, eol);
+        loop_sample l;
+        slice file = f.next();
+        slice function = f.next();
+        uint64_t base = f.nextNumber();
+        l.where = location(file, function, base, f.nextNumber());
+        l.depth = f.nextNumber();
+        l.block_count = f.nextNumber();
+        l.cycle_samples = f.nextNumber();
+        l.inst_samples = f.nextNumber();
+        current->loops.push_back(l);
+      }
+      break;
+
+    case 'e':
+      if(RECORD(p, eol, "experiment")) {
+        fields f(p, eol);
+        experiment e;
+        e.kind = f.next();
+        slice file = f.next();
+        slice function = f.next();
+        uint64_t base = f.nextNumber();
+        e.target = location(file, function, base, f.nextNumber());
+        e.range_count = f.nextNumber();
+        e.duration = f.nextNumber();
+        e.delay_size = f.nextNumber();
+        e.delays = f.nextNumber();
+        e.progress = 0;
+        while(!f.done()) {
+          e.progress += f.nextNumber();
+        }
+        current->experiments.push_back(e);
+      } else if(RECORD(p, eol, "end time")) {
+        current->end_time = fields(p, eol).nextNumber();
+      }
+      break;
+
+    case 'o':
+      if(RECORD(p, eol, "overhead")) {
+        fields f(p, eol);
+        overhead_sample o;
+        o.category = f.next();
+        o.count = f.nextNumber();
+        o.nanos = f.nextNumber();
+        current->overhead.push_back(o);
+      }
+      break;
+
+    case 's':
+      if(RECORD(p, eol, "start time"))
+        current->start_time = fields(p, eol).nextNumber();
+      break;
+
+    case 't':
+      if(RECORD(p, eol, "threads"))
+        current->threads = fields(p, eol).nextNumber();
+      break;
+
+    case 'm':
+      if(RECORD(p, eol, "mapping")) {
+        fields f(p, eol);
+        mapping_info m;
+        slice name = f.next();
+        m.base = f.nextNumber();
+        m.limit = f.nextNumber();
+        m.load_offset = f.nextNumber();
+        slice build_id = f.next();
+        m.module = (build_id.size == 0 || build_id == slice("-")) ? name : build_id;
+        current->mappings.push_back(m);
+      }
+      break;
+
+    case 'c':
+      if(RECORD(p, eol, "cycle period"))
+        current->cycle_period = fields(p, eol).nextNumber();
+      break;
+
+    case 'i':
+      if(RECORD(p, eol, "instruction period"))
+        current->inst_period = fields(p, eol).nextNumber();
+      break;
+    }
+  }
+}
+
+/// Read the records from one binary profile segment
+static void parseSegment(const profile::segment& s, vector<part>& parts) {
+  parts.emplace_back();
+  part& current = parts.back();
+  current.starts_run = true;
+  current.basename = slice(s.getBasename());
+  current.cycle_period = s.getCyclePeriod();
+  current.inst_period = s.getInstructionPeriod();
+
+  const profile::run_record* run = s.getRun();
+  if(run != NULL) {
+    current.start_time = run->start_time;
+    current.end_time = run->end_time;
+    current.threads = run->threads;
+  }
+
+  for(const profile::mapping_record& r : s.getMappings()) {
+    const char* build_id = s.getString(r.build_id);
+    slice module(build_id[0] == '\0' ? s.getString(r.name) : build_id);
+    current.mappings.push_back(mapping_info{ r.base, r.limit, r.load_offset, module });
+  }
+
+  for(const profile::block_record& r : s.getBlocks()) {
+    location l(slice(s.getString(r.file)), slice(s.getString(r.function)), r.base, r.limit);
+    current.addBlock(l, r.length, r.cycle_samples, r.inst_samples);
+  }
+
+  for(const profile::loop_record& r : s.getLoops()) {
+    location l(slice(s.getString(r.file)), slice(s.getString(r.function)), r.base, r.limit);
+    current.loops.push_back(loop_sample{ l, r.depth, r.block_count, r.cycle_samples, r.inst_samples });
+  }
+
+  for(const profile::experiment_record& r : s.getExperiments()) {
+    experiment e;
+    e.kind = slice(s.getString(r.kind));
+    e.target = location(slice(s.getString(r.file)), slice(s.getString(r.function)), r.base, r.limit);
+    e.range_count = r.range_count;
+    e.duration = r.duration;
+    e.delay_size = r.delay_size;
+    e.delays = r.delays;
+    e.progress = 0;
+    for(uint64_t p : s.getProgress(r)) {
+      e.progress += p;
+    }
+    current.experiments.push_back(e);
+  }
+
+  for(const profile::overhead_record& r : s.getOverhead()) {
+    current.overhead.push_back(overhead_sample{ slice(s.getString(r.category)), r.count, r.nanos });
+  }
+}
+
+/// A piece of an input to parse. Exactly one of `segment` and `begin` is used.
+struct task {
+  const profile::segment* segment;
+  const char* begin;
+  const char* end;
+  vector<part> parts;
+};
+
+/// Split a text profile into tasks of roughly equal size, ending each at a line boundary
+static void addTextTasks(const mapped_file& f, size_t threads, vector<task>& tasks) {
+  const char* data = f.getData();
+  size_t size = f.getSize();
+  size_t chunks = std::max((size_t)1, std::min(threads * 4, size / MinChunkSize));
+
+  const char* begin = data;
+  for(size_t i = 1; i <= chunks && begin < data + size; i++) {
+    const char* end = data + size * i / chunks;
+    if(end < begin) end = begin;
+    if(i < chunks) {
+      const char* eol = (const char*)memchr(end, '\n', data + size - end);
+      end = eol == NULL ? data + size : eol + 1;
+    }
+    tasks.push_back(task{ NULL, begin, end, vector<part>() });
+    begin = end;
+  }
+}
+
+/// Wilson score interval for a proportion of k successes in n trials
+static void proportionInterval(uint64_t k, uint64_t n, double& low, double& high) {
+  if(n == 0) {
+    low = high = 0;
+    return;
+  }
+  double p = (double)k / n;
+  double z2 = Z95 * Z95;
+  double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+  double spread = Z95 * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) / (1 + z2 / n);
+  low = std::max(0.0, center - spread);
+  high = std::min(1.0, center + spread);
+}
+
+/// Two-sided 95% critical value of Student's t distribution
+static double tCritical(size_t df) {
+  static const double table[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+  if(df == 0) return INFINITY;
+  if(df <= sizeof(table) / sizeof(table[0])) return table[df - 1];
+  return Z95;
+}
+
+static string describe(const location& l) {
+  char range[64];
+  snprintf(range, sizeof(range), "0x%lx-0x%lx", l.base, l.limit);
+  return l.function.str() + " (" + l.file.filename().str() + ") " + range;
+}
+
+/// Confidence interval for a share of all cycle samples. A single run only has sampling
+/// error. With several runs, each run is a cluster of samples, and the variance of the ratio
+/// estimate comes from how far each run's count is from its expected share of the run.
+static void shareInterval(const totals& t, const profile_totals& all, double& low, double& high) {
+  if(all.runs < 2 || all.cycle_samples == 0) {
+    proportionInterval(t.cycle_samples, all.cycle_samples, low, high);
+    return;
+  }
+  double r = all.runs;
+  double p = (double)t.cycle_samples / all.cycle_samples;
+  double mean_total = all.cycle_samples / r;
+  double ss = t.cycle_squares - 2 * p * t.cycle_products + p * p * all.cycle_squares;
+  double margin = tCritical(all.runs - 1) * sqrt(std::max(0.0, ss) / (r * (r - 1))) / mean_total;
+  low = std::max(0.0, p - margin);
+  high = std::min(1.0, p + margin);
+}
+
+/// Margin of error for the estimated executions of a block, summed over all runs
+static double executionsMargin(const totals& t, const profile_totals& all) {
+  if(all.runs < 2)
+    return Z95 * sqrt(t.executions_variance);
+  double r = all.runs;
+  double variance = std::max(0.0, (t.execution_squares - t.executions * t.executions / r) / (r - 1));
+  return tCritical(all.runs - 1) * sqrt(r * variance);
+}
+
+/// Print a sample count and its share of the total, with a confidence interval for the share
+static void printShare(const totals& t, const profile_totals& all) {
+  double low, high;
+  shareInterval(t, all, low, high);
+  printf("  %6.2f%% [%6.2f%%, %6.2f%%] %10lu",
+         all.cycle_samples == 0 ? 0.0 : 100.0 * t.cycle_samples / all.cycle_samples,
+         100 * low, 100 * high, t.cycle_samples);
+}
+
+/// Get the indices of the `count` largest entries by `key`
+template<typename T, typename K> static vector<size_t> top(const vector<T>& v, size_t count, K key) {
+  vector<size_t> order(v.size());
+  for(size_t i = 0; i < v.size(); i++) order[i] = i;
+  count = std::min(count, v.size());
+  std::partial_sort(order.begin(), order.begin() + count, order.end(), [&](size_t a, size_t b) {
+    return key(v[a]) > key(v[b]);
+  });
+  order.resize(count);
+  return order;
+}
+
+/// Run `count` tasks on a pool of threads, including the calling thread
+template<typename F> static void forEach(size_t count, size_t threads, F fn) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for(size_t i = next++; i < count; i = next++) {
+      fn(i);
+    }
+  };
+
+  vector<std::thread> pool;
+  for(size_t i = 1; i < std::min(threads, count); i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for(std::thread& t : pool) {
+    t.join();
+  }
+}
+
+struct target_stats {
+  location target;
+  slice kind;
+  double speedup = 0;               ///< Sum of each experiment's virtual speedup
+  vector<double> changes;           ///< Relative change in progress rate in each experiment
+
+  double mean() const {
+    double sum = 0;
+    for(double c : changes) sum += c;
+    return sum / changes.size();
+  }
+};
+
+/// Rank experiment targets by the change in progress rate while they were sped up. Delays
+/// pause the rest of the program, so progress is measured over the experiment's time minus the
+/// delays inserted. A target's virtual speedup is the fraction of the experiment it was
+/// sped up by. Each experiment is compared to the rate across all experiments in its run,
+/// so runs on faster or slower hosts can be combined. The interval treats experiments as
+/// independent.
+static void reportExperiments(const vector<const experiment*>& experiments, size_t run_count, size_t rows) {
+  vector<double> run_progress(run_count, 0);
+  vector<double> run_time(run_count, 0);
+  size_t skipped = 0;
+  double total_progress = 0;
+
+  auto usable = [](const experiment* e) {
+    return e->duration > 0 && (double)e->delays * e->delay_size < e->duration;
+  };
+
+  for(const experiment* e : experiments) {
+    if(!usable(e)) {
+      skipped++;
+      continue;
+    }
+    run_progress[e->run] += e->progress;
+    run_time[e->run] += e->duration - (double)e->delays * e->delay_size;
+    total_progress += e->progress;
+  }
+
+  printf("\nSpeedup experiments: %lu", experiments.size());
+  if(skipped > 0)
+    printf(" (%lu with more delay than duration skipped)", skipped);
+  printf("\n");
+
+  if(total_progress == 0) {
+    printf("  No progress points were visited during experiments\n");
+    return;
+  }
+
+  unordered_map<location, size_t, location_hash> index;
+  vector<target_stats> targets;
+  for(const experiment* e : experiments) {
+    // Runs without progress have no baseline to compare against
+    if(!usable(e) || run_progress[e->run] == 0)
+      continue;
+
+    double delayed = (double)e->delays * e->delay_size;
+    double baseline = run_progress[e->run] / run_time[e->run];
+
+    auto i = index.find(e->target);
+    if(i == index.end()) {
+      i = index.emplace(e->target, targets.size()).first;
+      targets.emplace_back();
+      targets.back().target = e->target;
+      targets.back().kind = e->kind;
+    }
+    target_stats& t = targets[i->second];
+    t.speedup += delayed / e->duration;
+    t.changes.push_back(e->progress / (e->duration - delayed) / baseline - 1);
+  }
+
+  printf("\nExperiment targets by change in progress rate (95%% confidence intervals)\n");
+  printf("  %8s %20s %6s %9s  %s\n", "change", "interval", "count", "speedup", "target");
+  for(size_t i : top(targets, rows, [](const target_stats& t) { return t.mean(); })) {
+    const target_stats& t = targets[i];
+    double mean = t.mean();
+    printf("  %+7.2f%% ", 100 * mean);
+
+    if(t.changes.size() > 1) {
+      double ss = 0;
+      for(double c : t.changes) ss += (c - mean) * (c - mean);
+      double n = t.changes.size();
+      double margin = tCritical(t.changes.size() - 1) * sqrt(ss / (n - 1) / n);
+      printf("[%+7.2f%%, %+7.2f%%]", 100 * (mean - margin), 100 * (mean + margin));
+    } else {
+      printf("%20s", "-");
+    }
+
+    printf(" %6lu %8.2f%%  %s %s\n", t.changes.size(), 100 * t.speedup / t.changes.size(),
+           t.kind.str().c_str(), describe(t.target).c_str());
+  }
+}
+
+/// Total the runtime's measured cost in each category over all runs. Each category's share is
+/// its time over the length of each run times the number of threads it sampled, an upper bound
+/// on the time profiled threads were running, so shares are lower bounds. Runs without start
+/// and end times or a thread count add nothing to the denominator.
+static void reportOverhead(const vector<part*>& parts, const vector<run_info>& runs) {
+  vector<overhead_sample> categories;
+  for(const part* p : parts) {
+    for(const overhead_sample& o : p->overhead) {
+      size_t i = 0;
+      while(i < categories.size() && !(categories[i].category == o.category)) i++;
+      if(i == categories.size()) categories.push_back(overhead_sample{ o.category, 0, 0 });
+      categories[i].count += o.count;
+      categories[i].nanos += o.nanos;
+    }
+  }
+
+  if(categories.size() == 0)
+    return;
+
+  uint64_t thread_time = 0;
+  for(const run_info& r : runs) {
+    thread_time += r.thread_time;
+  }
+
+  printf("\nProfiler overhead\n");
+  printf("  %-10s %12s %12s %12s %9s\n", "category", "events", "time (ms)", "ns/event", "share");
+  for(const overhead_sample& o : categories) {
+    printf("  %-10s %12lu %12.1f %12.0f", o.category.str().c_str(), o.count, (double)o.nanos / 1e6,
+           o.count == 0 ? 0.0 : (double)o.nanos / o.count);
+    if(thread_time > 0) printf(" %8.3f%%\n", 100.0 * o.nanos / thread_time);
+    else printf(" %9s\n", "-");
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t rows = DefaultRows;
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  vector<const char*> inputs;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      rows = strtoul(argv[++i], NULL, 10);
+    } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = std::max(1ul, strtoul(argv[++i], NULL, 10));
+    } else if(argv[i][0] == '-') {
+      fprintf(stderr, "Usage: %s [-n count] [-j threads] [input...]\n", argv[0]);
+      return 1;
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+
+  if(inputs.size() == 0)
+    inputs.push_back(access("out.czl", F_OK) == 0 || access("out.czp", F_OK) != 0 ? "out.czl" : "out.czp");
+
+  // Map every input and split it into tasks. Mappings are kept until the report is written.
+  vector<std::unique_ptr<profile::reader>> binaries;
+  vector<std::unique_ptr<mapped_file>> texts;
+  vector<task> tasks;
+
+  for(const char* path : inputs) {
+    if(profile::reader::isProfile(path)) {
+      profile::reader* r = profile::reader::open(path);
+      if(r == NULL) {
+        fprintf(stderr, "Failed to open profile %s\n", path);
+        return 1;
+      }
+      binaries.emplace_back(r);
+      for(const profile::segment& s : r->getSegments()) {
+        tasks.push_back(task{ &s, NULL, NULL, vector<part>() });
+      }
+    } else {
+      mapped_file* f = mapped_file::open(path);
+      if(f == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 1;
+      }
+      texts.emplace_back(f);
+      addTextTasks(*f, threads, tasks);
+    }
+  }
+
+  // Parse all tasks in parallel
+  forEach(tasks.size(), threads, [&](size_t i) {
+    task& t = tasks[i];
+    if(t.segment != NULL) parseSegment(*t.segment, t.parts);
+    else parseText(t.begin, t.end, t.parts);
+  });
+
+  // Assign parts to runs in input order. Periods and mappings may come from any part of a run.
+  vector<run_info> runs;
+  vector<part*> parts;
+  for(task& t : tasks) {
+    for(part& p : t.parts) {
+      if(p.starts_run || runs.size() == 0) {
+        runs.emplace_back();
+        runs.back().basename = p.basename;
+      }
+      run_info& r = runs.back();
+      p.run = runs.size() - 1;
+      if(p.cycle_period != 0) r.cycle_period = p.cycle_period;
+      if(p.inst_period != 0) r.inst_period = p.inst_period;
+      r.cycle_samples += p.cycle_samples;
+      if(p.threads != 0 && p.end_time > p.start_time)
+        r.thread_time = (p.end_time - p.start_time) * p.threads;
+      r.mappings.insert(r.mappings.end(), p.mappings.begin(), p.mappings.end());
+      parts.push_back(&p);
+    }
+  }
+
+  profile_totals all;
+  all.runs = runs.size();
+  size_t unmapped_runs = 0;
+  for(run_info& r : runs) {
+    // Files loaded at exit come first, so they win over overlapping files unloaded earlier
+    std::stable_sort(r.mappings.begin(), r.mappings.end(), [](const mapping_info& a, const mapping_info& b) {
+      return a.base < b.base;
+    });
+    all.cycle_samples += r.cycle_samples;
+    all.cycle_squares += (double)r.cycle_samples * r.cycle_samples;
+    if(r.mappings.size() == 0) unmapped_runs++;
+  }
+
+  forEach(parts.size(), threads, [&](size_t i) {
+    distribute(*parts[i], runs);
+  });
+
+  // Merge each shard of the blocks and functions in parallel. Parts are in run order, so each
+  // run's counts for an entry are added together before the next run starts.
+  vector<location_table<totals>> block_shards(BlockShards);
+  vector<location_table<totals>> function_shards(BlockShards);
+  forEach(2 * BlockShards, threads, [&](size_t n) {
+    size_t shard = n / 2;
+    bool functions = n % 2 == 1;
+    location_table<totals>& table = functions ? function_shards[shard] : block_shards[shard];
+    for(const part* p : parts) {
+      for(const block_sample& s : functions ? p->function_shards[shard] : p->block_shards[shard]) {
+        totals& t = table.get(s.where, s.hash);
+        t.length = s.length;
+        t.add(runs, p->run, s.length, s.cycle_samples, s.inst_samples);
+      }
+    }
+    for(auto& e : table.getEntries()) {
+      e.second.finish(runs);
+    }
+  });
+
+  typedef std::pair<location, totals> entry;
+  vector<entry> blocks;
+  vector<entry> functions;
+  for(size_t shard = 0; shard < BlockShards; shard++) {
+    vector<entry>& b = block_shards[shard].getEntries();
+    vector<entry>& f = function_shards[shard].getEntries();
+    blocks.insert(blocks.end(), b.begin(), b.end());
+    functions.insert(functions.end(), f.begin(), f.end());
+  }
+
+  location_table<totals> loop_table;
+  vector<const experiment*> experiments;
+  for(const part* p : parts) {
+    for(const loop_sample& s : p->loops) {
+      totals& t = loop_table.get(s.where, location_hash()(s.where));
+      t.depth = s.depth;
+      t.block_count = s.block_count;
+      t.add(runs, p->run, 0, s.cycle_samples, s.inst_samples);
+    }
+    for(const experiment& e : p->experiments) {
+      experiments.push_back(&e);
+    }
+  }
+  vector<entry>& loops = loop_table.getEntries();
+  for(entry& l : loops) {
+    l.second.finish(runs);
+  }
+
+  uint64_t inst_samples = 0;
+  for(const entry& b : blocks) {
+    inst_samples += b.second.inst_samples;
+  }
+
+  printf("Runs: %lu, blocks: %lu, loops: %lu, cycle samples: %lu, instruction samples: %lu\n",
+         runs.size(), blocks.size(), loops.size(), all.cycle_samples, inst_samples);
+  if(runs.size() > 1 && unmapped_runs > 0)
+    printf("%lu runs have no mappings, so their blocks are matched by loaded address\n", unmapped_runs);
+  if(runs.size() > 1)
+    printf("Intervals are estimated from the variation between runs\n");
+
+  auto byCycles = [](const entry& e) { return e.second.cycle_samples; };
+
+  printf("\nFunctions by share of cycle samples (95%% confidence intervals)\n");
+  printf("  %7s %20s %10s  %s\n", "share", "interval", "samples", "function");
+  for(size_t i : top(functions, rows, byCycles)) {
+    printShare(functions[i].second, all);
+    printf("  %s (%s)\n", functions[i].first.function.str().c_str(),
+           functions[i].first.file.filename().str().c_str());
+  }
+
+  printf("\nBlocks by share of cycle samples (95%% confidence intervals)\n");
+  printf("  %7s %20s %10s %8s %12s %27s  %s\n", "share", "interval", "samples", "length",
+         "executions", "interval", "block");
+  for(size_t i : top(blocks, rows, byCycles)) {
+    const totals& b = blocks[i].second;
+    double margin = executionsMargin(b, all);
+    printShare(b, all);
+    printf(" %8lu %12.0f [%12.0f, %12.0f]  %s\n", b.length, b.executions,
+           std::max(0.0, b.executions - margin), b.executions + margin, describe(blocks[i].first).c_str());
+  }
+
+  printf("\nBlocks by estimated executions (95%% confidence intervals)\n");
+  printf("  %12s %27s %10s %8s  %s\n", "executions", "interval", "samples", "length", "block");
+  for(size_t i : top(blocks, rows, [](const entry& b) { return b.second.executions; })) {
+    const totals& b = blocks[i].second;
+    double margin = executionsMargin(b, all);
+    printf("  %12.0f [%12.0f, %12.0f] %10lu %8lu  %s\n", b.executions,
+           std::max(0.0, b.executions - margin), b.executions + margin, b.inst_samples, b.length,
+           describe(blocks[i].first).c_str());
+  }
+
+  if(loops.size() > 0) {
+    printf("\nLoops by share of cycle samples, including nested loops (95%% confidence intervals)\n");
+    printf("  %7s %20s %10s %6s %7s  %s\n", "share", "interval", "samples", "depth", "blocks", "header");
+    for(size_t i : top(loops, rows, byCycles)) {
+      const totals& l = loops[i].second;
+      printShare(l, all);
+      printf(" %6lu %7lu  %s\n", l.depth, l.block_count, describe(loops[i].first).c_str());
+    }
+  }
+
+  if(experiments.size() > 0)
+    reportExperiments(experiments, runs.size(), rows);
+
+  reportOverhead(parts, runs);
+
+  return 0;
+}
@@ -0,0 +1,274 @@
+/// Symbolize a profile recorded with CAUSAL_OFFLINE=1. The runtime only writes a snapshot of
+/// loaded files and the sample counts at each raw PC. This tool finds functions and basic blocks
+/// with the runtime's own ELF and disassembly code, reading instructions from the files on disk,
+/// and replaces the raw PC records with the same blockstats records an online run would write.
+///
+/// Usage: causal-symbolize [input [output]]
+/// The input defaults to out.czl and the output to stdout. Other records are copied unchanged.
+/// The runtime doesn't load symbols in offline runs, so the CAUSAL_INCLUDE_* and CAUSAL_EXCLUDE_*
+/// symbol and source filters are read and applied here instead.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../runtime/cfg.h"
+#include "../../runtime/elf.h"
+#include "../../runtime/interval.h"
+#include "../../runtime/log.h"
+#include "../../runtime/options.h"
+#include "../../runtime/scope.h"
+
+using std::string;
+using std::vector;
+
+/// A file that was loaded in the profiled process
+struct mapping {
+  string name;
+  interval range;
+  uintptr_t load_offset;
+  string build_id;
+  size_t retire_time;   ///< When the file was found to be unloaded, or SIZE_MAX if it never was
+};
+
+struct counts {
+  size_t cycles = 0;
+  size_t insts = 0;
+};
+
+/// The samples at one raw PC
+struct pc_samples {
+  uintptr_t pc;
+  counts samples;
+  size_t time;          ///< A time when the file that holds these samples was loaded
+};
+
+/// A basic block with samples, ready to be written out
+struct block_record {
+  string file;
+  const char* function;
+  block_info block;
+  counts samples;
+};
+
+class Symbolizer {
+private:
+  std::ostream& _out;
+  string _debug_dir;
+  ScopeFilter _filter;
+  vector<mapping> _mappings;
+  vector<pc_samples> _pcs;
+  
+  /// Find the file that held a PC's samples: the first file containing the PC that was retired
+  /// after the PC's time, or one that was never retired. Returns SIZE_MAX if there is none.
+  size_t findMapping(const pc_samples& p) const {
+    size_t result = SIZE_MAX;
+    for(size_t i = 0; i < _mappings.size(); i++) {
+      const mapping& m = _mappings[i];
+      if(m.range.contains(p.pc) && m.retire_time >= p.time &&
+         (result == SIZE_MAX || m.retire_time < _mappings[result].retire_time)) {
+        result = i;
+      }
+    }
+    return result;
+  }
+  
+  /// Find the functions and blocks for the sampled PCs in one file. Records are keyed by the
+  /// file's index and the loaded address, which is also the order the runtime writes them in.
+  void symbolize(size_t index, const std::map<uintptr_t, counts>& pcs,
+                 std::map<std::pair<size_t, uintptr_t>, block_record>& records,
+                 vector<std::shared_ptr<ELFFile>>& open_files) {
+    const mapping& m = _mappings[index];
+    
+    // The runtime doesn't attribute samples in these files either
+    if(m.name.find("libcausal") != string::npos || m.name.find("libpapi") != string::npos)
+      return;
+    
+    if(!_filter.includesFile(m.name))
+      return;
+    
+    std::shared_ptr<ELFFile> elf(ELFFile::open(m.name));
+    if(!elf) {
+      WARNING("Skipping file %s", m.name.c_str());
+      return;
+    }
+    
+    if(!m.build_id.empty() && elf->getBuildID() != m.build_id) {
+      WARNING("Skipping file %s, which has changed since it was profiled", m.name.c_str());
+      return;
+    }
+    
+    std::shared_ptr<ELFFile> debug(elf->openDebugFile(m.name, _debug_dir));
+    function_table functions = elf->getFunctions(debug.get());
+    wrapped_array<function_table::function> fns = functions.getFunctions();
+    
+    // Function names point into the mapped files, so keep them open until the output is written
+    open_files.push_back(elf);
+    if(debug) open_files.push_back(debug);
+    
+    // Read code and jump tables from the file, translating loaded addresses to link-time addresses
+    cfg::memory_reader read = [&](interval r) {
+      return elf->getLoadedData(interval(r.getBase() - m.load_offset, r.getLimit() - m.load_offset));
+    };
+    
+    const function_table::function* current_fn = NULL;
+    vector<block_info> blocks;
+    
+    for(const auto& p : pcs) {
+      uintptr_t link_pc = p.first - m.load_offset;
+      
+      if(current_fn == NULL || !current_fn->range.contains(link_pc)) {
+        // Find the function containing this PC. Samples outside any function are dropped.
+        function_table::function* begin = &fns[0];
+        function_table::function* end = begin + fns.size();
+        function_table::function* fn = std::upper_bound(begin, end, link_pc,
+          [](uintptr_t pc, const function_table::function& f) { return pc < f.range.getLimit(); });
+        if(fn == end || !fn->range.contains(link_pc))
+          continue;
+        
+        current_fn = fn;
+        blocks.clear();
+        
+        // Samples in functions out of scope are dropped, as they would be in an online run
+        auto aliases = functions.getAliases(*fn);
+        if(_filter.includesFunction(fn->name, aliases, fn->source)) {
+          blocks = cfg::findBlocks(fn->range + m.load_offset, read);
+          if(blocks.size() == 0)
+            WARNING("No code for function %s in %s", fn->name, m.name.c_str());
+        }
+      }
+      
+      for(const block_info& b : blocks) {
+        if(b.range.contains(p.first)) {
+          block_record& r = records.emplace(std::make_pair(index, b.range.getBase()),
+            block_record{ m.name, current_fn->name, b, counts() }).first->second;
+          r.samples.cycles += p.second.cycles;
+          r.samples.insts += p.second.insts;
+          break;
+        }
+      }
+    }
+  }
+  
+public:
+  Symbolizer(std::ostream& out, const string& debug_dir, const ScopeFilter& filter) :
+    _out(out), _debug_dir(debug_dir), _filter(filter) {}
+  
+  void addMapping(const mapping& m) {
+    _mappings.push_back(m);
+  }
+  
+  void addPC(const pc_samples& p) {
+    _pcs.push_back(p);
+  }
+  
+  /// Write blockstats for the current run and start over
+  void finish() {
+    // Total the samples at each PC in each file
+    vector<std::map<uintptr_t, counts>> pcs(_mappings.size());
+    for(const pc_samples& p : _pcs) {
+      size_t i = findMapping(p);
+      if(i == SIZE_MAX)
+        continue;
+      counts& c = pcs[i][p.pc];
+      c.cycles += p.samples.cycles;
+      c.insts += p.samples.insts;
+    }
+    
+    // Records are written file by file, live files first, in address order like the runtime
+    std::map<std::pair<size_t, uintptr_t>, block_record> records;
+    vector<std::shared_ptr<ELFFile>> open_files;
+    for(size_t i = 0; i < _mappings.size(); i++) {
+      if(pcs[i].size() > 0)
+        symbolize(i, pcs[i], records, open_files);
+    }
+    
+    for(const auto& i : records) {
+      const block_record& r = i.second;
+      _out << "blockstats\t" << r.file << "\t" << r.function << "\t" << r.block.range << "\t"
+           << r.block.length << "\t" << r.samples.cycles << "\t" << r.samples.insts << "\n";
+    }
+    
+    _mappings.clear();
+    _pcs.clear();
+  }
+};
+
+static vector<string> split(const string& line) {
+  vector<string> parts;
+  std::istringstream s(line);
+  string part;
+  while(std::getline(s, part, '\t')) {
+    parts.push_back(part);
+  }
+  return parts;
+}
+
+int main(int argc, char** argv) {
+  if(argc > 3) {
+    fprintf(stderr, "Usage: %s [input [output]]\n", argv[0]);
+    return 1;
+  }
+  
+  const char* input_name = argc > 1 ? argv[1] : "out.czl";
+  std::ifstream input(input_name);
+  if(!input.is_open()) {
+    fprintf(stderr, "Failed to open %s\n", input_name);
+    return 1;
+  }
+  
+  std::ofstream output_file;
+  if(argc > 2) {
+    output_file.open(argv[2]);
+    if(!output_file.is_open()) {
+      fprintf(stderr, "Failed to open %s for output\n", argv[2]);
+      return 1;
+    }
+  }
+  std::ostream& output = argc > 2 ? output_file : std::cout;
+  
+  Symbolizer symbolizer(output, options::getString("CAUSAL_DEBUG_DIR", "/usr/lib/debug"),
+                        ScopeFilter::fromOptions());
+  
+  string line;
+  while(std::getline(input, line)) {
+    vector<string> parts = split(line);
+    
+    // Profiles written before retire and sample times were recorded treat every file as live,
+    // so the first listed file containing a PC wins
+    if((parts.size() == 6 || parts.size() == 7) && parts[0] == "mapping") {
+      uintptr_t base = strtoull(parts[2].c_str(), NULL, 16);
+      uintptr_t limit = strtoull(parts[3].c_str(), NULL, 16);
+      uintptr_t load_offset = strtoull(parts[4].c_str(), NULL, 16);
+      string build_id = parts[5] == "-" ? "" : parts[5];
+      size_t retire_time = parts.size() == 6 || parts[6] == "-" ? SIZE_MAX : strtoull(parts[6].c_str(), NULL, 10);
+      symbolizer.addMapping(mapping{ parts[1], interval(base, limit), load_offset, build_id, retire_time });
+      // Keep the mapping so tools can match blocks across runs by build-id and offset
+      output << line << "\n";
+      
+    } else if((parts.size() == 4 || parts.size() == 5) && parts[0] == "pcstats") {
+      pc_samples p;
+      p.pc = strtoull(parts[1].c_str(), NULL, 16);
+      p.samples.cycles = strtoull(parts[2].c_str(), NULL, 10);
+      p.samples.insts = strtoull(parts[3].c_str(), NULL, 10);
+      p.time = parts.size() == 5 ? strtoull(parts[4].c_str(), NULL, 10) : 0;
+      symbolizer.addPC(p);
+      
+    } else {
+      // Each run starts with a basename record, so finish the previous run first
+      if(parts.size() > 0 && parts[0] == "basename")
+        symbolizer.finish();
+      output << line << "\n";
+    }
+  }
+  
+  symbolizer.finish();
+  return 0;
+}
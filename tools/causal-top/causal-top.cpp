@@ -0,0 +1,156 @@
+/// Watch a running program's live statistics (written with CAUSAL_STATS). Shows sample totals
+/// and rates, the running speedup experiment, progress counters and their rates, and the
+/// busiest threads. The statistics are read from shared memory, so the program isn't
+/// interrupted.
+///
+/// Usage: causal-top [-d seconds] [-n count] [-1] path
+/// `-d` sets the refresh interval (default 1), `-n` limits the thread table to `count` rows
+/// (default 10), and `-1` prints the statistics once and exits. The screen is only cleared
+/// between refreshes when the output is a terminal.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "../../runtime/stats.h"
+#include "../../runtime/util.h"
+
+using std::vector;
+
+enum {
+  DefaultRows = 10
+};
+
+/// Get a counter's rate per second between two snapshots
+static double getRate(uint64_t now, uint64_t before, uint64_t elapsed) {
+  if(elapsed == 0 || now < before)
+    return 0;
+  return (double)(now - before) * Time_s / elapsed;
+}
+
+static void print(const stats::segment& s, const stats::segment* previous, size_t rows) {
+  uint64_t elapsed = previous != NULL ? s.update_time - previous->update_time : 0;
+  uint64_t uptime = s.update_time - s.start_time;
+
+  const char* state = s.finished ? "finished" : s.paused ? "paused" : "sampling";
+  printf("pid %lu  %s  up %.1fs\n", (unsigned long)s.pid, state, (double)uptime / Time_s);
+  printf("samples %lu (%.0f/s)  dropped %lu  filtered %lu  pending blocks %lu  deferred functions %lu\n",
+         (unsigned long)s.samples, previous != NULL ? getRate(s.samples, previous->samples, elapsed) : 0.0,
+         (unsigned long)s.dropped_samples, (unsigned long)s.filtered_samples,
+         (unsigned long)s.pending_blocks, (unsigned long)s.deferred_functions);
+
+  printf("experiments %lu", (unsigned long)s.experiments);
+  if(s.experiment.running) {
+    printf("  running: %s %s in %s at %#lx (%.1fs)", s.experiment.kind, s.experiment.function,
+           s.experiment.file, (unsigned long)s.experiment.base,
+           (double)(s.update_time - s.experiment.start_time) / Time_s);
+  }
+  printf("\n");
+
+  if(s.counter_count > 0) {
+    printf("\n%-60s %16s %12s\n", "progress counter", "value", "per second");
+    for(size_t i = 0; i < s.counter_count; i++) {
+      const stats::counter_record& c = s.counters[i];
+      double rate = 0;
+      if(previous != NULL && i < previous->counter_count && strcmp(previous->counters[i].name, c.name) == 0)
+        rate = getRate(c.value, previous->counters[i].value, elapsed);
+      printf("%-60s %16lu %12.1f\n", c.name, (unsigned long)c.value, rate);
+    }
+  }
+
+  // Show the threads with the highest sample rates
+  vector<const stats::thread_record*> threads;
+  for(size_t i = 0; i < s.thread_count; i++) {
+    threads.push_back(&s.threads[i]);
+  }
+  std::stable_sort(threads.begin(), threads.end(), [](const stats::thread_record* a, const stats::thread_record* b) {
+    return a->rate > b->rate;
+  });
+
+  if(threads.size() > 0) {
+    printf("\n%-10s %16s %12s\n", "thread", "samples", "per second");
+    for(size_t i = 0; i < threads.size() && i < rows; i++) {
+      printf("%-10lu %16lu %12lu\n", (unsigned long)threads[i]->tid, (unsigned long)threads[i]->samples,
+             (unsigned long)threads[i]->rate);
+    }
+    if(threads.size() > rows)
+      printf("(%lu more threads)\n", (unsigned long)(threads.size() - rows));
+  }
+}
+
+int main(int argc, char** argv) {
+  double delay = 1;
+  size_t rows = DefaultRows;
+  bool once = false;
+  const char* path = NULL;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      delay = strtod(argv[++i], NULL);
+    } else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      rows = strtoul(argv[++i], NULL, 10);
+    } else if(strcmp(argv[i], "-1") == 0) {
+      once = true;
+    } else if(argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+
+  if(path == NULL || delay <= 0) {
+    fprintf(stderr, "Usage: %s [-d seconds] [-n count] [-1] path\n", argv[0]);
+    return 1;
+  }
+
+  const stats::segment* shared = stats::open(path);
+  if(shared == NULL) {
+    fprintf(stderr, "Failed to open statistics file %s\n", path);
+    return 1;
+  }
+
+  bool terminal = isatty(STDOUT_FILENO);
+  std::unique_ptr<stats::segment> current(new stats::segment());
+  std::unique_ptr<stats::segment> previous;
+
+  while(true) {
+    if(!stats::read(shared, *current)) {
+      fprintf(stderr, "Timed out waiting for a consistent snapshot\n");
+      return 1;
+    }
+
+    if(terminal && !once) printf("\033[H\033[2J");
+    else if(previous) printf("\n");
+    print(*current, previous.get(), rows);
+    fflush(stdout);
+
+    if(once || current->finished)
+      break;
+    // A program killed before it could mark the statistics finished leaves them unchanging
+    if(kill(current->pid, 0) == -1 && errno == ESRCH) {
+      printf("process %lu has exited\n", (unsigned long)current->pid);
+      break;
+    }
+
+    if(!previous) previous.reset(new stats::segment());
+    std::swap(previous, current);
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)delay;
+    ts.tv_nsec = (long)((delay - ts.tv_sec) * Time_s);
+    nanosleep(&ts, NULL);
+  }
+
+  stats::detach(shared);
+  return 0;
+}
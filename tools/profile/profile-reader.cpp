@@ -0,0 +1,226 @@
+#include "profile-reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <ostream>
+
+#include "../../runtime/log.h"
+
+namespace profile {
+  /// Record sizes for each section type in this version of the format
+  static size_t getRecordSize(uint32_t type) {
+    switch(type) {
+      case Strings: return 1;
+      case Mappings: return sizeof(mapping_record);
+      case PCs: return sizeof(pc_record);
+      case Blocks: return sizeof(block_record);
+      case Loops: return sizeof(loop_record);
+      case Experiments: return sizeof(experiment_record);
+      case Progress: return sizeof(uint64_t);
+      case Run: return sizeof(run_record);
+      case Overhead: return sizeof(overhead_record);
+      case MappingTimes: return sizeof(uint64_t);
+      case PCTimes: return sizeof(uint64_t);
+      default: return 0;
+    }
+  }
+
+  bool segment::validate(const uint8_t* base, size_t size) {
+    if(size < sizeof(header))
+      return false;
+
+    const header* h = reinterpret_cast<const header*>(base);
+    if(memcmp(h->magic, Magic, sizeof(Magic)) != 0 || h->version != Version ||
+       h->size < sizeof(header) || h->size > size || h->index_offset > h->size ||
+       h->section_count > (h->size - h->index_offset) / sizeof(index_entry))
+      return false;
+
+    const index_entry* index = reinterpret_cast<const index_entry*>(base + h->index_offset);
+    bool has_strings = false;
+    for(size_t i = 0; i < h->section_count; i++) {
+      const index_entry& e = index[i];
+      size_t record_size = getRecordSize(e.type);
+
+      // Unknown sections are skipped, but known sections must match this version's records
+      if(record_size == 0)
+        continue;
+      if(e.record_size != record_size || e.offset > h->size ||
+         e.count > (h->size - e.offset) / record_size || e.offset % sizeof(uint64_t) != 0)
+        return false;
+
+      // The string table must end with a terminator, and offset zero is the empty string
+      if(e.type == Strings) {
+        if(e.count == 0 || base[e.offset + e.count - 1] != '\0')
+          return false;
+        has_strings = true;
+      }
+    }
+
+    return has_strings;
+  }
+
+  const index_entry* segment::getSection(uint32_t type) const {
+    for(size_t i = 0; i < _header->section_count; i++) {
+      if(_index[i].type == type)
+        return &_index[i];
+    }
+    return NULL;
+  }
+
+  const char* segment::getString(uint32_t offset) const {
+    const index_entry* e = getSection(Strings);
+    if(offset >= e->count)
+      return "";
+    return reinterpret_cast<const char*>(_base + e->offset + offset);
+  }
+
+  wrapped_array<const uint64_t> segment::getProgress(const experiment_record& r) const {
+    wrapped_array<const uint64_t> all = getRecords<uint64_t>(Progress);
+    if(r.first_progress > all.size() || r.progress_count > all.size() - r.first_progress)
+      return wrapped_array<const uint64_t>(NULL, 0);
+    return all.slice(r.first_progress, r.first_progress + r.progress_count);
+  }
+
+  const run_record* segment::getRun() const {
+    wrapped_array<const run_record> runs = getRecords<run_record>(Run);
+    return runs.size() > 0 ? &runs[0] : NULL;
+  }
+
+  static std::ostream& writeRange(std::ostream& os, uint64_t base, uint64_t limit) {
+    return os << std::hex << "0x" << base << "\t0x" << limit << std::dec;
+  }
+
+  void segment::writeText(std::ostream& out) const {
+    out << "basename\t" << getBasename() << "\n";
+    out << "cycle period\t" << getCyclePeriod() << "\n";
+    out << "instruction period\t" << getInstructionPeriod() << "\n";
+
+    const run_record* run = getRun();
+    if(run != NULL) {
+      out << "command\t" << getString(run->command) << "\n";
+      out << "host\t" << getString(run->host) << "\n";
+      out << "pid\t" << run->pid << "\n";
+      out << "start time\t" << run->start_time << "\n";
+      out << "end time\t" << run->end_time << "\n";
+      out << "threads\t" << run->threads << "\n";
+    }
+
+    // Times are only written if every record has one, so causal-symbolize treats profiles
+    // without them the same way whether they were converted or not
+    wrapped_array<const mapping_record> mappings = getMappings();
+    wrapped_array<const uint64_t> mapping_times = getMappingTimes();
+    bool has_mapping_times = mapping_times.size() == mappings.size();
+    for(size_t i = 0; i < mappings.size(); i++) {
+      const mapping_record& m = mappings[i];
+      const char* build_id = getString(m.build_id);
+      out << "mapping\t" << getString(m.name) << "\t";
+      writeRange(out, m.base, m.limit) << "\t0x" << std::hex << m.load_offset << std::dec << "\t"
+        << (build_id[0] == '\0' ? "-" : build_id);
+      if(has_mapping_times) {
+        if(mapping_times[i] == 0) out << "\t-";
+        else out << "\t" << mapping_times[i];
+      }
+      out << "\n";
+    }
+
+    wrapped_array<const pc_record> pcs = getPCs();
+    wrapped_array<const uint64_t> pc_times = getPCTimes();
+    bool has_pc_times = pc_times.size() == pcs.size();
+    for(size_t i = 0; i < pcs.size(); i++) {
+      const pc_record& p = pcs[i];
+      out << "pcstats\t0x" << std::hex << p.pc << std::dec << "\t"
+          << p.cycle_samples << "\t" << p.inst_samples;
+      if(has_pc_times) out << "\t" << pc_times[i];
+      out << "\n";
+    }
+
+    for(const block_record& b : getBlocks()) {
+      out << "blockstats\t" << getString(b.file) << "\t" << getString(b.function) << "\t";
+      writeRange(out, b.base, b.limit) << "\t" << b.length << "\t"
+        << b.cycle_samples << "\t" << b.inst_samples << "\n";
+    }
+
+    for(const loop_record& l : getLoops()) {
+      out << "loopstats\t" << getString(l.file) << "\t" << getString(l.function) << "\t";
+      writeRange(out, l.base, l.limit) << "\t" << l.depth << "\t" << l.block_count << "\t"
+        << l.cycle_samples << "\t" << l.inst_samples << "\n";
+    }
+
+    for(const experiment_record& e : getExperiments()) {
+      out << "experiment\t" << getString(e.kind) << "\t" << getString(e.file) << "\t"
+          << getString(e.function) << "\t";
+      writeRange(out, e.base, e.limit) << "\t" << e.range_count << "\t" << e.duration << "\t"
+        << e.delay_size << "\t" << e.delays;
+      for(uint64_t p : getProgress(e)) {
+        out << "\t" << p;
+      }
+      out << "\n";
+    }
+
+    for(const overhead_record& o : getOverhead()) {
+      out << "overhead\t" << getString(o.category) << "\t" << o.count << "\t" << o.nanos << "\n";
+    }
+  }
+
+  reader::~reader() {
+    if(munmap(const_cast<uint8_t*>(_data), _size) == -1)
+      WARNING("Failed to unmap profile");
+    if(close(_fd) == -1)
+      WARNING("Failed to close profile");
+  }
+
+  bool reader::isProfile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd == -1)
+      return false;
+    char magic[sizeof(Magic)];
+    bool result = read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, Magic, sizeof(Magic)) == 0;
+    close(fd);
+    return result;
+  }
+
+  reader* reader::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd == -1)
+      return NULL;
+
+    struct stat sb;
+    if(fstat(fd, &sb) == -1 || sb.st_size == 0) {
+      close(fd);
+      return NULL;
+    }
+
+    size_t size = sb.st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+      WARNING("Failed to map profile %s", path.c_str());
+      close(fd);
+      return NULL;
+    }
+
+    reader* r = new reader(fd, size, (const uint8_t*)data);
+
+    // Walk the segments. Each one records its own size.
+    size_t offset = 0;
+    while(offset < size) {
+      if(!segment::validate(r->_data + offset, size - offset)) {
+        WARNING("Ignoring invalid profile data at offset %lu in %s", offset, path.c_str());
+        break;
+      }
+      r->_segments.emplace_back(r->_data + offset);
+      offset += r->_segments.back().getSize();
+    }
+
+    if(r->_segments.size() == 0) {
+      delete r;
+      return NULL;
+    }
+
+    return r;
+  }
+}
@@ -0,0 +1,102 @@
+#if !defined(CAUSAL_TOOLS_PROFILE_READER_H)
+#define CAUSAL_TOOLS_PROFILE_READER_H
+
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "../../runtime/profile.h"
+#include "../../runtime/util.h"
+
+/// Read-only access to binary profiles. The file is mapped into memory and records are used
+/// in place, so opening a profile only reads the segment headers and indexes.
+namespace profile {
+  /// The records from one run
+  class segment {
+  private:
+    const uint8_t* _base;
+    const header* _header;
+    const index_entry* _index;
+
+    /// Find a section by type. Returns NULL if the segment doesn't have one.
+    const index_entry* getSection(uint32_t type) const;
+
+    template<typename T> wrapped_array<const T> getRecords(uint32_t type) const {
+      const index_entry* e = getSection(type);
+      if(e == NULL) return wrapped_array<const T>(NULL, 0);
+      return wrapped_array<const T>(reinterpret_cast<const T*>(_base + e->offset), e->count);
+    }
+
+  public:
+    segment(const uint8_t* base) : _base(base), _header(reinterpret_cast<const header*>(base)),
+        _index(reinterpret_cast<const index_entry*>(base + _header->index_offset)) {}
+
+    /// Check that a segment's header, index, and sections fit in `size` bytes. Sections with
+    /// the wrong record size for this version of the format are rejected.
+    static bool validate(const uint8_t* base, size_t size);
+
+    const char* getBasename() const { return getString(_header->basename); }
+    uint64_t getCyclePeriod() const { return _header->cycle_period; }
+    uint64_t getInstructionPeriod() const { return _header->inst_period; }
+    size_t getSize() const { return _header->size; }
+    /// Get the raw bytes of the segment, for copying it to another profile
+    const uint8_t* getData() const { return _base; }
+
+    /// Get a string by its offset in the string table. Bad offsets give the empty string.
+    const char* getString(uint32_t offset) const;
+
+    wrapped_array<const mapping_record> getMappings() const { return getRecords<mapping_record>(Mappings); }
+    wrapped_array<const pc_record> getPCs() const { return getRecords<pc_record>(PCs); }
+    wrapped_array<const block_record> getBlocks() const { return getRecords<block_record>(Blocks); }
+    wrapped_array<const loop_record> getLoops() const { return getRecords<loop_record>(Loops); }
+    wrapped_array<const experiment_record> getExperiments() const {
+      return getRecords<experiment_record>(Experiments);
+    }
+    wrapped_array<const overhead_record> getOverhead() const { return getRecords<overhead_record>(Overhead); }
+
+    /// Get the retire time of each mapping, parallel to getMappings(). Zero means the file was
+    /// still loaded. Profiles written before retire times were recorded have no entries.
+    wrapped_array<const uint64_t> getMappingTimes() const { return getRecords<uint64_t>(MappingTimes); }
+    /// Get the time of the latest sample at each PC, parallel to getPCs()
+    wrapped_array<const uint64_t> getPCTimes() const { return getRecords<uint64_t>(PCTimes); }
+
+    /// Get the progress counter deltas recorded for an experiment
+    wrapped_array<const uint64_t> getProgress(const experiment_record& e) const;
+
+    /// Get the description of the profiled process, or NULL if the segment doesn't have one
+    const run_record* getRun() const;
+
+    /// Write the segment as a run in the text profile format
+    void writeText(std::ostream& out) const;
+  };
+
+  /// A memory-mapped profile with one or more segments
+  class reader {
+  private:
+    int _fd;
+    size_t _size;
+    const uint8_t* _data;
+    std::vector<segment> _segments;
+
+    reader(int fd, size_t size, const uint8_t* data) : _fd(fd), _size(size), _data(data) {}
+
+  public:
+    /// Delete the copy constructor
+    reader(const reader&) = delete;
+
+    ~reader();
+
+    const std::vector<segment>& getSegments() const { return _segments; }
+
+    /// Check if a file starts with the binary profile magic
+    static bool isProfile(const std::string& path);
+
+    /// Open a profile. Returns NULL if the file can't be mapped or its first segment is invalid.
+    /// A damaged segment after the first, such as a run cut off while writing, ends the profile.
+    static reader* open(const std::string& path);
+  };
+}
+
+#endif